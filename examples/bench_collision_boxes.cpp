@@ -0,0 +1,202 @@
+/*
+    Compares CollisionBoxes (a sorted cell list, where any number of robots
+    can share a box) to the fixed number of slots per box it replaced, for
+    arenas with more and more of their area covered by robots
+
+    Usage: bench_collision_boxes [num_robots]
+*/
+
+#include "CollisionBoxes.h"
+#include "Timer.hpp"
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <vector>
+
+namespace Kilosim
+{
+// The previous design: every box has the same number of slots. Robots that
+// don't fit in their box are left out (the original only checked this with
+// an assert, so they overwrote the next box instead).
+class FixedSlotBoxes
+{
+private:
+  const int cddx[9] = {0, -1, -1, 0, 1, 1, 1, 0, -1};
+  const int cddy[9] = {0, 0, -1, -1, -1, 0, 1, 1, 1};
+  int PSIZE; //Maximum number of agents in a cell
+  std::vector<int> agent_positions;
+  std::vector<int> cells_used;
+  double diameter;
+  int bwidth;
+  int bheight;
+
+public:
+  //! Agents that didn't fit in their box in the last update()
+  int num_dropped = 0;
+
+  FixedSlotBoxes(const double width0, const double height0, const double diameter0,
+                 const int cell_capacity = 4)
+  {
+    diameter = diameter0;
+    PSIZE = cell_capacity;
+    bwidth = std::ceil(width0 / diameter);
+    bheight = std::ceil(height0 / diameter);
+    agent_positions.resize(PSIZE * bwidth * bheight, -1);
+  }
+
+  void reserve(const size_t num_agents)
+  {
+    cells_used.reserve(num_agents);
+  }
+
+  void update(const aligned_vector<double> &xs, const aligned_vector<double> &ys)
+  {
+    for (const auto &p : cells_used)
+      agent_positions[p] = -1;
+    cells_used.clear();
+    num_dropped = 0;
+
+    for (unsigned int a = 0; a < xs.size(); a++)
+    {
+      const int binx = std::min((int)(xs[a] / diameter), bwidth - 1);
+      const int biny = std::min((int)(ys[a] / diameter), bheight - 1);
+      const int idx0 = PSIZE * (biny * bwidth + binx);
+      int idx = idx0;
+      for (; idx < idx0 + PSIZE; idx++)
+        if (agent_positions[idx] == -1)
+          break;
+      if (idx == idx0 + PSIZE)
+      {
+        num_dropped++;
+        continue;
+      }
+      agent_positions[idx] = a;
+      cells_used.emplace_back(idx);
+    }
+  }
+
+  template <class F>
+  void considerNeighbours(const double x, const double y, F func) const
+  {
+    const int cbinx = x / diameter;
+    const int cbiny = y / diameter;
+    for (unsigned int nbi = 0; nbi <= 8; nbi++)
+    {
+      const int binx = cbinx + cddx[nbi];
+      const int biny = cbiny + cddy[nbi];
+      if (binx < 0 || biny < 0 || binx >= bwidth || biny >= bheight)
+        continue;
+      const int *const idx0 = &agent_positions[PSIZE * (biny * bwidth + binx)];
+      for (const int *idx = idx0; idx < idx0 + PSIZE; idx++)
+      {
+        if (*idx == -1)
+          continue;
+        if (!func(*idx))
+          return;
+      }
+    }
+  }
+};
+} // namespace Kilosim
+
+namespace
+{
+const double ROBOT_RADIUS = 16.5;
+const double CONTACT_SQ = 4 * ROBOT_RADIUS * ROBOT_RADIUS;
+const int REPS = 50;
+
+// Time rebuilding the boxes and then finding every robot's contacts (ms per
+// rebuild). The number of contacts found is saved in `contacts`.
+double time_cell_list(Kilosim::CollisionBoxes &boxes, const Kilosim::aligned_vector<double> &xs,
+                      const Kilosim::aligned_vector<double> &ys, long &contacts)
+{
+    Timer timer;
+    timer.start();
+    for (int rep = 0; rep < REPS; rep++)
+    {
+        contacts = 0;
+        boxes.update(xs, ys);
+        for (size_t i = 0; i < xs.size(); i++)
+        {
+            boxes.considerNeighbours(xs[i], ys[i], [&](const unsigned int j, const double x, const double y) {
+                const double dx = xs[i] - x;
+                const double dy = ys[i] - y;
+                if (j != i && dx * dx + dy * dy < CONTACT_SQ)
+                    contacts++;
+                return true;
+            });
+        }
+    }
+    timer.stop();
+    return timer.accumulated() * 1000 / REPS;
+}
+
+double time_fixed_slots(Kilosim::FixedSlotBoxes &boxes, const Kilosim::aligned_vector<double> &xs,
+                        const Kilosim::aligned_vector<double> &ys, long &contacts)
+{
+    Timer timer;
+    timer.start();
+    for (int rep = 0; rep < REPS; rep++)
+    {
+        contacts = 0;
+        boxes.update(xs, ys);
+        for (size_t i = 0; i < xs.size(); i++)
+        {
+            boxes.considerNeighbours(xs[i], ys[i], [&](const int j) {
+                const double dx = xs[i] - xs[j];
+                const double dy = ys[i] - ys[j];
+                if ((size_t)j != i && dx * dx + dy * dy < CONTACT_SQ)
+                    contacts++;
+                return true;
+            });
+        }
+    }
+    timer.stop();
+    return timer.accumulated() * 1000 / REPS;
+}
+} // namespace
+
+int main(int argc, char *argv[])
+{
+    const int num_robots = (argc > 1) ? atoi(argv[1]) : 20000;
+    printf("%d robots of radius %g mm, %d rebuilds and neighbour queries\n",
+           num_robots, ROBOT_RADIUS, REPS);
+    printf("coverage  max/box  cell list (contacts)   fixed slots (contacts, robots dropped)\n");
+    for (const double coverage : {0.05, 0.3, 0.9})
+    {
+        // Scatter the robots uniformly over an arena sized for the coverage
+        const double side = std::sqrt(num_robots * PI * ROBOT_RADIUS * ROBOT_RADIUS / coverage);
+        std::mt19937_64 rng(1);
+        std::uniform_real_distribution<double> uniform(0, side);
+        Kilosim::aligned_vector<double> xs(num_robots), ys(num_robots);
+        for (int i = 0; i < num_robots; i++)
+        {
+            xs[i] = uniform(rng);
+            ys[i] = uniform(rng);
+        }
+
+        const double box_size = 2 * ROBOT_RADIUS;
+        const int boxes_across = std::ceil(side / box_size);
+        std::vector<int> occupancy(boxes_across * boxes_across);
+        int max_per_box = 0;
+        for (int i = 0; i < num_robots; i++)
+        {
+            const int box = (int)(ys[i] / box_size) * boxes_across + (int)(xs[i] / box_size);
+            max_per_box = std::max(max_per_box, ++occupancy[box]);
+        }
+
+        Kilosim::CollisionBoxes cell_list(side, side, box_size);
+        cell_list.reserve(num_robots);
+        Kilosim::FixedSlotBoxes fixed_slots(side, side, box_size);
+        fixed_slots.reserve(num_robots);
+        long cell_list_contacts, fixed_slot_contacts;
+        const double cell_list_ms = time_cell_list(cell_list, xs, ys, cell_list_contacts);
+        const double fixed_slots_ms = time_fixed_slots(fixed_slots, xs, ys, fixed_slot_contacts);
+
+        printf("%7.0f%%  %7d  %6.2f ms (%7ld)   %6.2f ms (%7ld, %d)\n",
+               coverage * 100, max_per_box, cell_list_ms, cell_list_contacts,
+               fixed_slots_ms, fixed_slot_contacts, fixed_slots.num_dropped);
+    }
+    return 0;
+}
@@ -0,0 +1,134 @@
+/*
+    Compares finding message receivers with the neighbour grid (used when
+    robots report a communication range) to checking every pair of robots
+    (used when they don't), and checks that both deliver the same messages in
+    the same order
+
+    Usage: bench_communicate [num_robots]
+*/
+
+#include "World.h"
+#include "Kilobot.h"
+#include "Timer.hpp"
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <limits>
+#include <memory>
+#include <vector>
+
+namespace Kilosim
+{
+// Sends its index, and keeps a checksum of every message it receives (in
+// order) and of how many of its messages were received
+class ChecksumBot : public Kilobot
+{
+public:
+  uint16_t index = 0;
+  uint64_t checksum = 14695981039346656037ull;
+  uint64_t num_received = 0;
+
+private:
+  message_t m_message;
+
+  void add(const uint64_t value)
+  {
+    checksum = (checksum ^ value) * 1099511628211ull;
+  }
+
+  void setup()
+  {
+    m_message.type = NORMAL;
+    m_message.data[0] = index & 0xFF;
+    m_message.data[1] = index >> 8;
+    m_message.crc = message_crc(&m_message);
+  }
+  void loop() {}
+  void message_rx(message_t *message, distance_measurement_t *distance_measurement)
+  {
+    num_received++;
+    add(message->data[0] | (message->data[1] << 8));
+    add(*distance_measurement * 1000);
+  }
+  // Only some of the robots transmit
+  message_t *message_tx()
+  {
+    return (index % 3 != 0) ? &m_message : NULL;
+  }
+  void message_tx_success()
+  {
+    add(0xFFFFFFFF);
+  }
+};
+
+// Doesn't report its communication range, so the World checks every pair
+class AllPairsBot : public ChecksumBot
+{
+public:
+  double comm_range() const
+  {
+    return std::numeric_limits<double>::max();
+  }
+};
+} // namespace Kilosim
+
+// Run a World of robots for a few communication ticks and return the time per
+// step. The checksum of what every robot received is saved in `checksums`, and
+// the number of messages received in `num_received`.
+template <typename Bot>
+double run(const int num_robots, std::vector<uint64_t> &checksums,
+           uint64_t &num_received)
+{
+    // Same density of robots for any number of them
+    const double width = 3000 * std::sqrt(num_robots / 2000.0);
+    seed_rand(5);
+    Kilosim::World world(width, width);
+    std::vector<std::unique_ptr<Bot>> robots;
+    for (int i = 0; i < num_robots; i++)
+    {
+        robots.emplace_back(new Bot());
+        robots.back()->index = i;
+        world.add_robot(robots.back().get());
+        robots.back()->robot_init(uniform_rand_real(20, width - 20),
+                                  uniform_rand_real(20, width - 20), 0);
+    }
+
+    // Messages are sent every 3 ticks
+    const int num_steps = 30;
+    Timer timer;
+    timer.start();
+    for (int t = 0; t < num_steps; t++)
+    {
+        world.step();
+    }
+    timer.stop();
+
+    checksums.clear();
+    num_received = 0;
+    for (const auto &r : robots)
+    {
+        checksums.push_back(r->checksum);
+        num_received += r->num_received;
+    }
+    return timer.accumulated() * 1000 / num_steps;
+}
+
+int main(int argc, char *argv[])
+{
+    const int num_robots = (argc > 1) ? atoi(argv[1]) : 2000;
+    std::vector<uint64_t> grid_checksums, all_pairs_checksums;
+    uint64_t num_received;
+    const double grid_ms = run<Kilosim::ChecksumBot>(num_robots, grid_checksums, num_received);
+    const double all_pairs_ms = run<Kilosim::AllPairsBot>(num_robots, all_pairs_checksums,
+                                                          num_received);
+
+    printf("%d robots: grid %.3f ms/step, all pairs %.3f ms/step (%lu messages received)\n",
+           num_robots, grid_ms, all_pairs_ms, (unsigned long)num_received);
+    if (grid_checksums != all_pairs_checksums)
+    {
+        printf("FAILED: the messages received are different\n");
+        return 1;
+    }
+    printf("OK\n");
+    return 0;
+}
@@ -0,0 +1,66 @@
+/*
+    Checks that both broad phases give the same simulation, including when
+    the World is empty
+*/
+
+#include "World.h"
+#include "MyKilobot.cpp"
+#include <cmath>
+#include <cstdio>
+#include <memory>
+#include <vector>
+
+// Step an empty World, and then one with robots in it, and return the final
+// positions of the robots
+std::vector<double> run(const Kilosim::BroadPhase broad_phase)
+{
+    Kilosim::World empty(2400.0, 2400.0, "", 0, broad_phase);
+    for (int t = 0; t < 10; t++)
+    {
+        empty.step();
+    }
+
+    // The robots' IDs and the World's seed come from the global random numbers
+    seed_rand(1);
+    Kilosim::World world(2400.0, 2400.0, "", 0, broad_phase);
+    std::vector<std::unique_ptr<Kilosim::MyKilobot>> robots;
+    for (int n = 0; n < 400; n++)
+    {
+        robots.emplace_back(new Kilosim::MyKilobot());
+        world.add_robot(robots.back().get());
+        robots.back()->robot_init((n / 20) * 100 + 75, (n % 20) * 100 + 75, PI * n / 2);
+    }
+    while (world.get_time() < 30)
+    {
+        world.step();
+    }
+
+    std::vector<double> positions;
+    for (const auto &r : robots)
+    {
+        positions.push_back(r->x);
+        positions.push_back(r->y);
+        positions.push_back(r->theta);
+    }
+    return positions;
+}
+
+int main(int argc, char *argv[])
+{
+    const std::vector<double> grid = run(Kilosim::BROAD_PHASE_GRID);
+    const std::vector<double> hash = run(Kilosim::BROAD_PHASE_HASH);
+
+    double max_diff = 0;
+    for (size_t i = 0; i < grid.size(); i++)
+    {
+        max_diff = std::max(max_diff, std::abs(grid[i] - hash[i]));
+    }
+    printf("Largest difference between the broad phases: %g\n", max_diff);
+    if (max_diff != 0)
+    {
+        printf("FAILED\n");
+        return 1;
+    }
+    printf("OK\n");
+    return 0;
+}
@@ -0,0 +1,114 @@
+/*
+    Checks that the batched kinematics (compute_next_steps) agree with the
+    reference implementation (Robot::robot_compute_next_step), and compares
+    their speed
+*/
+
+#include "World.h"
+#include "Kilobot.h"
+#include "Kinematics.h"
+#include "Timer.hpp"
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <memory>
+#include <vector>
+
+namespace Kilosim
+{
+// A Kilobot whose motion can be set directly
+class MotionBot : public Kilobot
+{
+public:
+  void set_motion(const int motor_command, const double forward_speed,
+                  const double turn_speed)
+  {
+    m_motor_command = motor_command;
+    m_forward_speed = forward_speed;
+    m_turn_speed = turn_speed;
+  }
+
+private:
+  void setup() {}
+  void loop() {}
+  void message_rx(message_t *message, distance_measurement_t *distance_measurement) {}
+  message_t *message_tx() { return NULL; }
+  void message_tx_success() {}
+};
+} // namespace Kilosim
+
+int main(int argc, char *argv[])
+{
+    // Not a multiple of the vector width, so the remainder is checked too
+    const int num_robots = 100003;
+    const double dt = 1.0 / 32;
+    seed_rand(7);
+
+    Kilosim::World world(2400.0, 2400.0);
+    std::vector<std::unique_ptr<Kilosim::MotionBot>> robots;
+    Kilosim::RobotStore store;
+    store.resize(num_robots);
+    for (int i = 0; i < num_robots; i++)
+    {
+        robots.emplace_back(new Kilosim::MotionBot());
+        world.add_robot(robots.back().get());
+        // Some headings are far outside [0, 2*PI), to check the wrapping
+        const double theta = (i % 10 == 0) ? uniform_rand_real(-800, 800)
+                                           : uniform_rand_real(0, 2 * PI);
+        robots.back()->robot_init(uniform_rand_real(0, 2400), uniform_rand_real(0, 2400), theta);
+        // Motor commands 0-4: stopped, forward, CW, CCW, and not spun up
+        robots.back()->set_motion(uniform_rand_int(0, 4), uniform_rand_real(20, 28),
+                                  uniform_rand_real(0.4, 0.6));
+        robots.back()->write_to_store(store, i);
+    }
+
+    Kilosim::PoseArrays new_poses;
+    new_poses.resize(num_robots);
+    Kilosim::compute_next_steps(store, dt, new_poses, 0, num_robots);
+
+    double max_diff = 0;
+    bool in_range = true;
+    for (int i = 0; i < num_robots; i++)
+    {
+        const Kilosim::RobotPose pose = robots[i]->robot_compute_next_step();
+        double theta_diff = std::abs(pose.theta - new_poses.theta[i]);
+        theta_diff = std::min(theta_diff, 2 * PI - theta_diff);
+        max_diff = std::max({max_diff, std::abs(pose.x - new_poses.x[i]),
+                             std::abs(pose.y - new_poses.y[i]), theta_diff});
+        in_range = in_range && new_poses.theta[i] >= 0 && new_poses.theta[i] <= 2 * PI;
+    }
+
+    const int reps = 200;
+    Timer batched;
+    batched.start();
+    for (int k = 0; k < reps; k++)
+    {
+        Kilosim::compute_next_steps(store, dt, new_poses, 0, num_robots);
+    }
+    batched.stop();
+    Timer reference;
+    reference.start();
+    for (int k = 0; k < reps; k++)
+    {
+        for (int i = 0; i < num_robots; i++)
+        {
+            const Kilosim::RobotPose pose = robots[i]->robot_compute_next_step();
+            new_poses.x[i] = pose.x;
+            new_poses.y[i] = pose.y;
+            new_poses.theta[i] = pose.theta;
+        }
+    }
+    reference.stop();
+
+    printf("Largest difference from the reference: %g\n", max_diff);
+    printf("Batched: %.3f ms/step, reference: %.3f ms/step (%d robots)\n",
+           batched.accumulated() * 1000 / reps, reference.accumulated() * 1000 / reps,
+           num_robots);
+    if (max_diff > 1e-9 || !in_range)
+    {
+        printf("FAILED\n");
+        return 1;
+    }
+    printf("OK\n");
+    return 0;
+}
@@ -0,0 +1,98 @@
+/*
+    Checks that World::step() doesn't allocate memory once the World has been
+    set up, by counting calls to operator new and posix_memalign (which
+    aligned_vector uses)
+*/
+
+#include "World.h"
+#include "MyKilobot.cpp"
+#include <atomic>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <memory>
+#include <new>
+#include <vector>
+
+namespace
+{
+std::atomic<long> num_allocations(0);
+}
+
+void *operator new(size_t size)
+{
+    num_allocations++;
+    void *p = malloc(size ? size : 1);
+    if (!p)
+    {
+        throw std::bad_alloc();
+    }
+    return p;
+}
+
+void operator delete(void *p) noexcept
+{
+    free(p);
+}
+
+void operator delete(void *p, size_t) noexcept
+{
+    free(p);
+}
+
+// Replaces the C library's version for this program
+extern "C" int posix_memalign(void **p, size_t alignment, size_t size)
+{
+    num_allocations++;
+    // aligned_alloc needs a multiple of the alignment
+    *p = aligned_alloc(alignment, (size + alignment - 1) / alignment * alignment);
+    return *p ? 0 : ENOMEM;
+}
+
+// Count the allocations made while stepping a World
+long count_allocations(const unsigned int num_threads, const Kilosim::BroadPhase broad_phase,
+                       const uint32_t reorder_interval)
+{
+    seed_rand(123456789);
+    Kilosim::World world(2400.0, 2400.0, "", num_threads, broad_phase);
+    world.set_reorder_interval(reorder_interval);
+    std::vector<std::unique_ptr<Kilosim::MyKilobot>> robots;
+    for (int n = 0; n < 500; n++)
+    {
+        robots.emplace_back(new Kilosim::MyKilobot());
+        world.add_robot(robots.back().get());
+        robots.back()->robot_init((n / 23) * 100 + 75, (n % 23) * 100 + 75, PI * n / 2);
+    }
+    // The first steps size the communication grid and start OpenMP's threads
+    for (int t = 0; t < 10; t++)
+    {
+        world.step();
+    }
+    const long before = num_allocations;
+    for (int t = 0; t < 3000; t++)
+    {
+        world.step();
+    }
+    return num_allocations - before;
+}
+
+int main(int argc, char *argv[])
+{
+    bool ok = true;
+    for (const unsigned int num_threads : {1, 3})
+    {
+        for (const Kilosim::BroadPhase broad_phase : {Kilosim::BROAD_PHASE_GRID, Kilosim::BROAD_PHASE_HASH})
+        {
+            for (const uint32_t reorder_interval : {0, 32})
+            {
+                const long count = count_allocations(num_threads, broad_phase, reorder_interval);
+                printf("%u threads, %s, reorder every %u ticks: %ld allocations in 3000 steps\n",
+                       num_threads, broad_phase == Kilosim::BROAD_PHASE_GRID ? "grid" : "hash",
+                       reorder_interval, count);
+                ok = ok && count == 0;
+            }
+        }
+    }
+    printf(ok ? "OK\n" : "FAILED\n");
+    return ok ? 0 : 1;
+}
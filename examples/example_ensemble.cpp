@@ -0,0 +1,41 @@
+#include "World.h"
+#include "Ensemble.h"
+#include "MyKilobot.cpp"
+
+// Build a World with the same setup as the warm-up (the robots don't need to
+// be initialized, since their state comes from the warm-up)
+void build_world(Kilosim::EnsembleMember &member)
+{
+    member.world.reset(new Kilosim::World(2400.0, 2400.0));
+    for (int n = 0; n < 100; n++)
+    {
+        member.robots.emplace_back(new Kilosim::MyKilobot());
+        member.world->add_robot(member.robots.back().get());
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    // Simulate the warm-up once
+    Kilosim::EnsembleMember warmup;
+    build_world(warmup);
+    for (int n = 0; n < 100; n++)
+    {
+        warmup.robots[n]->robot_init((n / 10) * 100 + 75, (n % 10) * 100 + 75, 0);
+    }
+    while (warmup.world->get_time() < 60)
+    {
+        warmup.world->step();
+    }
+
+    // Run 20 variants from the end of the warm-up, each with its own seed
+    Kilosim::Ensemble ensemble(*warmup.world, build_world);
+    ensemble.run(20, [](Kilosim::EnsembleMember &member, size_t variant) {
+        member.world->set_seed(variant + 1);
+        while (member.world->get_time() < 600)
+        {
+            member.world->step();
+        }
+    });
+    return 0;
+}
@@ -0,0 +1,75 @@
+/**
+  @file
+  @brief Defines an allocator that aligns memory to cache lines, and a vector
+  type that uses it.
+*/
+#ifndef _kilosim_aligned_allocator_
+#define _kilosim_aligned_allocator_
+
+#include <cstddef>
+#include <cstdlib>
+#include <new>
+#include <vector>
+
+namespace Kilosim
+{
+/*!
+ * Allocator for standard containers which places their storage on an
+ * `Alignment`-byte boundary (by default, a 64-byte cache line).
+ *
+ * This keeps arrays that are split between threads from sharing cache lines
+ * at their start, and lets vectorized loops start on aligned memory.
+ */
+template <class T, std::size_t Alignment = 64>
+struct AlignedAllocator
+{
+  typedef T value_type;
+
+  template <class U>
+  struct rebind
+  {
+    typedef AlignedAllocator<U, Alignment> other;
+  };
+
+  AlignedAllocator() noexcept {}
+
+  template <class U>
+  AlignedAllocator(const AlignedAllocator<U, Alignment> &) noexcept {}
+
+  //! Allocate aligned storage for n objects. Throws std::bad_alloc on failure.
+  T *allocate(const std::size_t n)
+  {
+    void *p = nullptr;
+    if (posix_memalign(&p, Alignment, n * sizeof(T)) != 0)
+      throw std::bad_alloc();
+    return static_cast<T *>(p);
+  }
+
+  //! Free storage from allocate()
+  void deallocate(T *p, std::size_t) noexcept
+  {
+    free(p);
+  }
+};
+
+template <class T, class U, std::size_t Alignment>
+bool operator==(const AlignedAllocator<T, Alignment> &,
+                const AlignedAllocator<U, Alignment> &)
+{
+  return true;
+}
+
+template <class T, class U, std::size_t Alignment>
+bool operator!=(const AlignedAllocator<T, Alignment> &,
+                const AlignedAllocator<U, Alignment> &)
+{
+  return false;
+}
+
+//! A std::vector whose storage starts on a cache line
+template <class T>
+using aligned_vector = std::vector<T, AlignedAllocator<T>>;
+
+} // namespace Kilosim
+
+#endif
@@ -0,0 +1,156 @@
+/*
+    Kilosim
+
+    Binary snapshots of the full state of a simulation, for saving and
+    restoring a World
+*/
+
+#include "Checkpoint.h"
+#include <cerrno>
+#include <cstdio>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace Kilosim
+{
+
+namespace
+{
+//! Identifies a checkpoint file
+const char CHECKPOINT_MAGIC[8] = {'K', 'I', 'L', 'O', 'C', 'K', 'P', '1'};
+//! Version of the layout of checkpoint files
+const uint32_t CHECKPOINT_VERSION = 1;
+
+//! Fixed-size start of a checkpoint file, followed by the state
+struct CheckpointHeader
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t reserved0;
+    uint64_t state_size;
+    uint8_t reserved[40];
+};
+static_assert(sizeof(CheckpointHeader) == 64, "Checkpoint header must be 64 bytes");
+
+std::string error_string()
+{
+    return std::string(": ") + strerror(errno);
+}
+//! Write all of the bytes to a file (write() may only write some of them)
+bool write_all(const int fd, const void *data, size_t size)
+{
+    const uint8_t *p = (const uint8_t *)data;
+    while (size > 0)
+    {
+        const ssize_t written = write(fd, p, size);
+        if (written < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (written <= 0)
+        {
+            return false;
+        }
+        p += written;
+        size -= written;
+    }
+    return true;
+}
+} // namespace
+
+void CheckpointWriter::save(const std::string &filename) const
+{
+    const std::string tmp_filename = filename + ".tmp";
+    const int fd = open(tmp_filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+    {
+        throw std::runtime_error("Could not create checkpoint file " + tmp_filename + error_string());
+    }
+
+    CheckpointHeader header = {};
+    memcpy(header.magic, CHECKPOINT_MAGIC, sizeof(CHECKPOINT_MAGIC));
+    header.version = CHECKPOINT_VERSION;
+    header.state_size = m_size;
+
+    // Writing the file directly is faster than filling a new memory-mapped
+    // file, which page faults on every page
+    bool ok = write_all(fd, &header, sizeof(header)) &&
+              write_all(fd, m_data.data(), m_size);
+    // Make sure the new checkpoint is on disk before it replaces the old one,
+    // so a crash can't leave neither
+    ok = ok && fdatasync(fd) == 0;
+    const std::string error = error_string();
+    close(fd);
+    if (!ok || rename(tmp_filename.c_str(), filename.c_str()) != 0)
+    {
+        unlink(tmp_filename.c_str());
+        throw std::runtime_error("Failed to save checkpoint " + filename + (ok ? error_string() : error));
+    }
+}
+
+CheckpointReader::CheckpointReader(const uint8_t *data, const size_t size)
+    : m_data(data), m_size(size)
+{
+}
+
+CheckpointReader::CheckpointReader(const CheckpointWriter &writer)
+    : CheckpointReader(writer.data(), writer.size())
+{
+}
+
+CheckpointReader::CheckpointReader(const std::string &filename)
+{
+    const int fd = open(filename.c_str(), O_RDONLY);
+    if (fd < 0)
+    {
+        throw std::runtime_error("Could not open checkpoint file " + filename + error_string());
+    }
+    struct stat st;
+    void *map = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && st.st_size > 0)
+    {
+        map = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    }
+    close(fd);
+    if (map == MAP_FAILED)
+    {
+        throw std::runtime_error("Could not read checkpoint file " + filename);
+    }
+    const size_t file_size = st.st_size;
+    m_mapping = std::shared_ptr<const void>(map, [file_size](const void *p) {
+        munmap(const_cast<void *>(p), file_size);
+    });
+    // The state is read once, front to back
+    madvise(map, file_size, MADV_SEQUENTIAL);
+
+    CheckpointHeader header;
+    if (file_size < sizeof(header))
+    {
+        throw std::runtime_error("Invalid checkpoint file " + filename);
+    }
+    memcpy(&header, map, sizeof(header));
+    if (memcmp(header.magic, CHECKPOINT_MAGIC, sizeof(CHECKPOINT_MAGIC)) != 0 ||
+        header.version != CHECKPOINT_VERSION)
+    {
+        throw std::runtime_error("Invalid checkpoint file " + filename);
+    }
+    if (header.state_size != file_size - sizeof(header))
+    {
+        throw std::runtime_error("Incomplete checkpoint file " + filename);
+    }
+    m_data = (const uint8_t *)map + sizeof(header);
+    m_size = header.state_size;
+}
+
+CheckpointReader CheckpointReader::block()
+{
+    uint64_t length;
+    read(length);
+    CheckpointReader block(take(length), length);
+    block.m_mapping = m_mapping;
+    return block;
+}
+
+} // namespace Kilosim
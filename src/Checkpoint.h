@@ -0,0 +1,248 @@
+/*
+  Kilosim
+
+  Binary snapshots of the full state of a simulation, for saving and restoring
+  a World
+*/
+
+#ifndef __KILOSIM_CHECKPOINT_H
+#define __KILOSIM_CHECKPOINT_H
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+#include <type_traits>
+#include <algorithm>
+
+namespace Kilosim
+{
+/*!
+ * Buffer that the state of a World (and its Robots) is written into by
+ * `World::save_state()`. Values are stored as their raw bytes, so a checkpoint
+ * can only be restored on the same kind of machine, by a program built from
+ * the same code.
+ *
+ * The buffer keeps its memory when it's cleared, so a writer that's reused
+ * for periodic checkpoints doesn't allocate after the first one.
+ */
+class CheckpointWriter
+{
+private:
+  //! Memory for the state. Only the first m_size bytes have been written.
+  std::vector<uint8_t> m_data;
+  size_t m_size = 0;
+
+  //! Make room for count more bytes
+  void reserve(const size_t count)
+  {
+    if (count > m_data.size() - m_size)
+    {
+      m_data.resize(std::max(m_data.size() * 2, m_size + count));
+    }
+  }
+
+public:
+  /*!
+   * Write a value (which must be trivially copyable, e.g., a number, a plain
+   * struct, or a `message_t`)
+   * @param value Value to write
+   */
+  template <typename T>
+  void write(const T &value)
+  {
+    write(&value, 1);
+  }
+
+  /*!
+   * Write an array of values
+   * @param values First value to write
+   * @param count Number of values
+   */
+  template <typename T>
+  void write(const T *values, const size_t count)
+  {
+    static_assert(std::is_trivially_copyable<T>::value,
+                  "Only trivially copyable values can be written directly");
+    reserve(count * sizeof(T));
+    if (count > 0)
+    {
+      memcpy(&m_data[m_size], values, count * sizeof(T));
+    }
+    m_size += count * sizeof(T);
+  }
+
+  //! Write a vector of values (and its length)
+  template <typename T>
+  void write(const std::vector<T> &values)
+  {
+    write((uint64_t)values.size());
+    write(values.data(), values.size());
+  }
+
+  //! Write a string (and its length)
+  void write(const std::string &value)
+  {
+    write((uint64_t)value.size());
+    write(value.data(), value.size());
+  }
+
+  /*!
+   * Start a block of data whose length is saved before it, so a reader can
+   * check that everything in it was read (see `CheckpointReader::block()`)
+   * @return Position to pass to `end_block()`
+   */
+  size_t begin_block()
+  {
+    const size_t pos = m_size;
+    write((uint64_t)0);
+    return pos;
+  }
+
+  //! Finish a block started with `begin_block()`
+  void end_block(const size_t pos)
+  {
+    const uint64_t length = m_size - pos - sizeof(uint64_t);
+    memcpy(&m_data[pos], &length, sizeof(length));
+  }
+
+  //! Remove everything written (without giving back the memory)
+  void clear()
+  {
+    m_size = 0;
+  }
+
+  //! Get the number of bytes written
+  size_t size() const
+  {
+    return m_size;
+  }
+
+  //! Get the bytes written
+  const uint8_t *data() const
+  {
+    return m_data.data();
+  }
+
+  /*!
+   * Save everything written to a file. The file is written under a temporary
+   * name (`filename` + `.tmp`) and then renamed, so an existing checkpoint is
+   * only replaced once the new one is complete.
+   * @param filename File to save the checkpoint in
+   * @throws std::runtime_error if the file can't be written
+   */
+  void save(const std::string &filename) const;
+};
+
+/*!
+ * Reads the state written by a CheckpointWriter, either from memory or from a
+ * checkpoint file. Files are memory-mapped, so values are read straight out of
+ * the file without copying it first.
+ *
+ * Reading past the end of the data throws a `std::runtime_error`.
+ */
+class CheckpointReader
+{
+private:
+  const uint8_t *m_data;
+  size_t m_size;
+  size_t m_pos = 0;
+  //! Keeps a checkpoint file mapped while it's being read
+  std::shared_ptr<const void> m_mapping;
+
+  //! Check that count values of a size haven't all been read yet
+  void check_remaining(const size_t count, const size_t value_size) const
+  {
+    if (count > (m_size - m_pos) / value_size)
+    {
+      throw std::runtime_error("Checkpoint is shorter than the state being restored");
+    }
+  }
+
+  //! Get the next count bytes and move past them
+  const uint8_t *take(const size_t count)
+  {
+    check_remaining(count, 1);
+    const uint8_t *p = m_data + m_pos;
+    m_pos += count;
+    return p;
+  }
+
+public:
+  /*!
+   * Read from bytes in memory (which must outlive the reader)
+   * @param data Start of the state
+   * @param size Number of bytes
+   */
+  CheckpointReader(const uint8_t *data, const size_t size);
+
+  //! Read what has been written to a CheckpointWriter (which must outlive
+  //! the reader, without being written to)
+  explicit CheckpointReader(const CheckpointWriter &writer);
+
+  /*!
+   * Read from a checkpoint file saved with `CheckpointWriter::save()`
+   * @param filename Checkpoint file
+   * @throws std::runtime_error if the file can't be opened or isn't a
+   * complete checkpoint
+   */
+  explicit CheckpointReader(const std::string &filename);
+
+  //! Read a value written with `CheckpointWriter::write()`
+  template <typename T>
+  void read(T &value)
+  {
+    read(&value, 1);
+  }
+
+  //! Read an array of values
+  template <typename T>
+  void read(T *values, const size_t count)
+  {
+    static_assert(std::is_trivially_copyable<T>::value,
+                  "Only trivially copyable values can be read directly");
+    check_remaining(count, sizeof(T));
+    const uint8_t *p = take(count * sizeof(T));
+    if (count > 0)
+    {
+      memcpy(values, p, count * sizeof(T));
+    }
+  }
+
+  //! Read a vector of values (resized to the length that was written)
+  template <typename T>
+  void read(std::vector<T> &values)
+  {
+    uint64_t count;
+    read(count);
+    check_remaining(count, sizeof(T));
+    values.resize(count);
+    read(values.data(), count);
+  }
+
+  //! Read a string
+  void read(std::string &value)
+  {
+    uint64_t count;
+    read(count);
+    const uint8_t *p = take(count);
+    value.assign((const char *)p, count);
+  }
+
+  /*!
+   * Get a reader for the next block written between
+   * `CheckpointWriter::begin_block()` and `end_block()`, and move past it
+   */
+  CheckpointReader block();
+
+  //! Get the number of bytes that haven't been read yet
+  size_t remaining() const
+  {
+    return m_size - m_pos;
+  }
+};
+} // namespace Kilosim
+
+#endif
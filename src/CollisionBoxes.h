@@ -8,84 +8,365 @@
 #define __collision_boxes_h_
 
 #include "Robot.h"
+#include "AlignedAllocator.hpp"
+#include <algorithm>
 #include <cmath>
-#include <cassert>
-#include <unordered_map>
+#include <cstdint>
+#include <vector>
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
 
 namespace Kilosim
 {
 
+/*!
+ * How the boxes used to find nearby robots are stored
+ */
+enum BroadPhase : uint8_t
+{
+  //! A dense grid covering the whole arena. This is fastest when the robots
+  //! are spread over most of the arena, but its memory grows with the area of
+  //! the arena.
+  BROAD_PHASE_GRID,
+  //! A hash table of the boxes that have robots in them. Its memory only grows
+  //! with the number of robots, so it suits huge or mostly-empty arenas.
+  BROAD_PHASE_HASH
+};
+
+//Agents are binned into square boxes and then stored as one contiguous array
+//of agent indices sorted by box, plus the offset of each box (compressed sparse
+//row layout), so there is no limit on how many agents share a box.
+//
+//The sort is a parallel least-significant-digit radix sort of the box indices.
+//For each digit, every thread counts the digits in its own contiguous chunk of
+//agents, the counts are turned into offsets with an exclusive scan (ordered by
+//digit and then by thread), and every thread scatters its chunk to those
+//offsets. Each pass is stable, so agents in a box stay in index order no matter
+//how many threads there are. Digits are kept small enough that the per-thread
+//histograms fit in L1 cache, independent of the size of the grid.
+//
+//With BROAD_PHASE_GRID, the sort key is the index of the box, so there's a
+//range of agents for every box in the area. With BROAD_PHASE_HASH, the key is a
+//hash of the box into a table about twice the size of the number of agents.
+//Several boxes can then share a range, so every agent also records its box,
+//and queries skip agents whose box isn't the one being looked at.
 class CollisionBoxes
 {
 private:
-  const int cddx[9] = {0, -1, -1, 0, 1, 1, 1, 0, -1};
-  const int cddy[9] = {0, 0, -1, -1, -1, 0, 1, 1, 1};
-  const int PSIZE = 4;
   typedef std::vector<int> ivec;
-  ivec agent_positions;
-  ivec cells_used;
-  double diameter; //Collision diameter
-  int bwidth;      //Width in bins
-  int bheight;     //Height in bins
+  ivec cell_start;  //Agents with key c are cell_agents[cell_start[c]..cell_start[c+1])
+  ivec cell_agents; //Agent indices, sorted by key
+  ivec cell_keys;   //Key of each agent in cell_agents
+  ivec tmp_agents;  //Radix sort buffers
+  ivec tmp_keys;
+  ivec histograms;  //Digit counts (and then offsets) of each thread
+  ivec scan_totals; //Sum of the counts in each thread's range of digits
+  std::vector<int64_t> cell_ids;  //Box of each agent in cell_agents (hashed only)
+  aligned_vector<double> cell_xs; //Positions of the agents in cell_agents
+  aligned_vector<double> cell_ys;
+  BroadPhase layout = BROAD_PHASE_GRID;
+  double diameter = 1; //Collision diameter
+  int bwidth = 1;       //Width in bins
+  int bheight = 1;      //Height in bins
+  int num_keys = 0;     //Number of boxes (grid) or hash table size (hash)
+  int hash_bits = 1;    //Hash table size is 2^hash_bits
+  int radix_bits = 1;   //Bits in each digit of the radix sort
+  int radix_passes = 1; //Digits in a key
+
+  static const int MAX_RADIX_BITS = 11;
+
+  //Bin containing a coordinate. Points outside of the area are put in the
+  //nearest edge bin.
+  int bin_of(const double v, const int bins) const
+  {
+    return (int)std::min(std::max(v / diameter, 0.0), bins - 1.0);
+  }
+
+  //Sort key of a box
+  int key_of(const int binx, const int biny) const
+  {
+    if (layout == BROAD_PHASE_GRID)
+      return biny * bwidth + binx;
+    //Fibonacci hashing: the top bits of the product are well mixed
+    const uint64_t box = ((uint64_t)biny << 32) | (uint32_t)binx;
+    return (box * 0x9E3779B97F4A7C15ull) >> (64 - hash_bits);
+  }
+
+  //Set the number of keys, and split the bits of the largest key into as few
+  //radix digits as possible, with the digits as evenly sized as possible
+  void set_num_keys(const int num_keys0)
+  {
+    num_keys = num_keys0;
+    cell_start.resize(num_keys + 1);
+
+    int key_bits = 1;
+    while ((1 << key_bits) < num_keys)
+      key_bits++;
+    radix_passes = (key_bits + MAX_RADIX_BITS - 1) / MAX_RADIX_BITS;
+    radix_bits = (key_bits + radix_passes - 1) / radix_passes;
+  }
+
+  //Size the buffers for this many agents and threads. This only allocates
+  //memory when either grows.
+  void resize_buffers(const int num_agents, const int num_threads)
+  {
+    cell_agents.resize(num_agents);
+    cell_keys.resize(num_agents);
+    tmp_agents.resize(num_agents);
+    tmp_keys.resize(num_agents);
+    cell_xs.resize(num_agents);
+    cell_ys.resize(num_agents);
+    if (layout == BROAD_PHASE_HASH)
+    {
+      cell_ids.resize(num_agents);
+      //Keep the table between 2 and 4 times the number of agents
+      if (num_keys < 2 * num_agents || num_keys > 4 * std::max(num_agents, 1))
+      {
+        hash_bits = 1;
+        while ((1 << hash_bits) < 2 * num_agents)
+          hash_bits++;
+        set_num_keys(1 << hash_bits);
+      }
+    }
+    if ((int)histograms.size() < (num_threads << radix_bits))
+      histograms.resize(num_threads << radix_bits);
+    if ((int)scan_totals.size() < num_threads + 1)
+      scan_totals.resize(num_threads + 1);
+  }
 
 public:
-  CollisionBoxes() = default;
+  CollisionBoxes() : CollisionBoxes(1, 1, 1) {}
 
-  CollisionBoxes(const double width0, const double height0, const double diameter0)
+  /*!
+   * @param width0 Width of the area covered by the boxes
+   * @param height0 Height of the area covered by the boxes
+   * @param diameter0 Side length of a box. Neighbours are looked up in the
+   * 3x3 block of boxes around a point, so this must be at least the largest
+   * interaction distance
+   * @param layout0 How to store the boxes
+   */
+  CollisionBoxes(const double width0, const double height0, const double diameter0,
+                 const BroadPhase layout0 = BROAD_PHASE_GRID)
   {
     diameter = diameter0;
-    bwidth = std::ceil(width0 / diameter);
-    bheight = std::ceil(height0 / diameter);
+    layout = layout0;
+    bwidth = std::max((int)std::ceil(width0 / diameter), 1);
+    bheight = std::max((int)std::ceil(height0 / diameter), 1);
 
-    agent_positions.resize(PSIZE * bwidth * bheight, -1);
+    //A hash table always has at least 2 keys, even with no agents, so the
+    //radix sort and cell_start are valid before the first update()
+    if (layout == BROAD_PHASE_GRID)
+      set_num_keys(bwidth * bheight);
+    else
+      set_num_keys(1 << hash_bits);
+    resize_buffers(0, 1);
   }
 
-  template <class T>
-  void update(const std::vector<T> &agents)
+  /*!
+   * Place agents in the boxes. This runs in parallel with OpenMP, so it must not
+   * be called from inside a parallel region.
+   * @param xs x-positions of the agents
+   * @param ys y-positions of the agents
+   */
+  void update(const aligned_vector<double> &xs, const aligned_vector<double> &ys)
   {
-    //Clear bins of their occupants
-    for (const auto &p : cells_used)
-      agent_positions[p] = -1;
-    cells_used.clear();
+    const int num_agents = xs.size();
+#ifdef _OPENMP
+    resize_buffers(num_agents, omp_get_max_threads());
+#else
+    resize_buffers(num_agents, 1);
+#endif
+    const int radix = 1 << radix_bits;
+
+    //Each pass sorts from one pair of buffers into the other. Start from
+    //whichever pair makes the final pass land in cell_agents/cell_keys.
+    ivec *src_agents = &cell_agents, *src_keys = &cell_keys;
+    ivec *dst_agents = &tmp_agents, *dst_keys = &tmp_keys;
+    if (radix_passes % 2 == 1)
+    {
+      std::swap(src_agents, dst_agents);
+      std::swap(src_keys, dst_keys);
+    }
+
+#pragma omp parallel
+    {
+#ifdef _OPENMP
+      const int num_threads = omp_get_num_threads();
+      const int thread = omp_get_thread_num();
+#else
+      const int num_threads = 1;
+      const int thread = 0;
+#endif
+      //Each thread owns one contiguous chunk of agents, and one contiguous
+      //range of digits for the scan
+      const int chunk = (num_agents + num_threads - 1) / num_threads;
+      const int begin = std::min(num_agents, thread * chunk);
+      const int end = std::min(num_agents, begin + chunk);
+      const int digits_per_thread = (radix + num_threads - 1) / num_threads;
+      const int digit_begin = std::min(radix, thread * digits_per_thread);
+      const int digit_end = std::min(radix, digit_begin + digits_per_thread);
+      int *const hist = &histograms[thread * radix];
+
+      for (int a = begin; a < end; a++)
+      {
+        (*src_agents)[a] = a;
+        (*src_keys)[a] = key_of(bin_of(xs[a], bwidth), bin_of(ys[a], bheight));
+      }
+
+      for (int pass = 0; pass < radix_passes; pass++)
+      {
+        const int shift = pass * radix_bits;
+        const ivec &in_agents = *src_agents, &in_keys = *src_keys;
+        ivec &out_agents = *dst_agents, &out_keys = *dst_keys;
+
+        std::fill(hist, hist + radix, 0);
+        for (int a = begin; a < end; a++)
+          hist[(in_keys[a] >> shift) & (radix - 1)]++;
+#pragma omp barrier
+
+        //Exclusive scan over (digit, thread): first each thread totals its
+        //range of digits...
+        int total = 0;
+        for (int d = digit_begin; d < digit_end; d++)
+          for (int t = 0; t < num_threads; t++)
+            total += histograms[t * radix + d];
+        scan_totals[thread + 1] = total;
+#pragma omp barrier
+#pragma omp single
+        {
+          scan_totals[0] = 0;
+          for (int t = 1; t <= num_threads; t++)
+            scan_totals[t] += scan_totals[t - 1];
+        }
+        //...and then turns the counts in its range into offsets
+        int offset = scan_totals[thread];
+        for (int d = digit_begin; d < digit_end; d++)
+          for (int t = 0; t < num_threads; t++)
+          {
+            const int count = histograms[t * radix + d];
+            histograms[t * radix + d] = offset;
+            offset += count;
+          }
+#pragma omp barrier
+
+        for (int a = begin; a < end; a++)
+        {
+          const int dst = hist[(in_keys[a] >> shift) & (radix - 1)]++;
+          out_agents[dst] = in_agents[a];
+          out_keys[dst] = in_keys[a];
+        }
+#pragma omp barrier
+#pragma omp single
+        {
+          std::swap(src_agents, dst_agents);
+          std::swap(src_keys, dst_keys);
+        }
+      }
+
+      //Copy the positions into key order so that neighbour queries read
+      //contiguous memory, and find where each key starts. Every key from the
+      //previous agent's key (exclusive) up to this agent's key (inclusive)
+      //starts here.
+      for (int k = begin; k < end; k++)
+      {
+        cell_xs[k] = xs[cell_agents[k]];
+        cell_ys[k] = ys[cell_agents[k]];
+        if (layout == BROAD_PHASE_HASH)
+          cell_ids[k] = (int64_t)bin_of(cell_ys[k], bheight) * bwidth + bin_of(cell_xs[k], bwidth);
+        const int previous = (k == 0) ? -1 : cell_keys[k - 1];
+        for (int c = previous + 1; c <= cell_keys[k]; c++)
+          cell_start[c] = k;
+      }
+      if (thread == num_threads - 1)
+      {
+        const int last = (num_agents == 0) ? -1 : cell_keys[num_agents - 1];
+        for (int c = last + 1; c <= num_keys; c++)
+          cell_start[c] = num_agents;
+      }
+    }
+  }
 
-    for (unsigned int a = 0; a < agents.size(); a++)
+  /*!
+   * Make room to track this many agents, so that update() doesn't need to
+   * allocate memory
+   * @param num_agents Number of agents that will be placed in the boxes
+   */
+  void reserve(const size_t num_agents)
+  {
+    cell_agents.reserve(num_agents);
+    cell_keys.reserve(num_agents);
+    tmp_agents.reserve(num_agents);
+    tmp_keys.reserve(num_agents);
+    cell_xs.reserve(num_agents);
+    cell_ys.reserve(num_agents);
+    if (layout == BROAD_PHASE_HASH)
     {
-      const int binx = agents[a].x / diameter;
-      const int biny = agents[a].y / diameter;
-      const int idx0 = PSIZE * (biny * bwidth + binx);
-      int idx = idx0;
-      for (; idx <= idx0 + PSIZE; idx++)
-        if (agent_positions[idx] == -1)
-          break;
-      assert(idx != idx0 + PSIZE);
-      agent_positions[idx] = a;
-      cells_used.emplace_back(idx);
+      cell_ids.reserve(num_agents);
+      cell_start.reserve(4 * num_agents + 1);
     }
   }
 
+  //! Number of agents placed by the last update()
+  int size() const
+  {
+    return cell_agents.size();
+  }
+
+  /*!
+   * Agents in the order they are stored in the boxes. Looping over agents in
+   * this order makes consecutive neighbour queries look at the same boxes.
+   * @param k Position in the boxes (from 0 to size()-1)
+   * @return Index of the agent
+   */
+  int sorted_agent(const int k) const
+  {
+    return cell_agents[k];
+  }
+
+  /*!
+   * Call `func(agent, agent_x, agent_y)` for every agent in the 3x3 block of
+   * boxes around a point, using the positions from the last update(). In a
+   * grid, the boxes in each row of the block are stored contiguously, so this
+   * reads three runs of memory. If func returns false, no more agents are
+   * visited.
+   */
   template <class F>
   void considerNeighbours(const double x, const double y, F func) const
   {
-    const int cbinx = x / diameter;
-    const int cbiny = y / diameter;
+    const int cbinx = bin_of(x, bwidth);
+    const int cbiny = bin_of(y, bheight);
+    const int binx0 = std::max(cbinx - 1, 0);
+    const int binx1 = std::min(cbinx + 1, bwidth - 1);
 
-    for (unsigned int nbi = 0; nbi <= 8; nbi++)
+    for (int biny = std::max(cbiny - 1, 0); biny <= std::min(cbiny + 1, bheight - 1); biny++)
     {
-      const int binx = cbinx + cddx[nbi];
-      const int biny = cbiny + cddy[nbi];
-
-      if (binx < 0 || biny < 0 || binx == bwidth || biny == bheight)
+      if (layout == BROAD_PHASE_GRID)
+      {
+        const int end = cell_start[biny * bwidth + binx1 + 1];
+        for (int idx = cell_start[biny * bwidth + binx0]; idx < end; idx++)
+        {
+          //If func returns false, that means it doesn't want to look at any
+          //more neighbours
+          if (!func(cell_agents[idx], cell_xs[idx], cell_ys[idx]))
+            return;
+        }
         continue;
+      }
 
-      const auto idx0 = &agent_positions[PSIZE * (biny * bwidth + binx)];
-      for (auto idx = idx0; idx < idx0 + PSIZE; idx++)
+      for (int binx = binx0; binx <= binx1; binx++)
       {
-        if (*idx == -1)
-          continue;
-        //If func returns false, that means it doesn't want to look at any more
-        //neighbours
-        if (!func(*idx))
-          return;
+        const int key = key_of(binx, biny);
+        const int64_t id = (int64_t)biny * bwidth + binx;
+        for (int idx = cell_start[key]; idx < cell_start[key + 1]; idx++)
+        {
+          //Skip agents from other boxes that hash to the same key
+          if (cell_ids[idx] != id)
+            continue;
+          if (!func(cell_agents[idx], cell_xs[idx], cell_ys[idx]))
+            return;
+        }
       }
     }
   }
@@ -0,0 +1,109 @@
+/*
+    Kilosim
+
+    Branching many variants of a simulation from one shared starting state
+*/
+
+#include "Ensemble.h"
+#include <algorithm>
+#include <atomic>
+#include <exception>
+#include <mutex>
+#include <stdexcept>
+#include <thread>
+
+namespace Kilosim
+{
+Ensemble::Ensemble(const World &world, const Builder builder)
+    : m_builder(builder)
+{
+    world.save_state(m_state);
+}
+
+void Ensemble::branch(EnsembleMember &member) const
+{
+    member.world.reset();
+    member.robots.clear();
+    m_builder(member);
+    if (!member.world)
+    {
+        throw std::runtime_error("Ensemble builder didn't create a World");
+    }
+    // Every variant reads the same saved state; only the variant's own World
+    // and Robots are written
+    CheckpointReader in(m_state);
+    member.world->load_state(in);
+}
+
+void Ensemble::run(const size_t num_variants, const Runner runner,
+                   unsigned int num_concurrent) const
+{
+    if (num_concurrent == 0)
+    {
+        num_concurrent = std::max(std::thread::hardware_concurrency(), 1u);
+    }
+    num_concurrent = std::min((size_t)num_concurrent, num_variants);
+
+    // Variants are handed out one at a time, so threads that get short
+    // variants go on to run more of them
+    std::atomic<size_t> next_variant(0);
+    std::exception_ptr error;
+    std::mutex error_mutex;
+    const auto run_variants = [&]() {
+#ifdef _OPENMP
+        // Each thread has its own OpenMP settings (which a World's
+        // constructor may change, so they're set again after building it)
+        omp_set_dynamic(0);
+        omp_set_num_threads(m_variant_threads);
+#endif
+        size_t variant;
+        while ((variant = next_variant++) < num_variants)
+        {
+            try
+            {
+                EnsembleMember member;
+                branch(member);
+#ifdef _OPENMP
+                omp_set_dynamic(0);
+                omp_set_num_threads(m_variant_threads);
+#endif
+                runner(member, variant);
+            }
+            catch (...)
+            {
+                std::lock_guard<std::mutex> lock(error_mutex);
+                if (!error)
+                {
+                    error = std::current_exception();
+                }
+                // Don't start any more variants
+                next_variant = num_variants;
+            }
+        }
+    };
+
+    std::vector<std::thread> threads;
+    for (unsigned int t = 0; t < num_concurrent; t++)
+    {
+        threads.emplace_back(run_variants);
+    }
+    for (auto &thread : threads)
+    {
+        thread.join();
+    }
+    if (error)
+    {
+        std::rethrow_exception(error);
+    }
+}
+
+void Ensemble::set_variant_threads(const unsigned int num_threads)
+{
+    m_variant_threads = std::max(num_threads, 1u);
+}
+
+size_t Ensemble::get_state_size() const
+{
+    return m_state.size();
+}
+} // namespace Kilosim
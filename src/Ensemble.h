@@ -0,0 +1,132 @@
+/*
+  Kilosim
+
+  Branching many variants of a simulation from one shared starting state
+*/
+
+#ifndef __KILOSIM_ENSEMBLE_H
+#define __KILOSIM_ENSEMBLE_H
+
+#include "World.h"
+#include "Checkpoint.h"
+#include <functional>
+#include <memory>
+#include <vector>
+
+namespace Kilosim
+{
+/*!
+ * One simulation in an Ensemble: a World and the Robots in it (which the World
+ * doesn't own, so they're kept here)
+ */
+struct EnsembleMember
+{
+  std::unique_ptr<World> world;
+  std::vector<std::unique_ptr<Robot>> robots;
+};
+
+/*!
+ * An Ensemble runs many variants of a simulation that all start from the same
+ * state, such as a sweep over parameters or seeds that share a warm-up phase.
+ * The warm-up is simulated once; every variant then continues from a copy of
+ * its final state, instead of simulating it again.
+ *
+ * Create the Ensemble from the warm-up World when it reaches the state to
+ * branch from. This saves the World's state (see `World::save_state()`) in
+ * memory, where it's shared by all of the variants. Then `run()` the variants.
+ * Each one is a new World (made by your builder) restored to the saved state,
+ * which your runner then changes (e.g., `World::set_seed()`, or parameters of
+ * your robots) and simulates.
+ *
+ * Variants run concurrently, each on its own thread. Within a variant, the
+ * World steps on one thread by default, since running more variants at once
+ * makes better use of the cores than splitting each one up.
+ *
+ * ```
+ * Kilosim::Ensemble ensemble(warmup_world, build_world);
+ * ensemble.run(100, [](Kilosim::EnsembleMember &member, size_t variant) {
+ *     member.world->set_seed(variant + 1);
+ *     while (member.world->get_time() < 600)
+ *         member.world->step();
+ * });
+ * ```
+ */
+class Ensemble
+{
+public:
+  /*!
+   * Function that builds a new simulation set up like the one the Ensemble
+   * was created from: a World of the same size with the same light, with the
+   * same kinds of Robots added to it in the same order. The Robots don't need
+   * to be initialized (their state is restored from the Ensemble).
+   *
+   * Builders are called on several threads at once, and the Worlds they make
+   * step concurrently. Light patterns and Kilosim's light sources can be
+   * shared between the Worlds (e.g., one `std::shared_ptr<LightSource>`
+   * captured by the builder), but a custom light source whose `update()`
+   * modifies it must be created separately for each World.
+   */
+  typedef std::function<void(EnsembleMember &member)> Builder;
+
+  /*!
+   * Function that runs a single variant, given the simulation restored to the
+   * Ensemble's state and the number of the variant (from 0). It's called on
+   * several threads at once, so anything it shares between variants (other
+   * than a Logger file) must be protected.
+   */
+  typedef std::function<void(EnsembleMember &member, const size_t variant)> Runner;
+
+private:
+  //! State of the World that every variant starts from
+  CheckpointWriter m_state;
+  //! Makes the simulations of the variants
+  Builder m_builder;
+  //! Number of threads each variant's World steps with
+  unsigned int m_variant_threads = 1;
+
+public:
+  /*!
+   * Create an Ensemble that branches from the current state of a World
+   * @param world World to branch from (which isn't changed)
+   * @param builder Function that builds a new simulation like `world`
+   */
+  Ensemble(const World &world, const Builder builder);
+
+  /*!
+   * Run variants from the Ensemble's state, several at a time. This returns
+   * once all of them have finished.
+   * @param num_variants Number of variants to run
+   * @param runner Function that runs a variant
+   * @param num_concurrent Most variants to run at once, or 0 (default) for
+   * the number of cores
+   * @throws Any exception thrown by the builder or runner (after the other
+   * variants that are running have finished). Variants that haven't started
+   * yet are skipped.
+   */
+  void run(const size_t num_variants, const Runner runner,
+           unsigned int num_concurrent = 0) const;
+
+  /*!
+   * Build a single simulation restored to the Ensemble's state (e.g., to run
+   * a variant yourself)
+   * @param member Simulation to build (replacing anything already in it)
+   */
+  void branch(EnsembleMember &member) const;
+
+  /*!
+   * Set how many threads each variant's World steps with (Default: 1). More
+   * than one is only worth it when there are fewer variants than cores.
+   * @param num_threads Number of threads per variant
+   */
+  void set_variant_threads(const unsigned int num_threads);
+
+  //! Get the size of the state shared by the variants (in bytes)
+  size_t get_state_size() const;
+};
+
+/*! \example example_ensemble.cpp
+ * Example of running variants of a simulation from a shared warm-up
+ */
+} // namespace Kilosim
+
+#endif
@@ -0,0 +1,361 @@
+/*
+    Kilosim
+
+    Headless recording of simulations as video frames, rendered in software
+*/
+
+#include "FrameRecorder.h"
+#include <SFML/Graphics.hpp>
+#include <algorithm>
+#include <cctype>
+#include <cmath>
+#include <cstring>
+#include <stdexcept>
+
+namespace Kilosim
+{
+
+namespace
+{
+//! Number of frames that can wait to be drawn and saved
+const size_t FRAME_QUEUE_SIZE = 8;
+
+//! Whether a filename pattern is safe to give snprintf with a frame number:
+//! exactly one conversion of an integer (`%u`, `%d`, or `%i`, optionally with
+//! a `0` or `-` flag and a width), and otherwise only `%%`
+bool is_frame_pattern(const std::string &path)
+{
+    int num_conversions = 0;
+    for (size_t i = 0; i < path.size(); i++)
+    {
+        if (path[i] != '%')
+        {
+            continue;
+        }
+        i++;
+        if (i < path.size() && path[i] == '%')
+        {
+            continue;
+        }
+        while (i < path.size() && (path[i] == '0' || path[i] == '-'))
+        {
+            i++;
+        }
+        while (i < path.size() && isdigit((unsigned char)path[i]))
+        {
+            i++;
+        }
+        if (i == path.size() || (path[i] != 'u' && path[i] != 'd' && path[i] != 'i'))
+        {
+            return false;
+        }
+        num_conversions++;
+    }
+    return num_conversions == 1;
+}
+} // namespace
+
+FrameRecorder::FrameRecorder(World &world, const std::string path,
+                             const FrameFormat format, const uint32_t stride,
+                             const int frame_width)
+    : m_world(world),
+      m_path(path),
+      m_format(format),
+      m_stride(std::max(stride, (uint32_t)1)),
+      m_width(frame_width)
+{
+    std::vector<double> world_dim = world.get_dimensions();
+    m_scale = m_width / world_dim[0];
+    m_height = world_dim[1] * m_scale;
+
+    if (m_format == FRAME_RAW)
+    {
+        m_raw_file = fopen(path.c_str(), "wb");
+        if (m_raw_file == nullptr)
+        {
+            throw std::runtime_error("Could not create video file " + path);
+        }
+    }
+    else if (!is_frame_pattern(path))
+    {
+        throw std::invalid_argument("PNG filename pattern must contain one frame number (e.g., %06u) and no other % (use %% for one): " + path);
+    }
+
+    // Scale the light pattern image to the frame once (black if there isn't
+    // one)
+    m_background.assign((size_t)m_width * m_height * 4, 0);
+    if (world.has_light_pattern())
+    {
+        const sf::Image &img = world.get_light_pattern();
+        const sf::Vector2u img_size = img.getSize();
+        const uint8_t *img_pixels = img.getPixelsPtr();
+        for (int py = 0; py < m_height && img_size.x > 0; py++)
+        {
+            const size_t iy = std::min((size_t)((py + 0.5) * img_size.y / m_height),
+                                       (size_t)img_size.y - 1);
+            for (int px = 0; px < m_width; px++)
+            {
+                const size_t ix = std::min((size_t)((px + 0.5) * img_size.x / m_width),
+                                           (size_t)img_size.x - 1);
+                memcpy(&m_background[((size_t)py * m_width + px) * 4],
+                       &img_pixels[(iy * img_size.x + ix) * 4], 4);
+            }
+        }
+    }
+    for (size_t i = 3; i < m_background.size(); i += 4)
+    {
+        m_background[i] = 255;
+    }
+    m_pixels.resize(m_background.size());
+    place_light_cells();
+
+    m_queue.resize(FRAME_QUEUE_SIZE);
+    m_encoder = std::thread(&FrameRecorder::encode_frames, this);
+}
+
+FrameRecorder::~FrameRecorder()
+{
+    close();
+}
+
+void FrameRecorder::close()
+{
+    if (m_closed)
+    {
+        return;
+    }
+    {
+        std::lock_guard<std::mutex> lock(m_queue_mutex);
+        m_stop_encoder = true;
+    }
+    m_frames_recorded.notify_one();
+    m_encoder.join();
+    if (m_raw_file != nullptr)
+    {
+        fclose(m_raw_file);
+        m_raw_file = nullptr;
+    }
+    m_closed = true;
+}
+
+void FrameRecorder::set_light_cell_size(const int pixels)
+{
+    m_light_cell = std::max(pixels, 1);
+    place_light_cells();
+}
+
+void FrameRecorder::place_light_cells()
+{
+    m_light_cols = (m_width + m_light_cell - 1) / m_light_cell;
+    m_light_rows = (m_height + m_light_cell - 1) / m_light_cell;
+    m_light_xs.resize((size_t)m_light_cols * m_light_rows);
+    m_light_ys.resize(m_light_xs.size());
+    for (int cy = 0; cy < m_light_rows; cy++)
+    {
+        for (int cx = 0; cx < m_light_cols; cx++)
+        {
+            // Frames have y pointing down; the World has y pointing up
+            const size_t i = (size_t)cy * m_light_cols + cx;
+            m_light_xs[i] = (cx + 0.5) * m_light_cell / m_scale;
+            m_light_ys[i] = (m_height - (cy + 0.5) * m_light_cell) / m_scale;
+        }
+    }
+}
+
+int FrameRecorder::get_frame_width() const
+{
+    return m_width;
+}
+
+int FrameRecorder::get_frame_height() const
+{
+    return m_height;
+}
+
+uint64_t FrameRecorder::get_num_frames() const
+{
+    return m_tail;
+}
+
+void FrameRecorder::record()
+{
+    if (m_closed)
+    {
+        fprintf(stderr, "WARNING: Cannot record after the FrameRecorder is closed\n");
+        return;
+    }
+    const int64_t tick = m_world.get_tick();
+    if (m_last_tick >= 0 && tick < m_last_tick + m_stride)
+    {
+        return;
+    }
+    m_last_tick = tick;
+
+    // Wait for a free slot in the queue (only if the encoder is behind)
+    size_t slot;
+    {
+        std::unique_lock<std::mutex> lock(m_queue_mutex);
+        m_frames_saved.wait(lock, [this]() { return m_tail - m_head < m_queue.size(); });
+        slot = m_tail % m_queue.size();
+    }
+
+    // The encoder doesn't read this slot until m_tail moves past it. The
+    // vectors are reused, so this doesn't allocate once the queue is full.
+    FrameSnapshot &frame = m_queue[slot];
+    frame.index = m_tail;
+    std::vector<Robot *> &robots = m_world.get_robots();
+    frame.robots.resize(robots.size());
+#pragma omp parallel for schedule(static)
+    for (size_t i = 0; i < robots.size(); i++)
+    {
+        const Robot &r = *robots[i];
+        RobotSnapshot &snap = frame.robots[i];
+        snap.x = r.x * m_scale;
+        snap.y = m_height - r.y * m_scale;
+        snap.theta = r.theta;
+        for (int c = 0; c < 3; c++)
+        {
+            snap.color[c] = std::min(std::max(r.color[c], 0.0), 1.0) * 255 + 0.5;
+        }
+    }
+    if (m_world.has_light_source())
+    {
+        // Light sources can change every tick, so sample the light now
+        m_world.get_ambientlight(m_light_xs, m_light_ys, m_light_values);
+        frame.light.resize(m_light_values.size());
+        for (size_t i = 0; i < m_light_values.size(); i++)
+        {
+            frame.light[i] = m_light_values[i] * 255 / 1023;
+        }
+        frame.light_cell = m_light_cell;
+        frame.light_cols = m_light_cols;
+    }
+    else
+    {
+        frame.light.clear();
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(m_queue_mutex);
+        m_tail++;
+    }
+    m_frames_recorded.notify_one();
+}
+
+void FrameRecorder::encode_frames()
+{
+    std::unique_lock<std::mutex> lock(m_queue_mutex);
+    while (true)
+    {
+        m_frames_recorded.wait(lock, [this]() { return m_head != m_tail || m_stop_encoder; });
+        if (m_head == m_tail)
+        {
+            // Asked to stop, and every frame has been saved
+            return;
+        }
+        // The simulation thread only fills slots after m_tail, so this one can
+        // be read without the lock
+        const FrameSnapshot &frame = m_queue[m_head % m_queue.size()];
+        lock.unlock();
+        render(frame);
+        save(frame);
+        lock.lock();
+        m_head++;
+        m_frames_saved.notify_all();
+    }
+}
+
+void FrameRecorder::render(const FrameSnapshot &frame)
+{
+    uint8_t *pixels = m_pixels.data();
+    if (frame.light.empty())
+    {
+        memcpy(pixels, m_background.data(), m_pixels.size());
+    }
+    else
+    {
+        for (int py = 0; py < m_height; py++)
+        {
+            const uint8_t *light_row = &frame.light[(size_t)(py / frame.light_cell) * frame.light_cols];
+            uint8_t *row = &pixels[(size_t)py * m_width * 4];
+            for (int px = 0; px < m_width; px++)
+            {
+                const uint8_t value = light_row[px / frame.light_cell];
+                row[px * 4] = value;
+                row[px * 4 + 1] = value;
+                row[px * 4 + 2] = value;
+                row[px * 4 + 3] = 255;
+            }
+        }
+    }
+
+    // Robots smaller than a pixel still cover the pixel they're in
+    const float radius = RADIUS * m_scale;
+    const float radius_sq = std::max(radius * radius, 0.5f);
+    // Like the Viewer, a line 2 pixels wide from the center to the front (left
+    // out when the robot is too small for it to be seen)
+    const bool draw_heading = radius >= 3;
+    const int reach = std::ceil(std::max(radius, 0.71f));
+    for (const RobotSnapshot &r : frame.robots)
+    {
+        const int x0 = std::max((int)std::floor(r.x) - reach, 0);
+        const int x1 = std::min((int)std::floor(r.x) + reach, m_width - 1);
+        const int y0 = std::max((int)std::floor(r.y) - reach, 0);
+        const int y1 = std::min((int)std::floor(r.y) + reach, m_height - 1);
+        const float cos_theta = cos(r.theta);
+        const float sin_theta = sin(r.theta);
+        for (int py = y0; py <= y1; py++)
+        {
+            const float dy = py + 0.5f - r.y;
+            uint8_t *row = &pixels[(size_t)py * m_width * 4];
+            for (int px = x0; px <= x1; px++)
+            {
+                const float dx = px + 0.5f - r.x;
+                if (dx * dx + dy * dy > radius_sq)
+                {
+                    continue;
+                }
+                // Heading on screen is (cos, -sin), since y points down
+                const float along = dx * cos_theta - dy * sin_theta;
+                const float across = dx * sin_theta + dy * cos_theta;
+                uint8_t *p = &row[px * 4];
+                if (draw_heading && along >= 0 && std::abs(across) <= 1)
+                {
+                    p[0] = p[1] = p[2] = 0;
+                }
+                else
+                {
+                    p[0] = r.color[0];
+                    p[1] = r.color[1];
+                    p[2] = r.color[2];
+                }
+            }
+        }
+    }
+}
+
+void FrameRecorder::save(const FrameSnapshot &frame)
+{
+    if (m_format == FRAME_RAW)
+    {
+        if (fwrite(m_pixels.data(), 1, m_pixels.size(), m_raw_file) != m_pixels.size())
+        {
+            fprintf(stderr, "WARNING: Failed to write frame %lu to %s\n",
+                    (unsigned long)frame.index, m_path.c_str());
+        }
+        return;
+    }
+
+    // The constructor checked that m_path has exactly one integer conversion
+    char filename[4096];
+    snprintf(filename, sizeof(filename), m_path.c_str(), (unsigned)frame.index);
+    // Only the image is used (not a window), so this works without a display
+    sf::Image image;
+    image.create(m_width, m_height, m_pixels.data());
+    if (!image.saveToFile(filename))
+    {
+        fprintf(stderr, "WARNING: Failed to save frame %s\n", filename);
+    }
+}
+
+} // namespace Kilosim
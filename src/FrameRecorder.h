@@ -0,0 +1,204 @@
+/*
+  Kilosim
+
+  Headless recording of simulations as video frames, rendered in software
+*/
+
+#ifndef __KILOSIM_FRAMERECORDER_H
+#define __KILOSIM_FRAMERECORDER_H
+
+#include "World.h"
+#include <string>
+#include <vector>
+#include <cstdio>
+#include <cstdint>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
+
+namespace Kilosim
+{
+//! How a FrameRecorder saves frames
+enum FrameFormat : uint8_t
+{
+  //! All frames in one file of raw RGBA pixels (8 bits per channel), one
+  //! frame after another
+  FRAME_RAW,
+  //! One PNG image per frame
+  FRAME_PNG
+};
+
+/*!
+ * A FrameRecorder draws a World into images, like a `Viewer`, but without a
+ * window or a GPU, so simulations can be recorded on machines without a
+ * display (e.g., over SSH or on a cluster). Robots are drawn as circles in
+ * their LED color, with a black line showing their heading, on top of the
+ * light pattern.
+ *
+ * Call `record()` after every `World::step()`; a frame is saved every
+ * `stride` ticks. `record()` only copies the robots' states; the frames are
+ * drawn and saved by a background thread. If that thread falls behind by more
+ * than a few frames, `record()` waits for it.
+ *
+ * Frames can be saved as PNG images or as raw video. For example, to turn raw
+ * video into an MP4 file with [FFmpeg](https://ffmpeg.org/):
+ *
+ * ```
+ * ffmpeg -f rawvideo -pix_fmt rgba -s WIDTHxHEIGHT -r 32 -i frames.rgba out.mp4
+ * ```
+ *
+ * where `WIDTHxHEIGHT` is the frame size (`get_frame_width()` and
+ * `get_frame_height()`). The file can also be a named pipe that FFmpeg reads
+ * from.
+ *
+ * If the World has a light source (`World::set_light_source()`), the light is
+ * sampled every time a frame is saved, in cells of a few pixels (see
+ * `set_light_cell_size()`). Otherwise the light pattern image is drawn. It's
+ * read when the recorder is created, so set the light pattern first.
+ */
+class FrameRecorder
+{
+private:
+  //! State of a robot needed to draw it (in pixels)
+  struct RobotSnapshot
+  {
+    float x;
+    float y;
+    float theta;
+    uint8_t color[3];
+  };
+
+  //! Everything needed to draw a frame, copied from the World by record()
+  struct FrameSnapshot
+  {
+    //! Number of the frame (from 0)
+    uint64_t index;
+    std::vector<RobotSnapshot> robots;
+    //! Light in each cell (0-255), if it comes from a light source
+    std::vector<uint8_t> light;
+    //! Size of the light cells (pixels) and number of them across the frame
+    //! when the light was sampled, since they can change while the frame is
+    //! waiting to be drawn
+    int light_cell;
+    int light_cols;
+  };
+
+  //! World that's recorded
+  World &m_world;
+  //! Where frames are saved: the raw video file, or the pattern of the PNG
+  //! filenames
+  std::string m_path;
+  //! How frames are saved
+  FrameFormat m_format;
+  //! Number of ticks between frames
+  uint32_t m_stride;
+  //! Size of the frames (pixels)
+  int m_width;
+  int m_height;
+  //! Pixels per mm
+  double m_scale;
+  //! Size of the square cells that light from a light source is sampled in
+  //! (pixels). This and the other light cell members are only used by the
+  //! simulation thread.
+  int m_light_cell = 8;
+  //! Number of light cells across and down the frame
+  int m_light_cols;
+  int m_light_rows;
+  //! Center of every light cell in the World (mm)
+  aligned_vector<double> m_light_xs;
+  aligned_vector<double> m_light_ys;
+  //! Light sampled in every cell
+  aligned_vector<uint16_t> m_light_values;
+  //! Light pattern image, scaled to the frame size (RGBA)
+  std::vector<uint8_t> m_background;
+  //! Frame being drawn (RGBA; only used by the encoder thread)
+  std::vector<uint8_t> m_pixels;
+  //! Raw video file (for FRAME_RAW)
+  FILE *m_raw_file = nullptr;
+  //! Ring buffer of frames waiting to be drawn and saved
+  std::vector<FrameSnapshot> m_queue;
+  //! Number of frames saved so far (the oldest queued frame)
+  uint64_t m_head = 0;
+  //! Number of frames recorded so far (the next free slot in the queue)
+  uint64_t m_tail = 0;
+  //! Protects m_head, m_tail, and m_stop_encoder
+  std::mutex m_queue_mutex;
+  //! Signalled when a frame is recorded (or the encoder should stop)
+  std::condition_variable m_frames_recorded;
+  //! Signalled when the encoder has saved a frame
+  std::condition_variable m_frames_saved;
+  //! Whether the encoder thread should finish
+  bool m_stop_encoder = false;
+  //! Background thread that draws and saves frames
+  std::thread m_encoder;
+  //! Tick of the last recorded frame (or -1 if none)
+  int64_t m_last_tick = -1;
+  //! Whether the recording has been closed
+  bool m_closed = false;
+
+  //! Find the center of every light cell
+  void place_light_cells();
+  //! Body of the encoder thread
+  void encode_frames();
+  //! Draw a frame into m_pixels
+  void render(const FrameSnapshot &frame);
+  //! Save m_pixels
+  void save(const FrameSnapshot &frame);
+
+public:
+  /*!
+   * Create a recording of a World
+   * @param world World to record
+   * @param path For `FRAME_RAW`, the file to save the video in (replaced if
+   * it exists). For `FRAME_PNG`, the pattern of the filenames, with a
+   * `printf`-style number for the frame number (e.g.,
+   * `"frames/frame_%06u.png"`). Any other `%` in it (including in a
+   * directory name) must be written as `%%`. Directories must already exist.
+   * @param format How to save frames (Default: PNG images)
+   * @param stride Number of ticks between frames (Default: 1, every tick)
+   * @param frame_width Width of the frames (pixels). The height is set from
+   * the aspect ratio of the World. (Default: 1080)
+   * @throws std::runtime_error if the video file can't be created
+   * @throws std::invalid_argument if a PNG filename pattern doesn't have
+   * exactly one number, or has any other `%` conversion
+   */
+  FrameRecorder(World &world, const std::string path,
+                const FrameFormat format = FRAME_PNG, const uint32_t stride = 1,
+                const int frame_width = 1080);
+  //! Destructor: saves any waiting frames
+  ~FrameRecorder();
+
+  /*!
+   * Record a frame if `stride` ticks have passed since the last one (the
+   * first call always records). Calling this again in the same tick does
+   * nothing.
+   */
+  void record();
+
+  /*!
+   * Save all of the waiting frames, stop the background thread, and close the
+   * video file. Nothing can be recorded afterwards. This is done
+   * automatically when the recorder is destroyed.
+   */
+  void close();
+
+  /*!
+   * Set the size of the cells that light from a light source is sampled in.
+   * Light is sampled once per cell for every frame (on the simulation
+   * thread), so smaller cells show more detail but make `record()` slower.
+   * @param pixels Side of each cell (Default: 8)
+   */
+  void set_light_cell_size(const int pixels);
+
+  //! Get the width of the frames (pixels)
+  int get_frame_width() const;
+
+  //! Get the height of the frames (pixels)
+  int get_frame_height() const;
+
+  //! Get the number of frames recorded so far
+  uint64_t get_num_frames() const;
+};
+} // namespace Kilosim
+
+#endif
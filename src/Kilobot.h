@@ -4,6 +4,7 @@
 
 #include "Robot.h"
 #include "random.hpp"
+#include "Checkpoint.h"
 
 namespace Kilosim
 {
@@ -137,6 +138,32 @@ private:
 			tx_request = 0;
 	}
 
+	//! Save the Kilobot's state and the user implementation's (save_state())
+	void save(CheckpointWriter &out) const
+	{
+		out.write(left_ready);
+		out.write(right_ready);
+		out.write(m_turn_right);
+		out.write(m_turn_left);
+		out.write(distance_measurement);
+		out.write(message_sent);
+		out.write(kilo_ticks);
+		save_state(out);
+	}
+
+	//! Restore the state written by save()
+	void load(CheckpointReader &in)
+	{
+		in.read(left_ready);
+		in.read(right_ready);
+		in.read(m_turn_right);
+		in.read(m_turn_left);
+		in.read(distance_measurement);
+		in.read(message_sent);
+		in.read(kilo_ticks);
+		load_state(in);
+	}
+
 protected:
 	/***************************************************************************
 	 * REQUIRED USER API FUNCTIONS
@@ -182,6 +209,41 @@ protected:
 	 */
 	virtual void message_tx_success() = 0;
 
+	/*!
+	 * [User API] Save the state of your Kilobot for a checkpoint (see
+	 * `World::save_state()`). Write every member variable that can change
+	 * after `setup()`, for example:
+	 *
+	 * ```
+	 * void save_state(CheckpointWriter &out) const
+	 * {
+	 *     out.write(transmit_msg);
+	 *     out.write(last_checked);
+	 * }
+	 * ```
+	 *
+	 * Anything that isn't saved keeps its current value when a checkpoint is
+	 * restored, so the simulation won't continue exactly as it would have. (By
+	 * default, nothing is saved.)
+	 * @param out Checkpoint to write the state into
+	 */
+	virtual void save_state(CheckpointWriter &out) const {}
+
+	/*!
+	 * [User API] Restore the state saved by `save_state()`, reading the
+	 * variables in the same order they were written:
+	 *
+	 * ```
+	 * void load_state(CheckpointReader &in)
+	 * {
+	 *     in.read(transmit_msg);
+	 *     in.read(last_checked);
+	 * }
+	 * ```
+	 * @param in Checkpoint to read the state from
+	 */
+	virtual void load_state(CheckpointReader &in) {}
+
 	/***************************************************************************
 	 * KILOLIB API FUNCTIONS
 	 **************************************************************************/
@@ -282,8 +344,8 @@ protected:
 		if (m_light_pattern)
 		{
 			// Get point at front/nose of robot
-			int pos_x = x + RADIUS * 1 * cos(theta);
-			int pos_y = y + RADIUS * 1 * sin(theta);
+			double pos_x = x + RADIUS * 1 * cos(theta);
+			double pos_y = y + RADIUS * 1 * sin(theta);
 			// Get the 10-bit light intensity from the robot
 			return m_light_pattern->get_ambientlight(pos_x, pos_y);
 		}
@@ -328,12 +390,17 @@ protected:
 		color[2] = c.blue;
 	}
 
-	bool comm_criteria(double dist)
+	bool comm_criteria(double dist) const
 	{
 		// Standard circular transmission area
 		return dist <= m_comm_range;
 	}
 
+	double comm_range() const
+	{
+		return m_comm_range;
+	}
+
 	void *get_message()
 	{
 		void *m = this->message_tx();
@@ -344,6 +411,11 @@ protected:
 		return m;
 	}
 
+	size_t message_size() const
+	{
+		return sizeof(message_t);
+	}
+
 	void received()
 	{
 		message_sent = true;
@@ -0,0 +1,315 @@
+/*
+    Kilosim
+
+    Batched (vectorized) kinematics for all Robots in a World
+*/
+
+#include "Kinematics.h"
+#include <cmath>
+
+#if defined(__AVX512F__) || defined(__AVX2__)
+#include <immintrin.h>
+#endif
+
+namespace Kilosim
+{
+namespace
+{
+// The robot kinematics in Robot::robot_compute_next_step() can all be written
+// as a displacement along a rotated direction:
+//
+//     new_x = x + a * cos(angle) + b * sin(angle)
+//     new_y = y + a * sin(angle) - b * cos(angle)
+//     new_theta = wrap(theta + phi)
+//
+// - forward:     angle = theta,                phi = 0,
+//                a = forward_speed * dt,       b = 0
+// - CW rotation: angle = theta + phi + 4*PI/3, phi = -turn_speed * dt,
+//                a = RADIUS * (1 - cos(phi)),  b = RADIUS * sin(phi)
+// - CCW rotation: same, but with 2*PI/3 and phi = turn_speed * dt
+// - stopped:     phi = 0, a = 0, b = 0
+//
+// so each robot needs two sincos evaluations regardless of its motor command.
+
+constexpr double TWO_PI = 2 * PI;
+constexpr double INV_TWO_PI = 1 / (2 * PI);
+constexpr double TWO_OVER_PI = 2 / PI;
+constexpr double CW_OFFSET = 4 * PI / 3;
+constexpr double CCW_OFFSET = 2 * PI / 3;
+
+// pi/2 split into three parts for accurate range reduction (Cody-Waite)
+constexpr double DP1 = 1.570796310901641845703125;
+constexpr double DP2 = 1.589325471229585673428e-8;
+constexpr double DP3 = 6.12323399573676588614e-17;
+
+// Minimax polynomial coefficients for sin and cos on [-pi/4, pi/4] (Cephes)
+constexpr double S0 = 1.58962301576546568060e-10;
+constexpr double S1 = -2.50507477628578072866e-8;
+constexpr double S2 = 2.75573136213857245213e-6;
+constexpr double S3 = -1.98412698295895385996e-4;
+constexpr double S4 = 8.33333333332211858878e-3;
+constexpr double S5 = -1.66666666666666307295e-1;
+constexpr double C0 = -1.13585365213876817300e-11;
+constexpr double C1 = 2.08757008419747316778e-9;
+constexpr double C2 = -2.75573141792967388112e-7;
+constexpr double C3 = 2.48015872888517045348e-5;
+constexpr double C4 = -1.38888888888730564116e-3;
+constexpr double C5 = 4.16666666666665929218e-2;
+
+//! Branch-free sine and cosine of an angle (in radians)
+inline void sincos_poly(const double angle, double &s, double &c)
+{
+    // Reduce to r in [-pi/4, pi/4], where angle = r + n * pi/2
+    const double n = std::floor(angle * TWO_OVER_PI + 0.5);
+    const double r = ((angle - n * DP1) - n * DP2) - n * DP3;
+    const double z = r * r;
+    const double ps = r + r * z * (((((S0 * z + S1) * z + S2) * z + S3) * z + S4) * z + S5);
+    const double pc = 1.0 - 0.5 * z + z * z * (((((C0 * z + C1) * z + C2) * z + C3) * z + C4) * z + C5);
+    // Quadrant (0-3) of the angle decides which polynomial to use and the sign
+    const double q = n - 4 * std::floor(n * 0.25);
+    const bool swap = q == 1 || q == 3;
+    const double sv = swap ? pc : ps;
+    const double cv = swap ? ps : pc;
+    s = q >= 2 ? -sv : sv;
+    c = (q == 1 || q == 2) ? -cv : cv;
+}
+
+//! Next pose of a single robot (see the description above)
+inline void next_step_one(const RobotStore &store, const double dt,
+                          PoseArrays &new_poses, const size_t i)
+{
+    const int cmd = store.motor_command[i];
+    const bool forward = cmd == 1;
+    const bool cw = cmd == 2;
+    const bool ccw = cmd == 3;
+    const bool turning = cw || ccw;
+    const double turn = store.turn_speed[i] * dt;
+    const double phi = cw ? -turn : (ccw ? turn : 0.0);
+    const double angle = forward ? store.theta[i]
+                                 : store.theta[i] + phi + (cw ? CW_OFFSET : CCW_OFFSET);
+    double sa, ca, sp, cp;
+    sincos_poly(angle, sa, ca);
+    sincos_poly(phi, sp, cp);
+    const double a = forward ? store.forward_speed[i] * dt
+                             : (turning ? RADIUS * (1 - cp) : 0.0);
+    const double b = turning ? RADIUS * sp : 0.0;
+    new_poses.x[i] = store.x[i] + a * ca + b * sa;
+    new_poses.y[i] = store.y[i] + a * sa - b * ca;
+    const double t = store.theta[i] + phi;
+    new_poses.theta[i] = t - TWO_PI * std::floor(t * INV_TWO_PI);
+}
+
+#if defined(__AVX512F__)
+
+// The unmasked _mm512_roundscale_pd and _mm512_cvtepi32_pd are built on an
+// undefined source vector, which GCC reports as maybe uninitialized. The
+// zero-masked forms with every lane selected compile to the same instructions.
+constexpr __mmask8 ALL_LANES = 0xFF;
+
+//! Evaluate a polynomial in z by Horner's method, highest coefficient first
+inline __m512d horner8(const __m512d z, const double c0, const double c1,
+                       const double c2, const double c3, const double c4,
+                       const double c5)
+{
+    __m512d p = _mm512_set1_pd(c0);
+    p = _mm512_add_pd(_mm512_mul_pd(p, z), _mm512_set1_pd(c1));
+    p = _mm512_add_pd(_mm512_mul_pd(p, z), _mm512_set1_pd(c2));
+    p = _mm512_add_pd(_mm512_mul_pd(p, z), _mm512_set1_pd(c3));
+    p = _mm512_add_pd(_mm512_mul_pd(p, z), _mm512_set1_pd(c4));
+    return _mm512_add_pd(_mm512_mul_pd(p, z), _mm512_set1_pd(c5));
+}
+
+//! sincos_poly for 8 angles at once
+inline void sincos8(const __m512d angle, __m512d &s, __m512d &c)
+{
+    const __m512d zero = _mm512_setzero_pd();
+    const __m512d n = _mm512_maskz_roundscale_pd(
+        ALL_LANES, _mm512_mul_pd(angle, _mm512_set1_pd(TWO_OVER_PI)),
+        _MM_FROUND_TO_NEAREST_INT);
+    __m512d r = _mm512_sub_pd(angle, _mm512_mul_pd(n, _mm512_set1_pd(DP1)));
+    r = _mm512_sub_pd(r, _mm512_mul_pd(n, _mm512_set1_pd(DP2)));
+    r = _mm512_sub_pd(r, _mm512_mul_pd(n, _mm512_set1_pd(DP3)));
+    const __m512d z = _mm512_mul_pd(r, r);
+    const __m512d ps = _mm512_add_pd(
+        r, _mm512_mul_pd(_mm512_mul_pd(r, z), horner8(z, S0, S1, S2, S3, S4, S5)));
+    const __m512d pc = _mm512_add_pd(
+        _mm512_sub_pd(_mm512_set1_pd(1.0), _mm512_mul_pd(_mm512_set1_pd(0.5), z)),
+        _mm512_mul_pd(_mm512_mul_pd(z, z), horner8(z, C0, C1, C2, C3, C4, C5)));
+    const __m512d q = _mm512_sub_pd(
+        n, _mm512_mul_pd(_mm512_set1_pd(4.0),
+                         _mm512_maskz_roundscale_pd(ALL_LANES,
+                                                    _mm512_mul_pd(n, _mm512_set1_pd(0.25)),
+                                                    _MM_FROUND_TO_NEG_INF)));
+    const __mmask8 q1 = _mm512_cmp_pd_mask(q, _mm512_set1_pd(1.0), _CMP_EQ_OQ);
+    const __mmask8 q2 = _mm512_cmp_pd_mask(q, _mm512_set1_pd(2.0), _CMP_EQ_OQ);
+    const __mmask8 q3 = _mm512_cmp_pd_mask(q, _mm512_set1_pd(3.0), _CMP_EQ_OQ);
+    const __mmask8 swap = q1 | q3;
+    const __m512d sv = _mm512_mask_blend_pd(swap, ps, pc);
+    const __m512d cv = _mm512_mask_blend_pd(swap, pc, ps);
+    s = _mm512_mask_sub_pd(sv, q2 | q3, zero, sv);
+    c = _mm512_mask_sub_pd(cv, q1 | q2, zero, cv);
+}
+
+//! next_step_one for 8 robots at once, starting at index i
+inline void next_step_8(const RobotStore &store, const double dt,
+                        PoseArrays &new_poses, const size_t i)
+{
+    const __m512d zero = _mm512_setzero_pd();
+    const __m512d vdt = _mm512_set1_pd(dt);
+    const __m512d cmd = _mm512_maskz_cvtepi32_pd(
+        ALL_LANES, _mm256_loadu_si256((const __m256i *)&store.motor_command[i]));
+    const __mmask8 forward = _mm512_cmp_pd_mask(cmd, _mm512_set1_pd(1.0), _CMP_EQ_OQ);
+    const __mmask8 cw = _mm512_cmp_pd_mask(cmd, _mm512_set1_pd(2.0), _CMP_EQ_OQ);
+    const __mmask8 ccw = _mm512_cmp_pd_mask(cmd, _mm512_set1_pd(3.0), _CMP_EQ_OQ);
+    const __mmask8 turning = cw | ccw;
+
+    const __m512d x = _mm512_loadu_pd(&store.x[i]);
+    const __m512d y = _mm512_loadu_pd(&store.y[i]);
+    const __m512d theta = _mm512_loadu_pd(&store.theta[i]);
+    const __m512d turn = _mm512_mul_pd(_mm512_loadu_pd(&store.turn_speed[i]), vdt);
+    __m512d phi = _mm512_mask_blend_pd(ccw, zero, turn);
+    phi = _mm512_mask_sub_pd(phi, cw, zero, turn);
+    const __m512d offset = _mm512_mask_blend_pd(cw, _mm512_set1_pd(CCW_OFFSET),
+                                                _mm512_set1_pd(CW_OFFSET));
+    const __m512d angle = _mm512_mask_blend_pd(
+        forward, _mm512_add_pd(_mm512_add_pd(theta, phi), offset), theta);
+
+    __m512d sa, ca, sp, cp;
+    sincos8(angle, sa, ca);
+    sincos8(phi, sp, cp);
+    const __m512d vradius = _mm512_set1_pd(RADIUS);
+    __m512d a = _mm512_mask_blend_pd(
+        turning, zero, _mm512_mul_pd(vradius, _mm512_sub_pd(_mm512_set1_pd(1.0), cp)));
+    a = _mm512_mask_blend_pd(
+        forward, a, _mm512_mul_pd(_mm512_loadu_pd(&store.forward_speed[i]), vdt));
+    const __m512d b = _mm512_mask_blend_pd(turning, zero, _mm512_mul_pd(vradius, sp));
+
+    _mm512_storeu_pd(&new_poses.x[i], _mm512_add_pd(
+        x, _mm512_add_pd(_mm512_mul_pd(a, ca), _mm512_mul_pd(b, sa))));
+    _mm512_storeu_pd(&new_poses.y[i], _mm512_add_pd(
+        y, _mm512_sub_pd(_mm512_mul_pd(a, sa), _mm512_mul_pd(b, ca))));
+    const __m512d t = _mm512_add_pd(theta, phi);
+    const __m512d turns = _mm512_maskz_roundscale_pd(
+        ALL_LANES, _mm512_mul_pd(t, _mm512_set1_pd(INV_TWO_PI)), _MM_FROUND_TO_NEG_INF);
+    _mm512_storeu_pd(&new_poses.theta[i],
+                     _mm512_sub_pd(t, _mm512_mul_pd(_mm512_set1_pd(TWO_PI), turns)));
+}
+
+constexpr size_t LANES = 8;
+
+#elif defined(__AVX2__)
+
+//! Evaluate a polynomial in z by Horner's method, highest coefficient first
+inline __m256d horner4(const __m256d z, const double c0, const double c1,
+                       const double c2, const double c3, const double c4,
+                       const double c5)
+{
+    __m256d p = _mm256_set1_pd(c0);
+    p = _mm256_add_pd(_mm256_mul_pd(p, z), _mm256_set1_pd(c1));
+    p = _mm256_add_pd(_mm256_mul_pd(p, z), _mm256_set1_pd(c2));
+    p = _mm256_add_pd(_mm256_mul_pd(p, z), _mm256_set1_pd(c3));
+    p = _mm256_add_pd(_mm256_mul_pd(p, z), _mm256_set1_pd(c4));
+    return _mm256_add_pd(_mm256_mul_pd(p, z), _mm256_set1_pd(c5));
+}
+
+//! sincos_poly for 4 angles at once
+inline void sincos4(const __m256d angle, __m256d &s, __m256d &c)
+{
+    const __m256d sign = _mm256_set1_pd(-0.0);
+    const __m256d n = _mm256_round_pd(
+        _mm256_mul_pd(angle, _mm256_set1_pd(TWO_OVER_PI)),
+        _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC);
+    __m256d r = _mm256_sub_pd(angle, _mm256_mul_pd(n, _mm256_set1_pd(DP1)));
+    r = _mm256_sub_pd(r, _mm256_mul_pd(n, _mm256_set1_pd(DP2)));
+    r = _mm256_sub_pd(r, _mm256_mul_pd(n, _mm256_set1_pd(DP3)));
+    const __m256d z = _mm256_mul_pd(r, r);
+    const __m256d ps = _mm256_add_pd(
+        r, _mm256_mul_pd(_mm256_mul_pd(r, z), horner4(z, S0, S1, S2, S3, S4, S5)));
+    const __m256d pc = _mm256_add_pd(
+        _mm256_sub_pd(_mm256_set1_pd(1.0), _mm256_mul_pd(_mm256_set1_pd(0.5), z)),
+        _mm256_mul_pd(_mm256_mul_pd(z, z), horner4(z, C0, C1, C2, C3, C4, C5)));
+    const __m256d q = _mm256_sub_pd(
+        n, _mm256_mul_pd(_mm256_set1_pd(4.0),
+                         _mm256_floor_pd(_mm256_mul_pd(n, _mm256_set1_pd(0.25)))));
+    const __m256d q1 = _mm256_cmp_pd(q, _mm256_set1_pd(1.0), _CMP_EQ_OQ);
+    const __m256d q2 = _mm256_cmp_pd(q, _mm256_set1_pd(2.0), _CMP_EQ_OQ);
+    const __m256d q3 = _mm256_cmp_pd(q, _mm256_set1_pd(3.0), _CMP_EQ_OQ);
+    const __m256d swap = _mm256_or_pd(q1, q3);
+    const __m256d sv = _mm256_blendv_pd(ps, pc, swap);
+    const __m256d cv = _mm256_blendv_pd(pc, ps, swap);
+    // Flip the sign bit where the quadrant makes the value negative
+    s = _mm256_xor_pd(sv, _mm256_and_pd(_mm256_or_pd(q2, q3), sign));
+    c = _mm256_xor_pd(cv, _mm256_and_pd(_mm256_or_pd(q1, q2), sign));
+}
+
+//! next_step_one for 4 robots at once, starting at index i
+inline void next_step_4(const RobotStore &store, const double dt,
+                        PoseArrays &new_poses, const size_t i)
+{
+    const __m256d zero = _mm256_setzero_pd();
+    const __m256d vdt = _mm256_set1_pd(dt);
+    const __m256d cmd = _mm256_cvtepi32_pd(
+        _mm_loadu_si128((const __m128i *)&store.motor_command[i]));
+    const __m256d forward = _mm256_cmp_pd(cmd, _mm256_set1_pd(1.0), _CMP_EQ_OQ);
+    const __m256d cw = _mm256_cmp_pd(cmd, _mm256_set1_pd(2.0), _CMP_EQ_OQ);
+    const __m256d ccw = _mm256_cmp_pd(cmd, _mm256_set1_pd(3.0), _CMP_EQ_OQ);
+    const __m256d turning = _mm256_or_pd(cw, ccw);
+
+    const __m256d x = _mm256_loadu_pd(&store.x[i]);
+    const __m256d y = _mm256_loadu_pd(&store.y[i]);
+    const __m256d theta = _mm256_loadu_pd(&store.theta[i]);
+    const __m256d turn = _mm256_mul_pd(_mm256_loadu_pd(&store.turn_speed[i]), vdt);
+    __m256d phi = _mm256_blendv_pd(zero, turn, ccw);
+    phi = _mm256_blendv_pd(phi, _mm256_sub_pd(zero, turn), cw);
+    const __m256d offset = _mm256_blendv_pd(_mm256_set1_pd(CCW_OFFSET),
+                                            _mm256_set1_pd(CW_OFFSET), cw);
+    const __m256d angle = _mm256_blendv_pd(
+        _mm256_add_pd(_mm256_add_pd(theta, phi), offset), theta, forward);
+
+    __m256d sa, ca, sp, cp;
+    sincos4(angle, sa, ca);
+    sincos4(phi, sp, cp);
+    const __m256d vradius = _mm256_set1_pd(RADIUS);
+    __m256d a = _mm256_and_pd(
+        turning, _mm256_mul_pd(vradius, _mm256_sub_pd(_mm256_set1_pd(1.0), cp)));
+    a = _mm256_blendv_pd(
+        a, _mm256_mul_pd(_mm256_loadu_pd(&store.forward_speed[i]), vdt), forward);
+    const __m256d b = _mm256_and_pd(turning, _mm256_mul_pd(vradius, sp));
+
+    _mm256_storeu_pd(&new_poses.x[i], _mm256_add_pd(
+        x, _mm256_add_pd(_mm256_mul_pd(a, ca), _mm256_mul_pd(b, sa))));
+    _mm256_storeu_pd(&new_poses.y[i], _mm256_add_pd(
+        y, _mm256_sub_pd(_mm256_mul_pd(a, sa), _mm256_mul_pd(b, ca))));
+    const __m256d t = _mm256_add_pd(theta, phi);
+    const __m256d turns = _mm256_floor_pd(_mm256_mul_pd(t, _mm256_set1_pd(INV_TWO_PI)));
+    _mm256_storeu_pd(&new_poses.theta[i],
+                     _mm256_sub_pd(t, _mm256_mul_pd(_mm256_set1_pd(TWO_PI), turns)));
+}
+
+constexpr size_t LANES = 4;
+
+#endif
+} // namespace
+
+void compute_next_steps(const RobotStore &store, const double dt,
+                        PoseArrays &new_poses, const size_t begin,
+                        const size_t end)
+{
+    size_t i = begin;
+#if defined(__AVX512F__)
+    for (; i + LANES <= end; i += LANES)
+        next_step_8(store, dt, new_poses, i);
+#elif defined(__AVX2__)
+    for (; i + LANES <= end; i += LANES)
+        next_step_4(store, dt, new_poses, i);
+#else
+#pragma omp simd
+    for (size_t j = begin; j < end; j++)
+        next_step_one(store, dt, new_poses, j);
+    i = end;
+#endif
+    // Robots left over after the last full vector
+    for (; i < end; i++)
+        next_step_one(store, dt, new_poses, i);
+}
+} // namespace Kilosim
@@ -0,0 +1,38 @@
+/*
+    Kilosim
+
+    Batched (vectorized) kinematics for all Robots in a World
+*/
+
+#ifndef __KILOSIM_KINEMATICS_H
+#define __KILOSIM_KINEMATICS_H
+
+#include "RobotStore.h"
+
+namespace Kilosim
+{
+/*!
+ * Compute the next pose of every robot in a range as if it doesn't run into
+ * anything. This is the batched equivalent of calling
+ * `Robot::robot_compute_next_step()` on each robot, which remains the
+ * reference implementation. Results agree with it to within rounding error.
+ *
+ * Instead of branching on each robot's motor command, the displacement for
+ * every command is written in the same form and the inputs are blended, so
+ * many robots can be processed at once. The instruction set is chosen at
+ * compile time: AVX-512 (8 robots at a time), AVX2 (4 robots at a time), or a
+ * portable loop for the compiler to vectorize. (The Makefile compiles with
+ * `-march=native`, so the widest available one is used.)
+ *
+ * @param store Current physical state of the robots
+ * @param dt Seconds per tick
+ * @param new_poses Poses in which to save the results
+ * @param begin Index of the first robot to compute
+ * @param end One past the index of the last robot to compute
+ */
+void compute_next_steps(const RobotStore &store, const double dt,
+                        PoseArrays &new_poses, const size_t begin,
+                        const size_t end);
+} // namespace Kilosim
+
+#endif
@@ -25,23 +25,16 @@ void LightPattern::pattern_init(const double arena_width,
     set_light_pattern(img_src);
 }
 
-uint16_t LightPattern::get_ambientlight(const double x, const double y) const
+uint16_t LightPattern::get_ambientlight(const double x, const double y,
+                                        const uint32_t tick) const
 {
-    if (m_has_source)
+    if (m_light_source)
     {
-        // Transform from world coordinates to image coordinates
-        uint x_in_img = x * m_scale;
-        uint y_in_img = y * m_scale;
-
-        // Get the Color with the y-axis coordinate flip (each is 8-bit)
-        sf::Color c = m_light_pattern.getPixel(x_in_img,
-                                               m_img_dim.y - y_in_img - 1);
-        // Convert the color from RGB to grayscale using approximate luminosity
-        // Each value is 8-bit, so the resulting value is in the scale [0-255]
-        double luminosity = (0.3 * c.r) + (0.59 * c.g) + (0.11 * c.b);
-        // Scale to 10-bit [0-1023]
-        uint16_t lum_10bit = (uint16_t)luminosity * 4;
-        return lum_10bit;
+        return m_light_source->get_ambientlight(x, y, tick);
+    }
+    else if (m_has_source)
+    {
+        return m_luminance.get_ambientlight(x, y);
     }
     else
     {
@@ -49,8 +42,53 @@ uint16_t LightPattern::get_ambientlight(const double x, const double y) const
     }
 };
 
-sf::Image LightPattern::get_light_pattern() const
+uint16_t LightPattern::get_ambientlight(const double x, const double y) const
+{
+    return get_ambientlight(x, y, m_tick);
+}
+
+void LightPattern::get_ambientlight(const aligned_vector<double> &xs,
+                                    const aligned_vector<double> &ys,
+                                    aligned_vector<uint16_t> &light) const
+{
+    if (m_light_source)
+    {
+        m_light_source->get_ambientlight(xs, ys, m_tick, light);
+    }
+    else if (m_has_source)
+    {
+        m_luminance.get_ambientlight(xs, ys, light);
+    }
+    else
+    {
+        light.assign(xs.size(), 0);
+    }
+}
+
+void LightPattern::update(const uint32_t tick)
+{
+    m_tick = tick;
+    if (m_light_source)
+    {
+        m_light_source->update(tick);
+    }
+}
+
+const sf::Image &LightPattern::get_light_pattern() const
 {
+    if (m_has_source && !m_image_loaded)
+    {
+        if (m_img_src.size() >= 4 &&
+            m_img_src.compare(m_img_src.size() - 4, 4, ".lum") == 0)
+        {
+            m_light_pattern = m_luminance.to_image();
+        }
+        else if (!m_light_pattern.loadFromFile(m_img_src))
+        {
+            m_light_pattern = m_luminance.to_image();
+        }
+        m_image_loaded = true;
+    }
     return m_light_pattern;
 };
 
@@ -59,15 +97,41 @@ bool LightPattern::has_source() const
     return m_has_source;
 }
 
+bool LightPattern::has_light_source() const
+{
+    return m_light_source != nullptr;
+}
+
 void LightPattern::set_light_pattern(const std::string img_src)
 {
-    if (!m_light_pattern.loadFromFile(img_src))
+    try
     {
+        m_luminance.load(img_src, m_arena_width);
+    }
+    catch (const std::runtime_error &e)
+    {
+        std::cerr << e.what() << std::endl;
         exit(EXIT_FAILURE);
     }
-    // Set scaling and image dimensions when new image loaded
-    m_img_dim = m_light_pattern.getSize();
-    m_scale = (double)m_img_dim.x / m_arena_width;
+    m_img_src = img_src;
+    m_light_pattern = sf::Image();
+    m_image_loaded = false;
     m_has_source = true;
+    m_light_source = nullptr;
 };
+
+void LightPattern::set_light_source(std::shared_ptr<LightSource> light_source)
+{
+    m_light_source = light_source;
+    if (m_light_source)
+    {
+        m_light_source->update(m_tick);
+    }
+}
+
+void LightPattern::set_sampling(const LightSampling sampling,
+                                const double footprint_radius)
+{
+    m_luminance.set_sampling(sampling, footprint_radius);
+}
 } // namespace Kilosim
@@ -9,7 +9,10 @@
 
 #include <string>
 #include <iostream>
+#include <cstdint>
+#include <memory>
 #include <SFML/Graphics.hpp>
+#include "LightSource.h"
 
 namespace Kilosim
 {
@@ -18,20 +21,40 @@ namespace Kilosim
  * makes the simplifying assumption that perceived light intensity from the
  * sensors is linearly proportional to the luminosity. Any non-monochrome images
  * will be converted to grayscale by a luminosity for computing light intensity.
+ *
+ * The image is converted to 10-bit light intensities once, when it's loaded,
+ * so looking up the light at a point is a single array access. The light
+ * intensities are shared by every LightPattern in the process that uses the
+ * same file. For very large patterns, convert the image to a luminance file
+ * (`.lum`, with `LuminanceGrid::write_file()`), which is memory-mapped instead
+ * of read, so it is also shared between processes.
+ *
+ * Instead of a static image, the light can come from a `LightSource`, which
+ * can change over time (such as an `ImageSequence` or a moving `PointLight`).
+ * The World tells the LightPattern the current tick with `update()` at the
+ * start of every tick, and lookups without a tick use that one.
  */
 class LightPattern
 {
 private:
-  //! Ambient light in the world
-  sf::Image m_light_pattern;
+  //! Image of the ambient light in the world, only loaded when it's requested
+  //! (for display) by get_light_pattern()
+  mutable sf::Image m_light_pattern;
+  //! Whether m_light_pattern has been loaded from m_img_src
+  mutable bool m_image_loaded = false;
+  //! Filename of the light pattern image
+  std::string m_img_src;
   //! Width of the World (in mm), as set at initialization
   double m_arena_width;
-  //! Dimensions of internal image (to minimize recomputation)
-  sf::Vector2u m_img_dim;
-  //! Scaling between world dimensions/coordinates and image coordinates
-  double m_scale;
   //! Whether an image has been provided for light. (If not, always black)
   bool m_has_source;
+  //! 10-bit light intensities of the image (shared between all
+  //! LightPatterns that use the same file)
+  LuminanceGrid m_luminance;
+  //! Time-varying light, used instead of the image if set
+  std::shared_ptr<LightSource> m_light_source;
+  //! Current tick of the World
+  uint32_t m_tick = 0;
 
 public:
   /*!
@@ -69,15 +92,47 @@ public:
    * set_light_pattern), it will always return 0 (black).
    * @param x Robot x position (from left) in mm
    * @param y Robot y position (from bottom) in mm
+   * @param tick Tick of the World at which to get the light
+   * @return 10-bit light value (matching kilobot API)
+   */
+  uint16_t get_ambientlight(const double x, const double y,
+                            const uint32_t tick) const;
+
+  /*!
+   * Get a 10-bit light intensity (0-1023) at the current tick (from the last
+   * `update()`)
+   * @param x Robot x position (from left) in mm
+   * @param y Robot y position (from bottom) in mm
    * @return 10-bit light value (matching kilobot API)
    */
   uint16_t get_ambientlight(const double x, const double y) const;
 
   /*!
-   * Get the Internal Image representing the light pattern.
+   * Get the 10-bit light intensities at many points at once, at the current
+   * tick. This is the same as calling `get_ambientlight(x, y)` for each point,
+   * but is vectorized.
+   * @param xs x positions (from left) in mm
+   * @param ys y positions (from bottom) in mm
+   * @param light Light value at each point (resized to match xs)
+   */
+  void get_ambientlight(const aligned_vector<double> &xs,
+                        const aligned_vector<double> &ys,
+                        aligned_vector<uint16_t> &light) const;
+
+  /*!
+   * Set the current tick, and let the light source prepare for it. The World
+   * calls this at the start of every tick.
+   * @param tick Tick that's about to run
+   */
+  void update(const uint32_t tick);
+
+  /*!
+   * Get the Internal Image representing the light pattern. The image is only
+   * loaded (or, for a luminance file, drawn in grayscale) the first time this
+   * is called, since it's only needed for display. This is not thread-safe.
    * @return Image of the light pattern (full color)
    */
-  sf::Image get_light_pattern() const;
+  const sf::Image &get_light_pattern() const;
 
   /*!
    * Check if a source has been set for this LightPattern
@@ -85,11 +140,37 @@ public:
    */
   bool has_source() const;
 
+  /*!
+   * Check if a light source (that can change over time) is used instead of
+   * the image
+   * @return Whether a light source was set with `set_light_source()`
+   */
+  bool has_light_source() const;
+
   /*!
    * Set the light pattern to a new image source file
-   * @param img_src Filename (+location) of the new light source image
+   * @param img_src Filename (+location) of the new light source image, or of a
+   * luminance file (ending in `.lum`)
    */
   void set_light_pattern(const std::string img_src);
+
+  /*!
+   * Use a light source that can change over time instead of an image. Setting
+   * an image with `set_light_pattern()` afterwards replaces it.
+   * @param light_source Light source to use (or nullptr to go back to the
+   * image, if there is one)
+   */
+  void set_light_source(std::shared_ptr<LightSource> light_source);
+
+  /*!
+   * Set how light is sampled from the image (see
+   * `LuminanceGrid::set_sampling()`). This is kept if the image is changed.
+   * @param sampling How to sample light
+   * @param footprint_radius For `LIGHT_SAMPLE_AREA`, half the side of the
+   * square to average the light over (mm)
+   */
+  void set_sampling(const LightSampling sampling,
+                    const double footprint_radius = 0);
 };
 } // namespace Kilosim
 #endif
\ No newline at end of file
@@ -0,0 +1,527 @@
+/*
+    Kilosim
+
+    Light fields that can change over time: image sequences and procedural lights
+*/
+
+#include "LightSource.h"
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <map>
+#include <mutex>
+#include <stdexcept>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace Kilosim
+{
+struct LuminanceData
+{
+    //! Light values, in rows from the bottom of the image
+    const uint16_t *pixels = nullptr;
+    unsigned int width = 0;
+    unsigned int height = 0;
+
+    //! Summed-area table of the pixels, built the first time it's needed
+    mutable aligned_vector<double> sat;
+    mutable std::once_flag sat_built;
+
+    //! Get the summed-area table, building it if needed
+    const double *get_sat() const
+    {
+        std::call_once(sat_built, [this]() {
+            const size_t stride = width + 1;
+            sat.assign(stride * (height + 1), 0);
+            for (unsigned int row = 0; row < height; row++)
+            {
+                double row_sum = 0;
+                for (unsigned int col = 0; col < width; col++)
+                {
+                    row_sum += pixels[(size_t)row * width + col];
+                    sat[(row + 1) * stride + col + 1] = sat[row * stride + col + 1] + row_sum;
+                }
+            }
+        });
+        return sat.data();
+    }
+
+    virtual ~LuminanceData() {}
+};
+
+namespace
+{
+//! Header at the start of a luminance file
+struct LuminanceHeader
+{
+    char magic[8];
+    uint32_t width;
+    uint32_t height;
+    //! Pad the header so that the pixels start on a cache line
+    char reserved[48];
+};
+static_assert(sizeof(LuminanceHeader) == 64, "Luminance header must be 64 bytes");
+const char LUMINANCE_MAGIC[8] = {'K', 'I', 'L', 'O', 'L', 'U', 'M', '1'};
+
+//! Light values converted from an image, owned in memory
+struct ConvertedLuminance : public LuminanceData
+{
+    aligned_vector<uint16_t> storage;
+
+    explicit ConvertedLuminance(const sf::Image &img)
+    {
+        width = img.getSize().x;
+        height = img.getSize().y;
+        storage.resize((size_t)width * height);
+
+        // Convert every pixel to a light value now, so that each lookup is
+        // only an array access. Rows are flipped so that y increases upwards,
+        // like World y.
+        const sf::Uint8 *img_pixels = img.getPixelsPtr();
+        for (unsigned int row = 0; row < height; row++)
+        {
+            const sf::Uint8 *img_row = img_pixels + 4 * (size_t)(height - row - 1) * width;
+            for (unsigned int col = 0; col < width; col++)
+            {
+                const sf::Uint8 *c = img_row + 4 * col;
+                // Convert the color from RGB to grayscale using approximate
+                // luminosity. Each value is 8-bit, so the resulting value is in
+                // the scale [0-255]
+                double luminosity = (0.3 * c[0]) + (0.59 * c[1]) + (0.11 * c[2]);
+                // Scale to 10-bit [0-1023], rounding only after scaling
+                storage[(size_t)row * width + col] = (uint16_t)(luminosity * 4 + 0.5);
+            }
+        }
+        pixels = storage.data();
+    }
+};
+
+//! Light values in a read-only memory-mapped luminance file
+struct MappedLuminance : public LuminanceData
+{
+    void *mapping = MAP_FAILED;
+    size_t mapping_size = 0;
+
+    explicit MappedLuminance(const std::string &src)
+    {
+        const int fd = open(src.c_str(), O_RDONLY);
+        if (fd < 0)
+        {
+            throw std::runtime_error("Could not open luminance file " + src);
+        }
+        struct stat st;
+        if (fstat(fd, &st) == 0 && (size_t)st.st_size >= sizeof(LuminanceHeader))
+        {
+            mapping_size = st.st_size;
+            mapping = mmap(nullptr, mapping_size, PROT_READ, MAP_SHARED, fd, 0);
+        }
+        // The mapping stays valid after the file is closed
+        close(fd);
+        if (mapping == MAP_FAILED)
+        {
+            throw std::runtime_error("Could not map luminance file " + src);
+        }
+
+        const LuminanceHeader *header = static_cast<const LuminanceHeader *>(mapping);
+        if (memcmp(header->magic, LUMINANCE_MAGIC, sizeof(LUMINANCE_MAGIC)) != 0 ||
+            mapping_size < sizeof(LuminanceHeader) +
+                               (size_t)header->width * header->height * sizeof(uint16_t) ||
+            header->width == 0 || header->height == 0)
+        {
+            munmap(mapping, mapping_size);
+            throw std::runtime_error("Invalid luminance file " + src);
+        }
+        width = header->width;
+        height = header->height;
+        pixels = reinterpret_cast<const uint16_t *>(header + 1);
+    }
+
+    ~MappedLuminance()
+    {
+        munmap(mapping, mapping_size);
+    }
+};
+
+//! Whether a filename ends in .lum
+bool is_luminance_file(const std::string &src)
+{
+    return src.size() >= 4 && src.compare(src.size() - 4, 4, ".lum") == 0;
+}
+
+//! Pixels of every file that's currently loaded, so that each file is only
+//! loaded once per process
+std::mutex loaded_files_mutex;
+std::map<std::string, std::weak_ptr<const LuminanceData>> loaded_files;
+
+//! Convert a light value to 10 bits, capping it to the valid range
+uint16_t to_10bit(const double value)
+{
+    return (uint16_t)std::min(std::max(value, 0.0), 1023.0);
+}
+} // namespace
+
+void LuminanceGrid::set_data(std::shared_ptr<const LuminanceData> data,
+                             const double arena_width)
+{
+    m_data = data;
+    m_luminance = data->pixels;
+    m_width = data->width;
+    m_height = data->height;
+    m_scale = (double)m_width / arena_width;
+    m_sat = (m_sampling == LIGHT_SAMPLE_AREA) ? data->get_sat() : nullptr;
+}
+
+void LuminanceGrid::set_sampling(const LightSampling sampling,
+                                 const double footprint_radius)
+{
+    if (sampling == LIGHT_SAMPLE_AREA && !(footprint_radius > 0))
+    {
+        throw std::invalid_argument("Area light sampling needs a positive footprint radius");
+    }
+    m_sampling = sampling;
+    m_footprint = footprint_radius;
+    m_sat = (m_sampling == LIGHT_SAMPLE_AREA && m_data) ? m_data->get_sat() : nullptr;
+}
+
+uint16_t LuminanceGrid::sample_bilinear(const double x, const double y) const
+{
+    // Pixel centers are at half-integer image coordinates
+    const double u = std::min(std::max(x * m_scale - 0.5, 0.0), m_width - 1.0);
+    const double v = std::min(std::max(y * m_scale - 0.5, 0.0), m_height - 1.0);
+    const unsigned int col0 = u;
+    const unsigned int row0 = v;
+    const unsigned int col1 = std::min(col0 + 1, m_width - 1);
+    const unsigned int row1 = std::min(row0 + 1, m_height - 1);
+    const double fu = u - col0;
+    const double fv = v - row0;
+
+    const uint16_t *r0 = m_luminance + (size_t)row0 * m_width;
+    const uint16_t *r1 = m_luminance + (size_t)row1 * m_width;
+    const double bottom = r0[col0] + fu * (r0[col1] - r0[col0]);
+    const double top = r1[col0] + fu * (r1[col1] - r1[col0]);
+    return (uint16_t)(bottom + fv * (top - bottom) + 0.5);
+}
+
+double LuminanceGrid::area_sum(const double u, const double v) const
+{
+    // The sum of a piecewise-constant image up to (u, v) is exactly the
+    // bilinear interpolation of the summed-area table at (u, v)
+    const size_t stride = m_width + 1;
+    const unsigned int i0 = std::min((unsigned int)u, m_width - 1);
+    const unsigned int j0 = std::min((unsigned int)v, m_height - 1);
+    const double fu = u - i0;
+    const double fv = v - j0;
+    const double *s0 = m_sat + j0 * stride + i0;
+    const double *s1 = s0 + stride;
+    const double bottom = s0[0] + fu * (s0[1] - s0[0]);
+    const double top = s1[0] + fu * (s1[1] - s1[0]);
+    return bottom + fv * (top - bottom);
+}
+
+uint16_t LuminanceGrid::sample_area(const double x, const double y) const
+{
+    // Footprint in image coordinates, clipped to the image
+    const double u = x * m_scale;
+    const double v = y * m_scale;
+    const double r = m_footprint * m_scale;
+    const double u0 = std::min(std::max(u - r, 0.0), (double)m_width);
+    const double u1 = std::min(std::max(u + r, 0.0), (double)m_width);
+    const double v0 = std::min(std::max(v - r, 0.0), (double)m_height);
+    const double v1 = std::min(std::max(v + r, 0.0), (double)m_height);
+    const double area = (u1 - u0) * (v1 - v0);
+    if (area <= 0)
+    {
+        // Entirely outside of the image: use the nearest edge pixel
+        return m_luminance[index(x, y)];
+    }
+    const double sum = area_sum(u1, v1) - area_sum(u0, v1) -
+                       area_sum(u1, v0) + area_sum(u0, v0);
+    return (uint16_t)std::min(std::max(sum / area + 0.5, 0.0), 1023.0);
+}
+
+void LuminanceGrid::load(const sf::Image &img, const double arena_width)
+{
+    set_data(std::make_shared<ConvertedLuminance>(img), arena_width);
+}
+
+void LuminanceGrid::load(const std::string &src, const double arena_width)
+{
+    // Files are identified by their full path, so different relative paths to
+    // the same file share it too. The inode and modification time are part of
+    // the key, so a file that's replaced (see write_file()) is loaded again,
+    // while Worlds that already use it keep the old one.
+    char *full_path = realpath(src.c_str(), nullptr);
+    struct stat st;
+    if (!full_path || stat(full_path, &st) != 0)
+    {
+        free(full_path);
+        throw std::runtime_error("Could not find light pattern file " + src);
+    }
+    const std::string key = std::string(full_path) + ":" + std::to_string(st.st_ino) +
+                            ":" + std::to_string(st.st_mtim.tv_sec) + "." +
+                            std::to_string(st.st_mtim.tv_nsec);
+    free(full_path);
+
+    std::lock_guard<std::mutex> lock(loaded_files_mutex);
+    std::shared_ptr<const LuminanceData> data = loaded_files[key].lock();
+    if (!data)
+    {
+        if (is_luminance_file(src))
+        {
+            data = std::make_shared<MappedLuminance>(src);
+        }
+        else
+        {
+            sf::Image img;
+            if (!img.loadFromFile(src))
+            {
+                throw std::runtime_error("Could not load light pattern image " + src);
+            }
+            data = std::make_shared<ConvertedLuminance>(img);
+        }
+        loaded_files[key] = data;
+    }
+    set_data(data, arena_width);
+}
+
+void LuminanceGrid::write_file(const sf::Image &img, const std::string &lum_src)
+{
+    const ConvertedLuminance data(img);
+    LuminanceHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, LUMINANCE_MAGIC, sizeof(LUMINANCE_MAGIC));
+    header.width = data.width;
+    header.height = data.height;
+
+    // Luminance files are mapped while they're used, so an existing file is
+    // replaced instead of being overwritten. Simulations using it keep the
+    // old file (truncating it would crash them the next time they read it).
+    const std::string tmp_src = lum_src + ".tmp";
+    std::ofstream out(tmp_src, std::ios::binary | std::ios::trunc);
+    out.write(reinterpret_cast<const char *>(&header), sizeof(header));
+    out.write(reinterpret_cast<const char *>(data.pixels),
+              (size_t)data.width * data.height * sizeof(uint16_t));
+    out.close();
+    if (!out || rename(tmp_src.c_str(), lum_src.c_str()) != 0)
+    {
+        unlink(tmp_src.c_str());
+        throw std::runtime_error("Could not write luminance file " + lum_src);
+    }
+}
+
+sf::Image LuminanceGrid::to_image() const
+{
+    sf::Image img;
+    img.create(m_width, m_height);
+    for (unsigned int row = 0; row < m_height; row++)
+    {
+        for (unsigned int col = 0; col < m_width; col++)
+        {
+            const sf::Uint8 v = m_luminance[(size_t)row * m_width + col] / 4;
+            img.setPixel(col, m_height - row - 1, sf::Color(v, v, v));
+        }
+    }
+    return img;
+}
+
+void LuminanceGrid::get_ambientlight(const aligned_vector<double> &xs,
+                                     const aligned_vector<double> &ys,
+                                     aligned_vector<uint16_t> &light) const
+{
+    const size_t n = xs.size();
+    light.resize(n);
+    if (m_sampling != LIGHT_SAMPLE_NEAREST)
+    {
+        for (size_t i = 0; i < n; i++)
+        {
+            light[i] = get_ambientlight(xs[i], ys[i]);
+        }
+        return;
+    }
+    const uint16_t *luminance = m_luminance;
+#pragma omp simd
+    for (size_t i = 0; i < n; i++)
+    {
+        light[i] = luminance[index(xs[i], ys[i])];
+    }
+}
+
+void LightSource::get_ambientlight(const aligned_vector<double> &xs,
+                                   const aligned_vector<double> &ys,
+                                   const uint32_t tick,
+                                   aligned_vector<uint16_t> &light) const
+{
+    light.resize(xs.size());
+    for (size_t i = 0; i < xs.size(); i++)
+    {
+        light[i] = get_ambientlight(xs[i], ys[i], tick);
+    }
+}
+
+ImageSequence::ImageSequence(const double arena_width)
+    : m_arena_width(arena_width) {}
+
+void ImageSequence::add_keyframe(const uint32_t start_tick,
+                                 const std::string img_src)
+{
+    LuminanceGrid frame;
+    frame.load(img_src, m_arena_width);
+    add_frame(start_tick, frame);
+}
+
+void ImageSequence::add_keyframe(const uint32_t start_tick,
+                                 const sf::Image &img)
+{
+    LuminanceGrid frame;
+    frame.load(img, m_arena_width);
+    add_frame(start_tick, frame);
+}
+
+void ImageSequence::add_frame(const uint32_t start_tick,
+                              const LuminanceGrid &frame)
+{
+    if (!m_start_ticks.empty() && start_tick <= m_start_ticks.back())
+    {
+        throw std::invalid_argument("Keyframes must be added in order of their start ticks");
+    }
+    m_start_ticks.push_back(start_tick);
+    m_frames.push_back(frame);
+    m_frames.back().set_sampling(m_sampling, m_footprint_radius);
+}
+
+void ImageSequence::set_sampling(const LightSampling sampling,
+                                 const double footprint_radius)
+{
+    m_sampling = sampling;
+    m_footprint_radius = footprint_radius;
+    for (auto &frame : m_frames)
+    {
+        frame.set_sampling(sampling, footprint_radius);
+    }
+}
+
+void ImageSequence::set_loop(const uint32_t loop_ticks)
+{
+    m_loop_ticks = loop_ticks;
+}
+
+size_t ImageSequence::frame_at(const uint32_t tick) const
+{
+    const uint32_t t = (m_loop_ticks > 0) ? tick % m_loop_ticks : tick;
+    // Last frame that starts at or before t (or the first frame)
+    const auto next = std::upper_bound(m_start_ticks.begin(), m_start_ticks.end(), t);
+    return (next == m_start_ticks.begin()) ? 0 : next - m_start_ticks.begin() - 1;
+}
+
+uint16_t ImageSequence::get_ambientlight(const double x, const double y,
+                                         const uint32_t tick) const
+{
+    if (m_frames.empty())
+    {
+        return 0;
+    }
+    return m_frames[frame_at(tick)].get_ambientlight(x, y);
+}
+
+void ImageSequence::get_ambientlight(const aligned_vector<double> &xs,
+                                     const aligned_vector<double> &ys,
+                                     const uint32_t tick,
+                                     aligned_vector<uint16_t> &light) const
+{
+    if (m_frames.empty())
+    {
+        light.assign(xs.size(), 0);
+        return;
+    }
+    m_frames[frame_at(tick)].get_ambientlight(xs, ys, light);
+}
+
+PointLight::PointLight(const double x, const double y, const double intensity,
+                       const double half_distance)
+    : m_x(x), m_y(y), m_intensity(intensity), m_half_distance(half_distance) {}
+
+void PointLight::set_velocity(const double vx, const double vy)
+{
+    m_vx = vx;
+    m_vy = vy;
+}
+
+void PointLight::set_blink(const uint32_t period_ticks, const uint32_t on_ticks)
+{
+    m_blink_period = period_ticks;
+    m_blink_on = on_ticks;
+}
+
+uint16_t PointLight::get_ambientlight(const double x, const double y,
+                                      const uint32_t tick) const
+{
+    if (m_blink_period > 0 && tick % m_blink_period >= m_blink_on)
+    {
+        return 0;
+    }
+    const double dx = x - (m_x + m_vx * tick);
+    const double dy = y - (m_y + m_vy * tick);
+    const double d2 = (dx * dx + dy * dy) / (m_half_distance * m_half_distance);
+    return to_10bit(m_intensity / (1 + d2));
+}
+
+GradientLight::GradientLight(const double x0, const double y0,
+                             const double value0, const double x1,
+                             const double y1, const double value1)
+    : m_x0(x0), m_y0(y0), m_value0(value0), m_value1(value1)
+{
+    const double dx = x1 - x0;
+    const double dy = y1 - y0;
+    const double d2 = dx * dx + dy * dy;
+    if (d2 == 0)
+    {
+        throw std::invalid_argument("The points of a GradientLight must be different");
+    }
+    m_dir_x = dx / d2;
+    m_dir_y = dy / d2;
+}
+
+void GradientLight::set_velocity(const double vx, const double vy)
+{
+    m_vx = vx;
+    m_vy = vy;
+}
+
+uint16_t GradientLight::get_ambientlight(const double x, const double y,
+                                         const uint32_t tick) const
+{
+    // Fraction of the way from point 0 to point 1
+    const double f = (x - (m_x0 + m_vx * tick)) * m_dir_x +
+                     (y - (m_y0 + m_vy * tick)) * m_dir_y;
+    const double t = std::min(std::max(f, 0.0), 1.0);
+    return to_10bit(m_value0 + t * (m_value1 - m_value0));
+}
+
+void SumLight::add(std::shared_ptr<LightSource> source)
+{
+    m_sources.push_back(source);
+}
+
+void SumLight::update(const uint32_t tick)
+{
+    for (auto &source : m_sources)
+    {
+        source->update(tick);
+    }
+}
+
+uint16_t SumLight::get_ambientlight(const double x, const double y,
+                                    const uint32_t tick) const
+{
+    uint32_t sum = 0;
+    for (const auto &source : m_sources)
+    {
+        sum += source->get_ambientlight(x, y, tick);
+    }
+    return std::min(sum, (uint32_t)1023);
+}
+} // namespace Kilosim
@@ -0,0 +1,434 @@
+/*
+  Kilosim
+
+  Light fields that can change over time: image sequences and procedural lights
+*/
+
+#ifndef __KILOSIM_LIGHTSOURCE_H
+#define __KILOSIM_LIGHTSOURCE_H
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <cstdint>
+#include <algorithm>
+#include <SFML/Graphics.hpp>
+#include "AlignedAllocator.hpp"
+
+namespace Kilosim
+{
+//! Storage of the pixels of a LuminanceGrid (in memory or a mapped file)
+struct LuminanceData;
+
+/*!
+ * How a light sensor reading is taken from the pixels of an image
+ */
+enum LightSampling : uint8_t
+{
+  //! Value of the pixel containing the point (fastest, but coarse images give
+  //! robots visible steps in light)
+  LIGHT_SAMPLE_NEAREST,
+  //! Bilinear interpolation between the 4 pixels around the point, so light
+  //! changes smoothly between pixel centers
+  LIGHT_SAMPLE_BILINEAR,
+  //! Average light over a square footprint around the point (like a sensor
+  //! with a wide field of view). Uses a summed-area table, so the cost doesn't
+  //! depend on the size of the footprint.
+  LIGHT_SAMPLE_AREA
+};
+
+/*!
+ * An image converted to 10-bit light intensities (0-1023) and aligned with
+ * World coordinates, so that looking up the light at a point is a single array
+ * access.
+ *
+ * Colors are converted to grayscale by an approximate luminosity, making the
+ * simplifying assumption that perceived light intensity is linearly
+ * proportional to luminosity.
+ *
+ * The light intensities can also be saved to a luminance file (`.lum`) with
+ * `write_file()`. Luminance files are memory-mapped read-only instead of
+ * being read, so a pattern is only in memory once no matter how many Worlds
+ * (or processes) use it, and pages that robots never visit are never loaded.
+ * The format is a 64-byte header (the magic string `KILOLUM1`, then the width
+ * and height in pixels as 32-bit integers) followed by the 16-bit light values
+ * in rows from the bottom of the image, in native byte order.
+ *
+ * Every lookup takes constant time, whichever `LightSampling` is used.
+ */
+class LuminanceGrid
+{
+private:
+  //! Shared storage of the pixels (keeps m_luminance valid)
+  std::shared_ptr<const LuminanceData> m_data;
+  //! 10-bit light intensity of every pixel, in rows from the bottom of the
+  //! image (so that row and column increase with World y and x)
+  const uint16_t *m_luminance = nullptr;
+  //! Image width in pixels
+  unsigned int m_width = 0;
+  //! Image height in pixels
+  unsigned int m_height = 0;
+  //! Scaling between world dimensions/coordinates and image coordinates
+  double m_scale = 0;
+  //! How light is sampled from the pixels
+  LightSampling m_sampling = LIGHT_SAMPLE_NEAREST;
+  //! Half the side of the footprint for LIGHT_SAMPLE_AREA, in pixels
+  double m_footprint = 0;
+  //! Summed-area table of the pixels (for LIGHT_SAMPLE_AREA): entry (i, j) of
+  //! the (m_width+1) by (m_height+1) table is the sum of the pixels in the
+  //! first i columns of the first j rows
+  const double *m_sat = nullptr;
+
+  //! Interpolate between the 4 pixels around a point
+  uint16_t sample_bilinear(const double x, const double y) const;
+  //! Average the pixels in a square around a point
+  uint16_t sample_area(const double x, const double y) const;
+  //! Sum of the pixels between the origin and a point in image coordinates
+  double area_sum(const double u, const double v) const;
+
+  //! Use the given pixels
+  void set_data(std::shared_ptr<const LuminanceData> data,
+                const double arena_width);
+
+  //! Index in m_luminance of the pixel containing a point in World space.
+  //! Points outside of the image use the nearest pixel on its edge.
+  size_t index(const double x, const double y) const
+  {
+    const size_t x_in_img = std::min(std::max(x * m_scale, 0.0), m_width - 1.0);
+    const size_t y_in_img = std::min(std::max(y * m_scale, 0.0), m_height - 1.0);
+    return y_in_img * m_width + x_in_img;
+  }
+
+public:
+  /*!
+   * Convert an image to light intensities
+   * @param img Image to convert
+   * @param arena_width Width of the World in mm (the image covers the whole
+   * World, so its aspect ratio should match)
+   */
+  void load(const sf::Image &img, const double arena_width);
+
+  /*!
+   * Load light intensities from a file. Luminance files (ending in `.lum`) are
+   * memory-mapped; other images are decoded with SFML and converted. Either
+   * way, the pixels are shared with every other LuminanceGrid in the process
+   * loaded from the same file. Throws `std::runtime_error` if the file can't
+   * be read.
+   * @param src Filename (+location) of the image or luminance file
+   * @param arena_width Width of the World in mm
+   */
+  void load(const std::string &src, const double arena_width);
+
+  /*!
+   * Save the light intensities of an image as a luminance file. Throws
+   * `std::runtime_error` if the file can't be written. An existing file is
+   * replaced, not overwritten, so simulations that are using it carry on
+   * with the old light pattern; it's only loaded again by new Worlds.
+   * @param img Image to convert
+   * @param lum_src Filename (+location) of the luminance file to write (which
+   * should end in `.lum`)
+   */
+  static void write_file(const sf::Image &img, const std::string &lum_src);
+
+  /*!
+   * Convert the light intensities back to a (grayscale) image, such as for
+   * display
+   * @return Image with the same pixels as were loaded
+   */
+  sf::Image to_image() const;
+
+  //! Whether no image has been loaded
+  bool empty() const
+  {
+    return m_luminance == nullptr;
+  }
+
+  /*!
+   * Get the light intensity at a point in World space
+   * @param x x position (from left) in mm
+   * @param y y position (from bottom) in mm
+   * @return 10-bit light value
+   */
+  uint16_t get_ambientlight(const double x, const double y) const
+  {
+    switch (m_sampling)
+    {
+    case LIGHT_SAMPLE_BILINEAR:
+      return sample_bilinear(x, y);
+    case LIGHT_SAMPLE_AREA:
+      return sample_area(x, y);
+    default:
+      return m_luminance[index(x, y)];
+    }
+  }
+
+  /*!
+   * Set how light is sampled from the pixels. The default is
+   * `LIGHT_SAMPLE_NEAREST`.
+   * @param sampling How to sample light
+   * @param footprint_radius For `LIGHT_SAMPLE_AREA`, half the side of the
+   * square to average the light over (mm). Must be positive.
+   */
+  void set_sampling(const LightSampling sampling,
+                    const double footprint_radius = 0);
+
+  /*!
+   * Get the light intensities at many points at once (vectorized)
+   * @param xs x positions (from left) in mm
+   * @param ys y positions (from bottom) in mm
+   * @param light Light value at each point (resized to match xs)
+   */
+  void get_ambientlight(const aligned_vector<double> &xs,
+                        const aligned_vector<double> &ys,
+                        aligned_vector<uint16_t> &light) const;
+};
+
+/*!
+ * A light field whose intensity can depend on the tick of the simulation. Set
+ * one on the World with `World::set_light_source()` to use it instead of a
+ * static light pattern image.
+ *
+ * The World calls `update()` once at the start of every tick, before any
+ * robot runs. Robots' controllers then call `get_ambientlight()` in parallel,
+ * so it must not modify the source.
+ *
+ * A source can be shared by several Worlds (such as the variants of an
+ * Ensemble), which may step at the same time on different threads. The
+ * sources in Kilosim keep no per-tick state, so this is safe for them. A
+ * source whose `update()` modifies it must not be shared between Worlds that
+ * step concurrently; give each World its own copy instead.
+ */
+class LightSource
+{
+public:
+  virtual ~LightSource() {}
+
+  /*!
+   * Prepare for the light to be read during a tick. This is where a source
+   * can do expensive work that's the same for every point (such as
+   * regenerating a procedural texture), so that each lookup stays cheap. Any
+   * state it keeps makes the source unsafe to share between Worlds that step
+   * concurrently (see above).
+   * @param tick Tick that's about to run
+   */
+  virtual void update(const uint32_t tick) {}
+
+  /*!
+   * Get the light intensity at a point in World space during a tick
+   * @param x x position (from left) in mm
+   * @param y y position (from bottom) in mm
+   * @param tick Current tick of the World
+   * @return 10-bit light value (0-1023)
+   */
+  virtual uint16_t get_ambientlight(const double x, const double y,
+                                    const uint32_t tick) const = 0;
+
+  /*!
+   * Get the light intensities at many points at once during a tick. By
+   * default, this calls `get_ambientlight(x, y, tick)` for each point.
+   * @param xs x positions (from left) in mm
+   * @param ys y positions (from bottom) in mm
+   * @param tick Current tick of the World
+   * @param light Light value at each point (resized to match xs)
+   */
+  virtual void get_ambientlight(const aligned_vector<double> &xs,
+                                const aligned_vector<double> &ys,
+                                const uint32_t tick,
+                                aligned_vector<uint16_t> &light) const;
+};
+
+/*!
+ * A sequence of images, each shown from a given tick until the next one starts
+ * (optionally looping). All of the images are loaded and converted when they
+ * are added, so changing frames during the simulation costs nothing.
+ */
+class ImageSequence : public LightSource
+{
+private:
+  //! Width of the World (in mm)
+  double m_arena_width;
+  //! Tick at which each frame starts (increasing)
+  std::vector<uint32_t> m_start_ticks;
+  //! Light intensities of each frame
+  std::vector<LuminanceGrid> m_frames;
+  //! Length of the sequence in ticks, if it loops (0 = no looping)
+  uint32_t m_loop_ticks = 0;
+  //! Find the frame shown at a tick (a binary search over the start ticks,
+  //! so that the sequence holds no per-tick state)
+  size_t frame_at(const uint32_t tick) const;
+  //! How light is sampled from the frames
+  LightSampling m_sampling = LIGHT_SAMPLE_NEAREST;
+  double m_footprint_radius = 0;
+  //! Add a converted frame
+  void add_frame(const uint32_t start_tick, const LuminanceGrid &frame);
+
+public:
+  using LightSource::get_ambientlight;
+
+  /*!
+   * Create an empty image sequence (which is dark until a frame is added)
+   * @param arena_width Width of the World in mm
+   */
+  ImageSequence(const double arena_width);
+
+  /*!
+   * Add an image to the sequence. Frames must be added in order of their
+   * start ticks. The first frame is also shown before its start tick.
+   * @param start_tick Tick from which to show this image
+   * @param img_src Filename (+location) of the image or luminance (`.lum`)
+   * file. (See `LuminanceGrid::load()`.)
+   */
+  void add_keyframe(const uint32_t start_tick, const std::string img_src);
+
+  /*!
+   * Add an image to the sequence from memory
+   * @param start_tick Tick from which to show this image
+   * @param img Image to show
+   */
+  void add_keyframe(const uint32_t start_tick, const sf::Image &img);
+
+  /*!
+   * Repeat the sequence with a period
+   * @param loop_ticks Length of the sequence in ticks (0 = play once and stay
+   * on the last frame)
+   */
+  void set_loop(const uint32_t loop_ticks);
+
+  /*!
+   * Set how light is sampled from all of the frames (see
+   * `LuminanceGrid::set_sampling()`)
+   * @param sampling How to sample light
+   * @param footprint_radius For `LIGHT_SAMPLE_AREA`, half the side of the
+   * square to average the light over (mm)
+   */
+  void set_sampling(const LightSampling sampling,
+                    const double footprint_radius = 0);
+
+  uint16_t get_ambientlight(const double x, const double y,
+                            const uint32_t tick) const;
+  void get_ambientlight(const aligned_vector<double> &xs,
+                        const aligned_vector<double> &ys, const uint32_t tick,
+                        aligned_vector<uint16_t> &light) const;
+};
+
+/*!
+ * A point light (beacon) whose intensity falls off with distance. It can move
+ * at a constant velocity and blink.
+ *
+ * The intensity at distance d is `intensity / (1 + (d / half_distance)^2)`.
+ */
+class PointLight : public LightSource
+{
+private:
+  double m_x;
+  double m_y;
+  double m_intensity;
+  double m_half_distance;
+  //! Velocity in mm per tick
+  double m_vx = 0;
+  double m_vy = 0;
+  //! Blink period in ticks (0 = always on)
+  uint32_t m_blink_period = 0;
+  //! Ticks per period that the light is on
+  uint32_t m_blink_on = 0;
+
+public:
+  using LightSource::get_ambientlight;
+
+  /*!
+   * @param x x position at tick 0 (mm)
+   * @param y y position at tick 0 (mm)
+   * @param intensity Light value at the center (0-1023)
+   * @param half_distance Distance (mm) at which the light is half as bright
+   */
+  PointLight(const double x, const double y, const double intensity,
+             const double half_distance);
+
+  /*!
+   * Move the light at a constant velocity
+   * @param vx Velocity in the x direction (mm per tick)
+   * @param vy Velocity in the y direction (mm per tick)
+   */
+  void set_velocity(const double vx, const double vy);
+
+  /*!
+   * Turn the light on and off periodically. It is on for the first `on_ticks`
+   * of every period, starting at tick 0.
+   * @param period_ticks Length of a period in ticks (0 = always on)
+   * @param on_ticks Number of ticks per period that the light is on
+   */
+  void set_blink(const uint32_t period_ticks, const uint32_t on_ticks);
+
+  uint16_t get_ambientlight(const double x, const double y,
+                            const uint32_t tick) const;
+};
+
+/*!
+ * A linear gradient between two points. The light is `value0` at and behind
+ * point 0, `value1` at and beyond point 1, and changes linearly in between
+ * (it is constant in the direction perpendicular to the line between the
+ * points). It can move at a constant velocity.
+ */
+class GradientLight : public LightSource
+{
+private:
+  double m_x0;
+  double m_y0;
+  double m_value0;
+  double m_value1;
+  //! Direction from point 0 to point 1, divided by the squared distance
+  double m_dir_x;
+  double m_dir_y;
+  //! Velocity in mm per tick
+  double m_vx = 0;
+  double m_vy = 0;
+
+public:
+  using LightSource::get_ambientlight;
+
+  /*!
+   * @param x0 x position of point 0 at tick 0 (mm)
+   * @param y0 y position of point 0 at tick 0 (mm)
+   * @param value0 Light value at point 0 (0-1023)
+   * @param x1 x position of point 1 at tick 0 (mm)
+   * @param y1 y position of point 1 at tick 0 (mm)
+   * @param value1 Light value at point 1 (0-1023)
+   */
+  GradientLight(const double x0, const double y0, const double value0,
+                const double x1, const double y1, const double value1);
+
+  /*!
+   * Move the gradient at a constant velocity
+   * @param vx Velocity in the x direction (mm per tick)
+   * @param vy Velocity in the y direction (mm per tick)
+   */
+  void set_velocity(const double vx, const double vy);
+
+  uint16_t get_ambientlight(const double x, const double y,
+                            const uint32_t tick) const;
+};
+
+/*!
+ * The sum of several light sources (capped at the maximum light value)
+ */
+class SumLight : public LightSource
+{
+private:
+  std::vector<std::shared_ptr<LightSource>> m_sources;
+
+public:
+  using LightSource::get_ambientlight;
+
+  /*!
+   * Add a light source to the sum
+   * @param source Light source to add
+   */
+  void add(std::shared_ptr<LightSource> source);
+
+  void update(const uint32_t tick);
+  uint16_t get_ambientlight(const double x, const double y,
+                            const uint32_t tick) const;
+};
+} // namespace Kilosim
+
+#endif
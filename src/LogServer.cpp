@@ -0,0 +1,589 @@
+/*
+    Kilosim
+*/
+
+#include <H5Cpp.h>
+#include "LogServer.h"
+#include <stdexcept>
+#include <cstring>
+#include <cstdint>
+#include <cerrno>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+namespace Kilosim
+{
+
+namespace
+{
+//! Messages sent by a SocketLogSink. Every message starts with its type
+//! (uint32_t) and the size of the rest of the message (uint64_t).
+enum LogMessageType : uint32_t
+{
+    //! Name of the file to save to (replied to)
+    LOG_MSG_HELLO,
+    //! Trial number and overwrite flag (replied to)
+    LOG_MSG_OPEN_TRIAL,
+    //! A LogDatasetSpec
+    LOG_MSG_CREATE_DATASET,
+    //! Dataset number, number of rows, and the rows
+    LOG_MSG_APPEND,
+    //! Name and value (as JSON) of a param
+    LOG_MSG_PARAM,
+    //! Name and values of a vector
+    LOG_MSG_VECTOR,
+    //! Nothing (replied to once everything before it is saved)
+    LOG_MSG_FLUSH
+};
+
+//! Replies to LOG_MSG_OPEN_TRIAL
+enum LogTrialReply : uint8_t
+{
+    //! The trial exists (and wasn't to be overwritten)
+    LOG_TRIAL_EXISTS,
+    //! The trial was created
+    LOG_TRIAL_OPENED,
+    //! The trial couldn't be created
+    LOG_TRIAL_FAILED
+};
+
+//! Size of the type and size at the start of every message
+const size_t HEADER_SIZE = sizeof(uint32_t) + sizeof(uint64_t);
+
+template <typename T>
+void put(std::vector<uint8_t> &message, const T val)
+{
+    const uint8_t *bytes = reinterpret_cast<const uint8_t *>(&val);
+    message.insert(message.end(), bytes, bytes + sizeof(T));
+}
+
+void put_string(std::vector<uint8_t> &message, const std::string &str)
+{
+    put<uint64_t>(message, str.size());
+    message.insert(message.end(), str.begin(), str.end());
+}
+
+//! Reads the values of a received message in order
+struct MessageReader
+{
+    const uint8_t *pos;
+    const uint8_t *end;
+    //! Whether every value read was in the message
+    bool ok;
+
+    template <typename T>
+    T get()
+    {
+        T val = T();
+        if (end - pos < (ptrdiff_t)sizeof(T))
+        {
+            ok = false;
+            return val;
+        }
+        memcpy(&val, pos, sizeof(T));
+        pos += sizeof(T);
+        return val;
+    }
+
+    std::string get_string()
+    {
+        const uint64_t size = get<uint64_t>();
+        if (!ok || (uint64_t)(end - pos) < size)
+        {
+            ok = false;
+            return "";
+        }
+        std::string str(reinterpret_cast<const char *>(pos), size);
+        pos += size;
+        return str;
+    }
+};
+
+//! Send all of a buffer (without raising SIGPIPE if the other end is gone)
+bool send_all(const int socket, const void *data, size_t size)
+{
+    const uint8_t *bytes = static_cast<const uint8_t *>(data);
+    while (size > 0)
+    {
+        const ssize_t sent = send(socket, bytes, size, MSG_NOSIGNAL);
+        if (sent < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (sent <= 0)
+        {
+            return false;
+        }
+        bytes += sent;
+        size -= sent;
+    }
+    return true;
+}
+
+//! Fill in the address of a socket
+sockaddr_un socket_address(const std::string &socket_path)
+{
+    sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    if (socket_path.size() >= sizeof(address.sun_path))
+    {
+        throw std::runtime_error("Log server socket path is too long: " + socket_path);
+    }
+    strncpy(address.sun_path, socket_path.c_str(), sizeof(address.sun_path) - 1);
+    return address;
+}
+} // namespace
+
+//------------------------------------------------------------------------------
+// LogServer
+
+LogServer::LogServer(const std::string socket_path)
+    : m_socket_path(socket_path)
+{
+    const sockaddr_un address = socket_address(socket_path);
+    m_listen_socket = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (m_listen_socket < 0)
+    {
+        throw std::runtime_error("Failed to create log server socket");
+    }
+    unlink(socket_path.c_str());
+    if (bind(m_listen_socket, (const sockaddr *)&address, sizeof(address)) < 0 ||
+        listen(m_listen_socket, 64) < 0 || pipe(m_wake_pipe) < 0)
+    {
+        close(m_listen_socket);
+        throw std::runtime_error("Failed to create log server socket at " + socket_path +
+                                 ": " + strerror(errno));
+    }
+}
+
+LogServer::~LogServer()
+{
+    stop();
+    close(m_listen_socket);
+    close(m_wake_pipe[0]);
+    close(m_wake_pipe[1]);
+    unlink(m_socket_path.c_str());
+}
+
+void LogServer::start()
+{
+    m_thread = std::thread(&LogServer::serve, this);
+}
+
+void LogServer::stop()
+{
+    {
+        std::lock_guard<std::mutex> lock(m_stop_mutex);
+        m_stop = true;
+    }
+    const uint8_t wake = 1;
+    if (write(m_wake_pipe[1], &wake, 1) < 0)
+    {
+        fprintf(stderr, "WARNING: Failed to stop the log server\n");
+    }
+    if (m_thread.joinable() && m_thread.get_id() != std::this_thread::get_id())
+    {
+        m_thread.join();
+    }
+}
+
+void LogServer::serve()
+{
+    std::vector<pollfd> polled;
+    while (true)
+    {
+        {
+            std::lock_guard<std::mutex> lock(m_stop_mutex);
+            if (m_stop)
+            {
+                break;
+            }
+        }
+
+        polled.clear();
+        polled.push_back({m_wake_pipe[0], POLLIN, 0});
+        polled.push_back({m_listen_socket, POLLIN, 0});
+        for (auto &client : m_clients)
+        {
+            polled.push_back({client->socket, POLLIN, 0});
+        }
+        if (poll(polled.data(), polled.size(), -1) < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            fprintf(stderr, "WARNING: Log server failed to wait for Loggers\n");
+            break;
+        }
+
+        if (polled[0].revents)
+        {
+            // Woken by stop()
+            continue;
+        }
+        if (polled[1].revents & POLLIN)
+        {
+            const int socket = accept(m_listen_socket, nullptr, nullptr);
+            if (socket >= 0)
+            {
+                m_clients.emplace_back(new Client());
+                m_clients.back()->socket = socket;
+            }
+        }
+
+        // Read from the clients that were polled (new clients are after them).
+        // Go backwards so disconnected clients can be removed.
+        for (size_t i = polled.size() - 2; i-- > 0;)
+        {
+            if (!polled[i + 2].revents)
+            {
+                continue;
+            }
+            Client &client = *m_clients[i];
+            const size_t old_size = client.received.size();
+            client.received.resize(old_size + (1 << 20));
+            const ssize_t n = recv(client.socket, &client.received[old_size], 1 << 20, 0);
+            client.received.resize(old_size + std::max(n, (ssize_t)0));
+            if ((n < 0 && errno == EINTR) || (n > 0 && handle_messages(client)))
+            {
+                continue;
+            }
+            // Disconnected (closes the client's file if nobody else is using it)
+            close(client.socket);
+            m_clients.erase(m_clients.begin() + i);
+        }
+    }
+
+    for (auto &client : m_clients)
+    {
+        close(client->socket);
+    }
+    m_clients.clear();
+}
+
+bool LogServer::handle_messages(Client &client)
+{
+    size_t pos = 0;
+    while (client.received.size() - pos >= HEADER_SIZE)
+    {
+        uint32_t type;
+        uint64_t size;
+        memcpy(&type, &client.received[pos], sizeof(type));
+        memcpy(&size, &client.received[pos + sizeof(type)], sizeof(size));
+        if (client.received.size() - pos - HEADER_SIZE < size)
+        {
+            break;
+        }
+        if (!handle_message(client, type, &client.received[pos + HEADER_SIZE], size))
+        {
+            return false;
+        }
+        pos += HEADER_SIZE + size;
+    }
+    client.received.erase(client.received.begin(), client.received.begin() + pos);
+    return true;
+}
+
+bool LogServer::handle_message(Client &client, const uint32_t type,
+                               const uint8_t *payload, const uint64_t size)
+{
+    MessageReader reader{payload, payload + size, true};
+    if (type == LOG_MSG_HELLO)
+    {
+        const std::string file_id = reader.get_string();
+        try
+        {
+            client.sink.reset(new H5LogSink(file_id));
+        }
+        catch (const std::exception &err)
+        {
+            fprintf(stderr, "WARNING: %s\n", err.what());
+        }
+        catch (const H5::Exception &)
+        {
+            fprintf(stderr, "WARNING: Failed to create log file %s\n", file_id.c_str());
+        }
+        const uint8_t reply = client.sink != nullptr;
+        return send_all(client.socket, &reply, 1);
+    }
+    if (!client.sink)
+    {
+        // Every client must say which file it's saving to first
+        return false;
+    }
+
+    uint8_t reply = 1;
+    switch (type)
+    {
+    case LOG_MSG_OPEN_TRIAL:
+    {
+        const uint32_t trial_num = reader.get<uint32_t>();
+        const bool overwrite = reader.get<uint8_t>();
+        if (!reader.ok)
+        {
+            return false;
+        }
+        client.row_bytes.clear();
+        try
+        {
+            reply = client.sink->open_trial(trial_num, overwrite) ? LOG_TRIAL_OPENED
+                                                                  : LOG_TRIAL_EXISTS;
+        }
+        catch (const std::runtime_error &err)
+        {
+            fprintf(stderr, "WARNING: %s\n", err.what());
+            reply = LOG_TRIAL_FAILED;
+        }
+        return send_all(client.socket, &reply, 1);
+    }
+    case LOG_MSG_CREATE_DATASET:
+    {
+        LogDatasetSpec spec;
+        spec.name = reader.get_string();
+        spec.rank = reader.get<uint8_t>();
+        spec.type = (LogValueType)reader.get<uint8_t>();
+        spec.row_len = reader.get<uint64_t>();
+        spec.gzip_level = reader.get<uint32_t>();
+        spec.shuffle = reader.get<uint8_t>();
+        spec.chunk_rows = reader.get<uint64_t>();
+        spec.chunk_cols = reader.get<uint64_t>();
+        uint64_t chunk_rows, chunk_cols;
+        if (!reader.ok || spec.rank < 1 || spec.rank > 2 || spec.type > LOG_UINT8 ||
+            spec.row_len > UINT64_MAX / sizeof(double) ||
+            !log_chunk_shape(spec, chunk_rows, chunk_cols))
+        {
+            fprintf(stderr, "WARNING: Log server received an invalid dataset\n");
+            return false;
+        }
+        client.sink->create_dataset(spec);
+        client.row_bytes.push_back(spec.row_len * log_value_size(spec.type));
+        return true;
+    }
+    case LOG_MSG_APPEND:
+    {
+        const uint64_t dataset = reader.get<uint64_t>();
+        const uint64_t count = reader.get<uint64_t>();
+        // The rows must be exactly the rest of the message, so nothing past
+        // the end of it is read
+        const uint64_t rows_size = reader.end - reader.pos;
+        bool valid = reader.ok && dataset < client.row_bytes.size();
+        if (valid)
+        {
+            const uint64_t row_bytes = client.row_bytes[dataset];
+            valid = (row_bytes == 0) ? rows_size == 0
+                                     : rows_size % row_bytes == 0 && rows_size / row_bytes == count;
+        }
+        if (!valid)
+        {
+            fprintf(stderr, "WARNING: Log server received invalid rows\n");
+            return false;
+        }
+        if (!client.sink->append(dataset, reader.pos, count))
+        {
+            fprintf(stderr, "WARNING: Failed to append data to dataset %lu\n",
+                    (unsigned long)dataset);
+        }
+        return true;
+    }
+    case LOG_MSG_PARAM:
+    {
+        const std::string name = reader.get_string();
+        const std::string val = reader.get_string();
+        if (!reader.ok)
+        {
+            return false;
+        }
+        json parsed;
+        try
+        {
+            parsed = json::parse(val);
+        }
+        catch (const json::exception &)
+        {
+            fprintf(stderr, "WARNING: Log server received an invalid param %s\n",
+                    name.c_str());
+            return false;
+        }
+        client.sink->write_param(name, parsed);
+        return true;
+    }
+    case LOG_MSG_VECTOR:
+    {
+        const std::string name = reader.get_string();
+        std::vector<double> vals((reader.end - reader.pos) / sizeof(double));
+        memcpy(vals.data(), reader.pos, vals.size() * sizeof(double));
+        if (reader.ok)
+        {
+            client.sink->write_vector(name, vals);
+        }
+        return reader.ok;
+    }
+    case LOG_MSG_FLUSH:
+        client.sink->flush();
+        return send_all(client.socket, &reply, 1);
+    default:
+        fprintf(stderr, "WARNING: Log server received an unknown message\n");
+        return false;
+    }
+}
+
+//------------------------------------------------------------------------------
+// SocketLogSink
+
+SocketLogSink::SocketLogSink(const std::string &socket_path,
+                             const std::string &file_id)
+{
+    const sockaddr_un address = socket_address(socket_path);
+    m_socket = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (m_socket < 0 ||
+        connect(m_socket, (const sockaddr *)&address, sizeof(address)) < 0)
+    {
+        if (m_socket >= 0)
+        {
+            close(m_socket);
+        }
+        throw std::runtime_error("Failed to connect to log server at " + socket_path +
+                                 ": " + strerror(errno));
+    }
+
+    std::lock_guard<std::mutex> lock(m_mutex);
+    begin_message(LOG_MSG_HELLO);
+    put_string(m_message, file_id);
+    if (!send_message() || receive_reply() != 1)
+    {
+        close(m_socket);
+        throw std::runtime_error("Log server failed to open " + file_id);
+    }
+}
+
+SocketLogSink::~SocketLogSink()
+{
+    // Make sure everything has been saved before the Logger finishes
+    flush();
+    close(m_socket);
+}
+
+void SocketLogSink::begin_message(const uint32_t type)
+{
+    m_message.clear();
+    put(m_message, type);
+    // Size is filled in by send_message()
+    put<uint64_t>(m_message, 0);
+}
+
+bool SocketLogSink::send_message(const void *data, const size_t size)
+{
+    if (m_failed)
+    {
+        return false;
+    }
+    const uint64_t message_size = m_message.size() - HEADER_SIZE + size;
+    memcpy(&m_message[sizeof(uint32_t)], &message_size, sizeof(message_size));
+    if (!send_all(m_socket, m_message.data(), m_message.size()) ||
+        (size > 0 && !send_all(m_socket, data, size)))
+    {
+        fprintf(stderr, "WARNING: Lost connection to the log server\n");
+        m_failed = true;
+    }
+    return !m_failed;
+}
+
+int SocketLogSink::receive_reply()
+{
+    uint8_t reply;
+    ssize_t n;
+    do
+    {
+        n = recv(m_socket, &reply, 1, 0);
+    } while (n < 0 && errno == EINTR);
+    if (n != 1)
+    {
+        fprintf(stderr, "WARNING: Lost connection to the log server\n");
+        m_failed = true;
+        return -1;
+    }
+    return reply;
+}
+
+bool SocketLogSink::open_trial(const uint32_t trial_num, const bool overwrite)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_row_bytes.clear();
+    begin_message(LOG_MSG_OPEN_TRIAL);
+    put<uint32_t>(m_message, trial_num);
+    put<uint8_t>(m_message, overwrite);
+    const int reply = send_message() ? receive_reply() : -1;
+    if (reply < 0)
+    {
+        throw std::runtime_error("Lost connection to the log server");
+    }
+    if (reply == LOG_TRIAL_FAILED)
+    {
+        throw std::runtime_error("Log server failed to create trial_" +
+                                 std::to_string(trial_num));
+    }
+    return reply == LOG_TRIAL_OPENED;
+}
+
+void SocketLogSink::create_dataset(const LogDatasetSpec &spec)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    begin_message(LOG_MSG_CREATE_DATASET);
+    put_string(m_message, spec.name);
+    put<uint8_t>(m_message, spec.rank);
+    put<uint8_t>(m_message, spec.type);
+    put<uint64_t>(m_message, spec.row_len);
+    put<uint32_t>(m_message, spec.gzip_level);
+    put<uint8_t>(m_message, spec.shuffle);
+    put<uint64_t>(m_message, spec.chunk_rows);
+    put<uint64_t>(m_message, spec.chunk_cols);
+    m_row_bytes.push_back(spec.row_len * log_value_size(spec.type));
+    send_message();
+}
+
+bool SocketLogSink::append(const size_t dataset, const void *rows, const size_t count)
+{
+    // Not replied to (the server warns if it fails), so the writer thread
+    // doesn't wait for the file
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if (dataset >= m_row_bytes.size())
+    {
+        return false;
+    }
+    begin_message(LOG_MSG_APPEND);
+    put<uint64_t>(m_message, dataset);
+    put<uint64_t>(m_message, count);
+    return send_message(rows, count * m_row_bytes[dataset]);
+}
+
+void SocketLogSink::write_param(const std::string &name, const json &val)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    begin_message(LOG_MSG_PARAM);
+    put_string(m_message, name);
+    put_string(m_message, val.dump());
+    send_message();
+}
+
+void SocketLogSink::write_vector(const std::string &name, const std::vector<double> &vals)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    begin_message(LOG_MSG_VECTOR);
+    put_string(m_message, name);
+    send_message(vals.data(), vals.size() * sizeof(double));
+}
+
+void SocketLogSink::flush()
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    begin_message(LOG_MSG_FLUSH);
+    if (send_message())
+    {
+        receive_reply();
+    }
+}
+
+} // namespace Kilosim
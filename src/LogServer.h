@@ -0,0 +1,161 @@
+/*
+  Kilosim
+
+  Saves the logs of simulations running in several processes to shared HDF5
+  files
+*/
+
+#ifndef __KILOSIM_LOGSERVER_H
+#define __KILOSIM_LOGSERVER_H
+
+#include "LogSink.h"
+#include <string>
+#include <vector>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <cstdint>
+
+namespace Kilosim
+{
+/*!
+ * A LogServer lets simulations running in separate processes (on the same
+ * machine) save their trials into the same HDF5 file. An HDF5 file can only be
+ * opened for writing by one process at a time, so the server is the only
+ * process that writes to it. Loggers connect to the server by giving the
+ * location of its socket as `log_server` when they're constructed, and send it
+ * everything they would have written.
+ *
+ * Every file is opened once, and each connected Logger saves its own trial
+ * (`trial_#` group) in it. All of the writing is done by one thread, so
+ * nothing is written twice or out of order.
+ *
+ * For example, start the server in one program:
+ *
+ * ```
+ * Kilosim::LogServer server("/tmp/kilosim.sock");
+ * server.serve(); // Runs until stop() is called
+ * ```
+ *
+ * and then run any number of simulations with:
+ *
+ * ```
+ * Kilosim::Logger logger(world, "results.h5", trial, false, "/tmp/kilosim.sock");
+ * ```
+ *
+ * @note Relative file names are relative to the server's working directory.
+ */
+class LogServer
+{
+private:
+  //! A connected Logger
+  struct Client
+  {
+    //! Connected socket
+    int socket;
+    //! Received bytes that aren't a whole message yet
+    std::vector<uint8_t> received;
+    //! Where the client's data is saved (after it says which file)
+    std::unique_ptr<H5LogSink> sink;
+    //! Size of a row of each dataset in the client's current trial (bytes),
+    //! used to check the rows it sends
+    std::vector<uint64_t> row_bytes;
+  };
+
+  //! Location of the socket
+  std::string m_socket_path;
+  //! Socket that Loggers connect to
+  int m_listen_socket;
+  //! Pipe used to wake up serve() when stop() is called
+  int m_wake_pipe[2];
+  //! Connected Loggers
+  std::vector<std::unique_ptr<Client>> m_clients;
+  //! Whether serve() should return
+  bool m_stop = false;
+  //! Protects m_stop
+  std::mutex m_stop_mutex;
+  //! Thread running serve() (if started with start())
+  std::thread m_thread;
+
+  //! Handle every complete message received from a client
+  //! @return Whether the client is still connected
+  bool handle_messages(Client &client);
+  //! Handle one message. Returns false if the client should be disconnected.
+  bool handle_message(Client &client, const uint32_t type,
+                      const uint8_t *payload, const uint64_t size);
+
+public:
+  /*!
+   * Create a server listening at a local (Unix domain) socket
+   * @param socket_path Location of the socket to create. Any existing socket
+   * at this location is replaced.
+   * @throws std::runtime_error if the socket can't be created
+   */
+  LogServer(const std::string socket_path);
+  //! Destructor: stops the server, closing the files and the socket
+  ~LogServer();
+
+  /*!
+   * Handle Loggers until `stop()` is called. All of the files are written
+   * from the thread that calls this.
+   */
+  void serve();
+
+  //! Run `serve()` in a background thread
+  void start();
+
+  /*!
+   * Stop serving (from any thread), and wait for the background thread if
+   * started with `start()`. Loggers that are still connected can no longer
+   * save anything.
+   */
+  void stop();
+};
+
+/*!
+ * Sends everything a Logger saves to a `LogServer` over its socket
+ */
+class SocketLogSink : public LogSink
+{
+private:
+  //! Connected socket
+  int m_socket;
+  //! Whether the connection has failed
+  bool m_failed = false;
+  //! Messages can come from the writer thread and the simulation thread
+  std::mutex m_mutex;
+  //! Message being built
+  std::vector<uint8_t> m_message;
+  //! Size of a row of each dataset in the current trial (bytes)
+  std::vector<size_t> m_row_bytes;
+
+  //! Start building a message in m_message. The lock must be held.
+  void begin_message(const uint32_t type);
+  //! Send m_message followed by `size` bytes of `data`. The lock must be
+  //! held.
+  bool send_message(const void *data = nullptr, const size_t size = 0);
+  //! Wait for the server's reply to the last message. The lock must be held.
+  //! @return The reply, or -1 if the connection was lost
+  int receive_reply();
+
+public:
+  /*!
+   * Connect to a LogServer
+   * @param socket_path Location of the server's socket
+   * @param file_id Name and location of the HDF5 file to save to
+   * @throws std::runtime_error if the server can't be reached or can't open
+   * the file
+   */
+  SocketLogSink(const std::string &socket_path, const std::string &file_id);
+  ~SocketLogSink();
+
+  bool open_trial(const uint32_t trial_num, const bool overwrite);
+  void create_dataset(const LogDatasetSpec &spec);
+  bool append(const size_t dataset, const void *rows, const size_t count);
+  void write_param(const std::string &name, const json &val);
+  void write_vector(const std::string &name, const std::vector<double> &vals);
+  void flush();
+};
+} // namespace Kilosim
+
+#endif
@@ -0,0 +1,350 @@
+/*
+    Kilosim
+
+    Created 2018-10 by Julia Ebert
+*/
+
+#include <H5Cpp.h>
+#include <algorithm>
+#include <map>
+#include <unordered_map>
+#include <mutex>
+#include <stdexcept>
+#include <climits>
+#include <cstdlib>
+#include "LogSink.h"
+namespace Kilosim
+{
+
+namespace
+{
+//! The HDF5 library (serial build) isn't thread-safe, so every sink (and every
+//! Logger's writer thread) takes turns using it. This includes compressing
+//! chunks, which HDF5 does inside the write.
+std::mutex &hdf5_mutex()
+{
+    static std::mutex mutex;
+    return mutex;
+}
+
+//! Files opened by H5LogSinks in this process, by their full path. Only used
+//! with hdf5_mutex held.
+std::map<std::string, std::weak_ptr<H5::H5File>> &open_files()
+{
+    static std::map<std::string, std::weak_ptr<H5::H5File>> files;
+    return files;
+}
+
+//! Full path of an existing file (or "" if it doesn't exist)
+std::string full_path(const std::string &fname)
+{
+    char path[PATH_MAX];
+    if (realpath(fname.c_str(), path) == nullptr)
+    {
+        return "";
+    }
+    return path;
+}
+
+//! HDF5 type used to save values of each LogValueType
+const H5::PredType &h5_value_type(const LogValueType type)
+{
+    switch (type)
+    {
+    case LOG_FLOAT:
+        return H5::PredType::NATIVE_FLOAT;
+    case LOG_INT16:
+        return H5::PredType::NATIVE_INT16;
+    case LOG_UINT8:
+        return H5::PredType::NATIVE_UINT8;
+    default:
+        return H5::PredType::NATIVE_DOUBLE;
+    }
+}
+
+//! Get the H5 data type (for saving) from the JSON (NOTE: only works for
+//! atomic datatypes)
+H5::PredType h5_type(const json &j)
+{
+    static const std::unordered_map<json::value_t, H5::PredType> json_h5_types = {
+        {json::value_t::boolean, H5::PredType::NATIVE_HBOOL},
+        {json::value_t::number_integer, H5::PredType::NATIVE_INT},
+        {json::value_t::number_unsigned, H5::PredType::NATIVE_UINT},
+        {json::value_t::number_float, H5::PredType::NATIVE_DOUBLE},
+        {json::value_t::string, H5::PredType::C_S1},
+    };
+    return json_h5_types.at(j.type());
+}
+} // namespace
+
+size_t log_value_size(const LogValueType type)
+{
+    switch (type)
+    {
+    case LOG_FLOAT:
+        return sizeof(float);
+    case LOG_INT16:
+        return sizeof(int16_t);
+    case LOG_UINT8:
+        return sizeof(uint8_t);
+    default:
+        return sizeof(double);
+    }
+}
+
+H5LogSink::H5LogSink(const std::string &file_id)
+{
+    std::lock_guard<std::mutex> h5_lock(hdf5_mutex());
+    // From: https://stackoverflow.com/a/13849946
+    H5::Exception::dontPrint();
+
+    // Share the file if another sink in this process already has it open
+    std::string path = full_path(file_id);
+    if (!path.empty())
+    {
+        m_file = open_files()[path].lock();
+        if (m_file)
+        {
+            return;
+        }
+        try
+        {
+            m_file = std::make_shared<H5::H5File>(file_id.c_str(), H5F_ACC_RDWR);
+        }
+        catch (const H5::FileIException &)
+        {
+            throw std::runtime_error("Failed to open log file " + file_id +
+                                     " (is another program writing to it?)");
+        }
+    }
+    else
+    {
+        // Create the HDF5 file if it doesn't already exist
+        m_file = std::make_shared<H5::H5File>(file_id.c_str(), H5F_ACC_TRUNC);
+        path = full_path(file_id);
+    }
+    open_files()[path] = m_file;
+}
+
+H5LogSink::~H5LogSink()
+{
+    // The last sink using the file closes it
+    std::lock_guard<std::mutex> h5_lock(hdf5_mutex());
+    m_datasets.clear();
+    m_file = nullptr;
+}
+
+bool H5LogSink::open_trial(const uint32_t trial_num, const bool overwrite)
+{
+    std::lock_guard<std::mutex> h5_lock(hdf5_mutex());
+    m_datasets.clear();
+    m_num_rows.clear();
+    m_specs.clear();
+
+    // Create group for the trial
+    m_trial_group_name = "trial_" + std::to_string(trial_num);
+    try
+    {
+        if (H5Lexists(m_file->getId(), m_trial_group_name.c_str(), H5P_DEFAULT) > 0)
+        {
+            if (!overwrite)
+            {
+                return false;
+            }
+            m_file->unlink(m_trial_group_name.c_str());
+            fprintf(stderr, "WARNING: Overwrote trial data\n");
+        }
+        m_file->createGroup(m_trial_group_name.c_str());
+        m_file->createGroup((m_trial_group_name + "/params").c_str());
+    }
+    catch (const H5::Exception &)
+    {
+        throw std::runtime_error("Failed to create group " + m_trial_group_name);
+    }
+    return true;
+}
+
+bool log_chunk_shape(const LogDatasetSpec &spec, uint64_t &rows, uint64_t &cols)
+{
+    if (spec.row_len == 0)
+    {
+        return false;
+    }
+    // Choose chunks of about 64 KiB, at most 64 columns wide, so that slicing
+    // by robot or by time reads little more than what was asked for
+    const uint64_t value_size = log_value_size(spec.type);
+    const uint64_t target_values = (64 << 10) / value_size;
+    cols = spec.chunk_cols ? spec.chunk_cols : 64;
+    cols = std::min(cols, spec.row_len);
+    rows = spec.chunk_rows ? spec.chunk_rows : target_values / cols;
+    rows = std::max(rows, (uint64_t)1);
+    return rows <= UINT32_MAX / value_size / cols;
+}
+
+void H5LogSink::create_dataset(const LogDatasetSpec &spec)
+{
+    std::lock_guard<std::mutex> h5_lock(hdf5_mutex());
+    std::string dset_name = m_trial_group_name + "/" + spec.name;
+
+    // Keep the numbering even if this fails, so later datasets still line up
+    std::shared_ptr<H5::DataSet> dataset;
+    uint64_t chunk_rows, chunk_cols;
+    if (!log_chunk_shape(spec, chunk_rows, chunk_cols))
+    {
+        fprintf(stderr, "WARNING: Dataset %s has no values or too large chunks\n",
+                spec.name.c_str());
+    }
+    else
+    {
+        try
+        {
+            const hsize_t dims[2] = {0, spec.row_len};
+            const hsize_t max_dims[2] = {H5S_UNLIMITED, spec.row_len};
+            H5::DataSpace space(spec.rank, dims, max_dims);
+
+            const hsize_t chunk_dims[2] = {chunk_rows, chunk_cols};
+            H5::DSetCreatPropList create_props;
+            create_props.setChunk(spec.rank, chunk_dims);
+            if (spec.shuffle && spec.gzip_level > 0)
+            {
+                create_props.setShuffle();
+            }
+            if (spec.gzip_level > 0)
+            {
+                create_props.setDeflate(spec.gzip_level);
+            }
+
+            // Rows are appended a few at a time, so keep a whole row of chunks
+            // in the cache. Otherwise partly filled chunks are decompressed and
+            // compressed again for every batch of rows.
+            const size_t chunks_per_row = (spec.row_len + chunk_cols - 1) / chunk_cols;
+            const size_t chunk_bytes = chunk_rows * chunk_cols * log_value_size(spec.type);
+            H5::DSetAccPropList access_props;
+            access_props.setChunkCache(std::max(chunks_per_row * 10 + 1, (size_t)521),
+                                       std::max(chunks_per_row * chunk_bytes, (size_t)1 << 20),
+                                       1.0);
+
+            dataset = std::make_shared<H5::DataSet>(m_file->createDataSet(
+                dset_name, h5_value_type(spec.type), space, create_props,
+                access_props));
+        }
+        catch (const H5::Exception &)
+        {
+            fprintf(stderr, "WARNING: Failed to create dataset %s\n", spec.name.c_str());
+        }
+    }
+    m_datasets.push_back(dataset);
+    m_num_rows.push_back(0);
+    m_specs.push_back(spec);
+}
+
+bool H5LogSink::append(const size_t dataset, const void *rows, const size_t count)
+{
+    std::lock_guard<std::mutex> h5_lock(hdf5_mutex());
+    if (dataset >= m_datasets.size() || !m_datasets[dataset])
+    {
+        return false;
+    }
+    const LogDatasetSpec &spec = m_specs[dataset];
+    H5::DataSet &dset = *m_datasets[dataset];
+    try
+    {
+        const hsize_t new_size[2] = {m_num_rows[dataset] + count, spec.row_len};
+        dset.extend(new_size);
+
+        H5::DataSpace file_space = dset.getSpace();
+        const hsize_t offset[2] = {m_num_rows[dataset], 0};
+        const hsize_t block[2] = {count, spec.row_len};
+        file_space.selectHyperslab(H5S_SELECT_SET, block, offset);
+        H5::DataSpace mem_space(spec.rank, block);
+        dset.write(rows, h5_value_type(spec.type), mem_space, file_space);
+        m_num_rows[dataset] += count;
+        return true;
+    }
+    catch (const H5::Exception &)
+    {
+        return false;
+    }
+}
+
+void H5LogSink::write_param(const std::string &name, const json &val)
+{
+    // Example: https://support.hdfgroup.org/ftp/HDF5/current/src/unpacked/c++/examples/h5group.cpp
+    // https://support.hdfgroup.org/ftp/HDF5/current/src/unpacked/c++/examples/h5tutr_crtgrpd.cpp
+    std::lock_guard<std::mutex> h5_lock(hdf5_mutex());
+    std::string dset_name = m_trial_group_name + "/params/" + name;
+    try
+    {
+        H5::PredType val_type = h5_type(val);
+        H5::DataSpace dataspace;
+        if (val_type == H5::PredType::C_S1)
+        {
+            std::string str_val = val.get<std::string>();
+            H5::StrType strtype(H5::PredType::C_S1, H5T_VARIABLE);
+            H5::DataSet dataset =
+                m_file->createDataSet(dset_name, strtype, dataspace);
+            dataset.write(str_val, strtype);
+        }
+        else
+        {
+            H5::DataSet dataset =
+                m_file->createDataSet(dset_name, val_type, dataspace);
+            // Save scalar...
+
+            if (val_type == H5::PredType::NATIVE_HBOOL)
+            {
+                bool bool_val = val.get<bool>();
+                dataset.write(&bool_val, val_type);
+            }
+            else if (val_type == H5::PredType::NATIVE_INT)
+            {
+                int int_val = val.get<int>();
+                dataset.write(&int_val, val_type);
+            }
+            else if (val_type == H5::PredType::NATIVE_UINT)
+            {
+                uint uint_val = val.get<uint>();
+                dataset.write(&uint_val, val_type);
+            }
+            else if (val_type == H5::PredType::NATIVE_DOUBLE)
+            {
+                double double_val = val.get<double>();
+                dataset.write(&double_val, val_type);
+            }
+        }
+    }
+    catch (const std::exception &)
+    {
+        fprintf(stderr, "WARNING: Failed to save param %s\n", name.c_str());
+    }
+    catch (const H5::Exception &)
+    {
+        fprintf(stderr, "WARNING: Failed to save param %s\n", name.c_str());
+    }
+}
+
+void H5LogSink::write_vector(const std::string &name, const std::vector<double> &vals)
+{
+    std::lock_guard<std::mutex> h5_lock(hdf5_mutex());
+    std::string dset_name = m_trial_group_name + "/" + name;
+    hsize_t out_len[1] = {vals.size()};
+    try
+    {
+        H5::DataType datatype(H5::PredType::NATIVE_DOUBLE);
+        H5::DataSpace dataspace(1, out_len);
+        H5::DataSet dataset = m_file->createDataSet(dset_name, datatype, dataspace);
+        dataset.write(vals.data(), datatype);
+    }
+    catch (const H5::Exception &)
+    {
+        fprintf(stderr, "WARNING: Failed to save vector %s\n", name.c_str());
+    }
+}
+
+void H5LogSink::flush()
+{
+    std::lock_guard<std::mutex> h5_lock(hdf5_mutex());
+    m_file->flush(H5F_SCOPE_LOCAL);
+}
+
+} // namespace Kilosim
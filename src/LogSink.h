@@ -0,0 +1,192 @@
+/*
+  Kilosim
+
+  Destinations for the data saved by a Logger
+*/
+
+#ifndef __KILOSIM_LOGSINK_H
+#define __KILOSIM_LOGSINK_H
+
+#include "../include/json.hpp"
+#include <string>
+#include <vector>
+#include <memory>
+#include <cstdint>
+
+using json = nlohmann::json;
+
+namespace H5
+{
+class H5File;
+class DataSet;
+} // namespace H5
+
+namespace Kilosim
+{
+//! Types of values that can be saved in a dataset
+enum LogValueType : uint8_t
+{
+  LOG_DOUBLE,
+  LOG_FLOAT,
+  LOG_INT16,
+  LOG_UINT8
+};
+
+//! Size in bytes of a value of each LogValueType
+size_t log_value_size(const LogValueType type);
+
+//! LogValueType used to save values of each supported C++ type
+template <typename T>
+struct LogValueTypeOf;
+template <>
+struct LogValueTypeOf<double>
+{
+  static const LogValueType value = LOG_DOUBLE;
+};
+template <>
+struct LogValueTypeOf<float>
+{
+  static const LogValueType value = LOG_FLOAT;
+};
+template <>
+struct LogValueTypeOf<int16_t>
+{
+  static const LogValueType value = LOG_INT16;
+};
+template <>
+struct LogValueTypeOf<uint8_t>
+{
+  static const LogValueType value = LOG_UINT8;
+};
+
+/*!
+ * Description of a dataset that rows are appended to
+ */
+struct LogDatasetSpec
+{
+  //! Name within the trial group
+  std::string name;
+  //! 1 for a time series of single values, 2 for rows of values
+  uint8_t rank;
+  //! Type of the values
+  LogValueType type;
+  //! Number of values in each row
+  uint64_t row_len;
+  //! Compression level (0 for none)
+  uint32_t gzip_level;
+  //! Whether to shuffle bytes before compressing
+  bool shuffle;
+  //! Rows and maximum columns in each chunk (0 to choose automatically)
+  uint64_t chunk_rows;
+  uint64_t chunk_cols;
+};
+
+/*!
+ * Find the shape of the chunks that a dataset is stored in
+ * @param spec Dataset
+ * @param rows Rows in each chunk
+ * @param cols Columns in each chunk
+ * @return Whether the dataset can be stored: its rows aren't empty and its
+ * chunks are smaller than HDF5's limit of 4 GiB
+ */
+bool log_chunk_shape(const LogDatasetSpec &spec, uint64_t &rows, uint64_t &cols);
+
+/*!
+ * Where a Logger saves its data. A LogSink writes one trial at a time: a
+ * group named `trial_#` with a `params` group and datasets that rows are
+ * appended to.
+ *
+ * `append()` is called by the Logger's writer thread, and everything else by
+ * the simulation thread, so implementations must allow that.
+ */
+class LogSink
+{
+public:
+  virtual ~LogSink() {}
+
+  /*!
+   * Start saving a trial by creating its group
+   * @param trial_num Number of the trial
+   * @param overwrite Whether to replace the trial if it already exists
+   * @return Whether the trial can be saved (false if it exists and
+   * `overwrite` is false)
+   * @throws std::runtime_error if the trial can't be created for any other
+   * reason (e.g., the connection to a log server was lost)
+   */
+  virtual bool open_trial(const uint32_t trial_num, const bool overwrite) = 0;
+
+  /*!
+   * Create a dataset in the current trial. Datasets are numbered in the order
+   * they're created, starting from 0 for each trial (even if creating one
+   * fails).
+   * @param spec Description of the dataset
+   */
+  virtual void create_dataset(const LogDatasetSpec &spec) = 0;
+
+  /*!
+   * Append rows to a dataset
+   * @param dataset Number of the dataset in the current trial
+   * @param rows Values of the rows, one row after another
+   * @param count Number of rows
+   * @return Whether the rows were saved (or sent)
+   */
+  virtual bool append(const size_t dataset, const void *rows, const size_t count) = 0;
+
+  /*!
+   * Save an atomic parameter (bool, number, or string) in the trial's params
+   * group
+   */
+  virtual void write_param(const std::string &name, const json &val) = 0;
+
+  //! Save a vector as a dataset in the trial group
+  virtual void write_vector(const std::string &name, const std::vector<double> &vals) = 0;
+
+  //! Make sure everything saved so far is in the file
+  virtual void flush() = 0;
+};
+
+/*!
+ * Saves to an HDF5 file. Every H5LogSink in the process that saves to the
+ * same file shares one open file, so several Loggers (in different threads)
+ * can save different trials to the same file.
+ *
+ * The HDF5 library isn't thread-safe, so every H5LogSink in the process (for
+ * any file) takes turns using it. HDF5 compresses chunks while writing them,
+ * so Loggers in the same process also compress one at a time. With many
+ * Loggers in one process, lower the compression level if their writer
+ * threads can't keep up.
+ */
+class H5LogSink : public LogSink
+{
+private:
+  //! Opened file (shared)
+  std::shared_ptr<H5::H5File> m_file;
+  //! Group of the current trial. e.g., trial_0
+  std::string m_trial_group_name;
+  //! Datasets of the current trial, numbered in the order they were created
+  std::vector<std::shared_ptr<H5::DataSet>> m_datasets;
+  //! Number of rows in each dataset
+  std::vector<uint64_t> m_num_rows;
+  //! Description of each dataset
+  std::vector<LogDatasetSpec> m_specs;
+
+public:
+  /*!
+   * Open (or create, if it doesn't exist) an HDF5 file
+   * @param file_id Name and location of the file
+   * @throws std::runtime_error if the file exists but can't be opened (e.g.,
+   * another process is writing to it)
+   */
+  H5LogSink(const std::string &file_id);
+  ~H5LogSink();
+
+  bool open_trial(const uint32_t trial_num, const bool overwrite);
+  void create_dataset(const LogDatasetSpec &spec);
+  bool append(const size_t dataset, const void *rows, const size_t count);
+  void write_param(const std::string &name, const json &val);
+  void write_vector(const std::string &name, const std::vector<double> &vals);
+  void flush();
+};
+} // namespace Kilosim
+
+#endif
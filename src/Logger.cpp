@@ -5,70 +5,192 @@
 */
 
 #include <typeinfo>
+#include <algorithm>
+#include <cstring>
 #include "Logger.h"
+#include "LogServer.h"
 namespace Kilosim
 {
 
+namespace
+{
+//! Number of robots in each block of the fused pass. This is fixed (rather
+//! than one block per thread) so that reductions are merged the same way on
+//! any number of threads.
+const size_t FUSED_BLOCK_SIZE = 256;
+} // namespace
+
 Logger::Logger(World &world, std::string const file_id, int const trial_num,
-               bool const overwrite_trials)
+               bool const overwrite_trials, std::string const log_server)
     : m_world(world),
       m_file_id(file_id),
       m_overwrite_trials(overwrite_trials)
 {
-    // Create the HDF5 file if it doesn't already exist
-    m_h5_file = create_or_open_file(file_id);
+    // The time series is always the first column
+    m_columns.push_back(new_column<double>("time", LOG_TIME, 1));
+
+    if (log_server.empty())
+    {
+        // Create the HDF5 file if it doesn't already exist
+        m_sink.reset(new H5LogSink(file_id));
+    }
+    else
+    {
+        m_sink.reset(new SocketLogSink(log_server, file_id));
+    }
     set_trial(trial_num);
+    allocate_buffers();
+    m_writer = std::thread(&Logger::write_rows, this);
 }
 
 Logger::~Logger(void)
 {
-    m_h5_file->close();
+    close();
 }
 
-void Logger::set_trial(uint const trial_num)
+void Logger::close()
 {
-    m_trial_num = trial_num;
-    // Create group for the trial
-    m_trial_group_name = "trial_" + std::to_string(trial_num);
-    m_params_group_name = m_trial_group_name + "/params";
-    try
+    if (m_closed)
+    {
+        return;
+    }
+    drain();
+    {
+        std::lock_guard<std::mutex> lock(m_queue_mutex);
+        m_stop_writer = true;
+    }
+    m_rows_logged.notify_one();
+    m_writer.join();
+
+    // The file is closed once no other Logger is using it
+    m_sink = nullptr;
+    m_closed = true;
+}
+
+void Logger::flush()
+{
+    drain();
+    if (!m_closed)
+    {
+        m_sink->flush();
+    }
+}
+
+void Logger::set_buffer_size(const size_t bytes)
+{
+    drain();
+    m_buffer_bytes = bytes;
+    allocate_buffers();
+}
+
+void Logger::allocate_buffers()
+{
+    size_t row_bytes = 0;
+    for (auto &column : m_columns)
+    {
+        row_bytes += column.row_len * column.value_size;
+    }
+    m_capacity = std::max(m_buffer_bytes / row_bytes, (size_t)1);
+    for (auto &column : m_columns)
+    {
+        column.rows.assign(m_capacity * column.row_len * column.value_size, 0);
+    }
+    // Nothing is buffered, so the ring buffers can start from the beginning
+    m_head = 0;
+    m_tail = 0;
+}
+
+void Logger::drain() const
+{
+    std::unique_lock<std::mutex> lock(m_queue_mutex);
+    m_rows_written.wait(lock, [this]() { return m_head == m_tail; });
+}
+
+void Logger::write_rows()
+{
+    std::unique_lock<std::mutex> lock(m_queue_mutex);
+    while (true)
     {
-        H5::Group *trialGroup = new H5::Group(
-            m_h5_file->openGroup(m_trial_group_name.c_str()));
-        (void)trialGroup; //Suppresses warning abut trialGroup variable not being used
-        if (m_overwrite_trials)
+        m_rows_logged.wait(lock, [this]() { return m_head != m_tail || m_stop_writer; });
+        if (m_head == m_tail)
         {
-            m_h5_file->unlink(m_trial_group_name.c_str());
-            fprintf(stderr, "WARNING: Overwrote trial data\n");
+            // Asked to stop, and everything has been written
+            return;
         }
-        else
+        // Write every row that's been logged so far. The simulation thread only
+        // adds rows after m_tail, so these can be read without the lock.
+        const size_t start = m_head % m_capacity;
+        const size_t count = m_tail - m_head;
+        lock.unlock();
+        // The rows may wrap around the end of the ring buffers
+        const size_t first_count = std::min(count, m_capacity - start);
+        for (size_t c = 0; c < m_columns.size(); c++)
         {
-            fprintf(stderr, "Conflicts with existing trial. Exiting to avoid data overwrite.\n");
-            m_h5_file->close();
-            exit(EXIT_FAILURE);
+            const LogColumn &column = m_columns[c];
+            const size_t row_bytes = column.row_len * column.value_size;
+            bool ok = m_sink->append(c, &column.rows[start * row_bytes], first_count);
+            if (ok && count > first_count)
+            {
+                ok = m_sink->append(c, &column.rows[0], count - first_count);
+            }
+            if (!ok)
+            {
+                fprintf(stderr, "WARNING: Failed to append data to dataset %s\n",
+                        column.name.c_str());
+            }
         }
+        lock.lock();
+        m_head += count;
+        m_rows_written.notify_all();
     }
-    catch (H5::FileIException &)
+}
+
+void Logger::create_dataset(const LogColumn &column)
+{
+    LogDatasetSpec spec;
+    spec.name = column.name;
+    // The time series is 1D; aggregators are 2D (time x values)
+    spec.rank = (column.kind == LOG_TIME) ? 1 : 2;
+    spec.type = column.type;
+    spec.row_len = column.row_len;
+    spec.gzip_level = m_gzip_level;
+    spec.shuffle = m_shuffle;
+    spec.chunk_rows = m_chunk_rows;
+    spec.chunk_cols = m_chunk_cols;
+    m_sink->create_dataset(spec);
+}
+
+void Logger::set_compression(const unsigned int gzip_level, const bool shuffle)
+{
+    m_gzip_level = std::min(gzip_level, 9u);
+    m_shuffle = shuffle;
+}
+
+void Logger::set_chunk_size(const size_t rows, const size_t cols)
+{
+    m_chunk_rows = rows;
+    m_chunk_cols = cols;
+}
+
+void Logger::set_trial(uint const trial_num)
+{
+    // Rows logged so far belong to the previous trial
+    drain();
+    m_trial_num = trial_num;
+    // Create group for the trial
+    if (!m_sink->open_trial(trial_num, m_overwrite_trials))
     {
+        fprintf(stderr, "Conflicts with existing trial. Exiting to avoid data overwrite.\n");
+        m_sink = nullptr;
+        exit(EXIT_FAILURE);
     }
-    H5::Group *trialGroup =
-        new H5::Group(m_h5_file->createGroup(m_trial_group_name.c_str()));
-    (void)trialGroup; // Suppresses warning abut trialGroup variable not being used
-
-    // Create the params group if it doesn't already exist
-    m_params_group = create_or_open_group(m_h5_file, m_params_group_name);
-
-    // Create a packet table dataset for the timeseries
-    m_time_dset_name = m_trial_group_name + "/time";
-    FL_PacketTable *time_packet_table = new FL_PacketTable(
-        m_h5_file->getId(),
-        (char *)m_time_dset_name.c_str(),
-        H5T_NATIVE_DOUBLE, 1);
-    if (!time_packet_table->IsValid())
+
+    // Create datasets for the timeseries and the aggregators in the new trial
+    // group
+    for (auto &column : m_columns)
     {
-        fprintf(stderr, "WARNING: Failed to create time series");
+        create_dataset(column);
     }
-    m_time_table = H5PacketTablePtr(time_packet_table);
 }
 
 uint Logger::get_trial() const
@@ -79,53 +201,176 @@ uint Logger::get_trial() const
 void Logger::add_aggregator(std::string const agg_name,
                             aggregatorFunc const agg_func)
 {
-    m_aggregators.insert({{agg_name, agg_func}});
-
     // Do a test run of the aggregator to get the length of the output
-    const std::vector<double> test_output = (*agg_func)(m_world.get_robots());
+    const size_t row_len = (*agg_func)(m_world.get_robots()).size();
 
-    hsize_t out_len[1] = {test_output.size()};
-    H5::ArrayType agg_type(H5::PredType::NATIVE_DOUBLE, 1, out_len);
-    std::make_shared<H5::ArrayType>(agg_type);
+    LogColumn column = new_column<double>(agg_name, LOG_AGGREGATOR, row_len);
+    column.fill = [agg_func, agg_name, row_len](std::vector<Robot *> &robots, void *out) {
+        // Call the aggregator function on the robots
+        const std::vector<double> agg_val = (*agg_func)(robots);
+        if (agg_val.size() != row_len)
+        {
+            fprintf(stderr, "WARNING: Aggregator %s returned %zu values instead of %zu\n",
+                    agg_name.c_str(), agg_val.size(), row_len);
+        }
+        double *row = static_cast<double *>(out);
+        const size_t n = std::min(agg_val.size(), row_len);
+        std::copy(agg_val.begin(), agg_val.begin() + n, row);
+        std::fill(row + n, row + row_len, 0.0);
+    };
+    add_column(column);
+}
+
+void Logger::add_column(const LogColumn &added)
+{
+    for (auto &column : m_columns)
+    {
+        if (column.name == added.name)
+        {
+            fprintf(stderr, "WARNING: Aggregator %s was already added\n",
+                    added.name.c_str());
+            return;
+        }
+    }
+    if (added.row_len == 0)
+    {
+        fprintf(stderr, "WARNING: Aggregator %s has no values; not logging it\n",
+                added.name.c_str());
+        return;
+    }
 
-    // Create a packet table and save it
-    std::string agg_dset_name = m_trial_group_name + "/" + agg_name;
-    FL_PacketTable *agg_packet_table = new FL_PacketTable(
-        m_h5_file->getId(), (char *)agg_dset_name.c_str(), agg_type.getId(), 1);
-    if (!agg_packet_table)
+    // The writer uses the columns while rows are buffered
+    drain();
+    m_columns.push_back(added);
+    create_dataset(m_columns.back());
+    if (added.kind == LOG_PER_ROBOT || added.kind == LOG_REDUCTION)
     {
-        fprintf(stderr, "WARNING: Failed to create aggregator table");
+        m_fused_columns.push_back(m_columns.size() - 1);
     }
-    m_aggregator_dsets.insert({{agg_name, H5PacketTablePtr(agg_packet_table)}});
+    allocate_buffers();
 }
 
-void Logger::log_state() const
+void Logger::evaluate_fused(std::vector<Robot *> &robots, const size_t slot) const
 {
-    // https://thispointer.com/how-to-iterate-over-an-unordered_map-in-c11/
-    // Add the current time to the time series
-    double t = m_world.get_time();
-    herr_t err = m_time_table->AppendPacket(&t);
-    if (err < 0)
-        fprintf(stderr, "WARNING: Failed to append to time series");
-
-    for (std::pair<std::string, aggregatorFunc> agg : m_aggregators)
+    const size_t n = robots.size();
+    const size_t num_blocks = (n + FUSED_BLOCK_SIZE - 1) / FUSED_BLOCK_SIZE;
+    for (const size_t c : m_fused_columns)
     {
-        // Not sure about passing the pointer / reference here ?
-        log_aggregator(agg.first, agg.second);
+        const LogColumn &column = m_columns[c];
+        if (column.kind == LOG_PER_ROBOT && column.row_len != n)
+        {
+            fprintf(stderr, "WARNING: Aggregator %s has %zu values but there are %zu robots\n",
+                    column.name.c_str(), column.row_len, n);
+            memset(&column.rows[slot * column.row_len * column.value_size], 0,
+                   column.row_len * column.value_size);
+        }
+        else if (column.kind == LOG_REDUCTION)
+        {
+            // Only allocates when the number of robots grows
+            column.partials.resize(num_blocks * column.row_len);
+        }
+    }
+
+#pragma omp parallel for schedule(static)
+    for (size_t b = 0; b < num_blocks; b++)
+    {
+        const size_t begin = b * FUSED_BLOCK_SIZE;
+        const size_t end = std::min(begin + FUSED_BLOCK_SIZE, n);
+        // Every aggregator goes over the block's robots while they're in cache
+        for (const size_t c : m_fused_columns)
+        {
+            const LogColumn &column = m_columns[c];
+            if (column.kind == LOG_PER_ROBOT)
+            {
+                column.fill_block(robots, begin, std::min(end, column.row_len),
+                                  &column.rows[slot * column.row_len * column.value_size]);
+            }
+            else
+            {
+                double *part = &column.partials[b * column.row_len];
+                std::fill(part, part + column.row_len, column.initial);
+                column.fill_block(robots, begin, end, part);
+            }
+        }
+    }
+
+    // Merge the blocks in order, so the results don't depend on the number of
+    // threads
+    for (const size_t c : m_fused_columns)
+    {
+        const LogColumn &column = m_columns[c];
+        if (column.kind != LOG_REDUCTION)
+        {
+            continue;
+        }
+        const AggregatorSpan<double> total{
+            reinterpret_cast<double *>(&column.rows[slot * column.row_len * sizeof(double)]),
+            column.row_len};
+        std::fill(total.begin(), total.end(), column.initial);
+        for (size_t b = 0; b < num_blocks; b++)
+        {
+            const AggregatorSpan<double> part{&column.partials[b * column.row_len],
+                                              column.row_len};
+            if (column.merge)
+            {
+                column.merge(total, part);
+            }
+            else
+            {
+                for (size_t k = 0; k < column.row_len; k++)
+                {
+                    total[k] += part[k];
+                }
+            }
+        }
+        if (column.finish)
+        {
+            column.finish(total, n);
+        }
     }
 }
 
-void Logger::log_aggregator(std::string const agg_name,
-                            aggregatorFunc const agg_func) const
+void Logger::log_state() const
 {
-    // Call the aggregator function on the robots
-    std::vector<double> agg_val = (*agg_func)(m_world.get_robots());
-    // TODO: append to the packet table (should be created by add_aggregator)
-    herr_t err = m_aggregator_dsets.at(agg_name)->AppendPacket(agg_val.data());
-    if (err < 0)
+    if (m_closed)
+    {
+        fprintf(stderr, "WARNING: Cannot log state after the Logger is closed\n");
+        return;
+    }
+    // Wait for a free row in the buffers (only if the writer is behind)
+    size_t slot;
+    {
+        std::unique_lock<std::mutex> lock(m_queue_mutex);
+        m_rows_written.wait(lock, [this]() { return m_tail - m_head < m_capacity; });
+        slot = m_tail % m_capacity;
+    }
+
+    // The writer doesn't read this row until m_tail moves past it
+    std::vector<Robot *> &robots = m_world.get_robots();
+    for (const auto &column : m_columns)
+    {
+        uint8_t *row = &column.rows[slot * column.row_len * column.value_size];
+        if (column.kind == LOG_TIME)
+        {
+            // Add the current time to the time series
+            const double t = m_world.get_time();
+            memcpy(row, &t, sizeof(t));
+        }
+        else if (column.kind == LOG_AGGREGATOR)
+        {
+            column.fill(robots, row);
+        }
+    }
+    if (!m_fused_columns.empty())
     {
-        fprintf(stderr, "WARNING: Failed to append data to aggregator table");
+        evaluate_fused(robots, slot);
     }
+
+    {
+        std::lock_guard<std::mutex> lock(m_queue_mutex);
+        m_tail++;
+    }
+    m_rows_logged.notify_one();
 }
 
 void Logger::log_config(ConfigParser &config, const bool show_warnings)
@@ -144,13 +389,13 @@ void Logger::log_param(const std::string name, const json val)
 
 void Logger::log_param(const std::string name, const json val, const bool show_warnings)
 {
-    // Example: https://support.hdfgroup.org/ftp/HDF5/current/src/unpacked/c++/examples/h5group.cpp
-    // https://support.hdfgroup.org/ftp/HDF5/current/src/unpacked/c++/examples/h5tutr_crtgrpd.cpp
-
-    std::string dset_name = m_params_group_name + "/" + name;
-
+    if (m_closed)
+    {
+        fprintf(stderr, "WARNING: Cannot log param %s after the Logger is closed\n",
+                name.c_str());
+    }
     // Get the type of the parameter
-    if (val.type() == json::value_t::object)
+    else if (val.type() == json::value_t::object)
     {
         if (show_warnings)
             printf("WARNING: Cannot save param '%s' (currently no support for JSON 'object' type)\n",
@@ -165,99 +410,19 @@ void Logger::log_param(const std::string name, const json val, const bool show_w
     }
     else
     {
-        H5::PredType val_type = h5_type(val);
-        H5::DataSpace *dataspace = new H5::DataSpace();
-        if (val_type == H5::PredType::C_S1)
-        {
-            std::string str_val = val.get<std::string>();
-            hid_t strtype = H5Tcopy(H5T_C_S1);
-            H5Tset_size(strtype, H5T_VARIABLE);
-            H5::DataSet dataset =
-                m_h5_file->createDataSet(dset_name, strtype, *dataspace);
-            dataset.write(&str_val, strtype);
-        }
-        else
-        {
-            H5::DataSet dataset =
-                m_h5_file->createDataSet(dset_name, val_type, *dataspace);
-            // Save scalar...
-
-            if (val_type == H5::PredType::NATIVE_HBOOL)
-            {
-                bool bool_val = val.get<bool>();
-                dataset.write(&bool_val, val_type);
-            }
-            else if (val_type == H5::PredType::NATIVE_INT)
-            {
-                int int_val = val.get<int>();
-                dataset.write(&int_val, val_type);
-            }
-            else if (val_type == H5::PredType::NATIVE_UINT)
-            {
-                uint uint_val = val.get<uint>();
-                dataset.write(&uint_val, val_type);
-            }
-            else if (val_type == H5::PredType::NATIVE_DOUBLE)
-            {
-                double double_val = val.get<double>();
-                dataset.write(&double_val, val_type);
-            }
-        }
+        m_sink->write_param(name, val);
     }
 }
 
 void Logger::log_vector(const std::string vec_name, const std::vector<double> vec_val)
 {
-    std::string dset_name = m_trial_group_name + "/" + vec_name;
-    hsize_t out_len[1] = {vec_val.size()};
-    // H5::ArrayType agg_type(H5::PredType::NATIVE_DOUBLE, 1, out_len);
-    // std::make_shared<H5::ArrayType>(agg_type);
-
-    H5::DataType datatype(H5::PredType::NATIVE_DOUBLE);
-    H5::DataSpace dataspace(1, out_len);
-    H5::DataSet dataset = m_h5_file->createDataSet(dset_name, datatype, dataspace);
-    dataset.write(vec_val.data(), datatype);
-    // H5::DataSet *dataset = new H5::DataSet(
-    //     m_h5_file->createDataSet(vec_name, H5::PredType::NATIVE_DOUBLE, *dataspace));
-    // dataset->write(vec_val.data(), H5::PredType::NATIVE_DOUBLE);
-}
-
-H5::PredType Logger::h5_type(const json j) const
-{
-    return m_json_h5_types.at(j.type());
-}
-
-Logger::H5FilePtr Logger::create_or_open_file(const std::string &fname)
-{
-    // From: https://stackoverflow.com/a/13849946
-    H5::Exception::dontPrint();
-    H5::H5File *file;
-    try
-    {
-        file = new H5::H5File(fname.c_str(), H5F_ACC_RDWR);
-    }
-    catch (const H5::FileIException &)
-    {
-        file = new H5::H5File(fname.c_str(), H5F_ACC_TRUNC);
-    }
-    return H5FilePtr(file);
-}
-
-Logger::H5GroupPtr Logger::create_or_open_group(H5FilePtr file,
-                                                const std::string &group_name)
-{
-    // https://stackoverflow.com/q/35668056
-    H5::Exception::dontPrint();
-    H5::Group *group;
-    try
-    {
-        group = new H5::Group(file->openGroup(group_name));
-    }
-    catch (H5::Exception &err)
+    if (m_closed)
     {
-        group = new H5::Group(file->createGroup(group_name));
+        fprintf(stderr, "WARNING: Cannot log vector %s after the Logger is closed\n",
+                vec_name.c_str());
+        return;
     }
-    return H5GroupPtr(group);
+    m_sink->write_vector(vec_name, vec_val);
 }
 
 } // namespace Kilosim
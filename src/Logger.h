@@ -10,28 +10,57 @@
 #ifndef __KILOSIM_LOGGER_H
 #define __KILOSIM_LOGGER_H
 
-#include <H5PacketTable.h>
-#include <H5Cpp.h>
 #include "Robot.h"
 #include "World.h"
 #include "ConfigParser.h"
+#include "LogSink.h"
 #include "../include/json.hpp"
 #include <unordered_map>
 #include <string>
 #include <memory>
 #include <vector>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
 
 using json = nlohmann::json;
 
 namespace Kilosim
 {
+/*!
+ * Values that an aggregator writes for one row of its dataset. The memory is
+ * owned by the Logger, so aggregators don't allocate anything.
+ */
+template <typename T>
+struct AggregatorSpan
+{
+  //! First value
+  T *data;
+  //! Number of values (as given to `Logger::add_aggregator()`)
+  size_t size;
+
+  T &operator[](const size_t i) const
+  {
+    return data[i];
+  }
+  T *begin() const
+  {
+    return data;
+  }
+  T *end() const
+  {
+    return data + size;
+  }
+};
+
 /*!
  * A Logger is used to save [HDF5](https://portal.hdfgroup.org/display/support)
  * files containing parameters and continuous state information for multiple
  * simulation trials.
  *
- * State information is logged through aggregator functions, which reduce the
- * state of the robots to a vector. This could be a single average value over
+ * State information is logged through aggregators, which reduce the state of
+ * the robots to a fixed number of values. This could be a single average value over
  * all the robots (e.g., mean observed ambient light) all the way to saving a
  * value for every robot (e.g., each robot's ambient light value as an
  * element). Each aggregator is saved as an array, where each row is the
@@ -48,8 +77,8 @@ namespace Kilosim
  * |   |   |__ param1 (dataset)
  * |   |   |__ param2 (dataset)
  * |   |   |__ ...
- * |   |__ aggregator_1 (dataset)  [n x t]
- * |   |__ aggregator_2 (dataset)  [m x t]
+ * |   |__ aggregator_1 (dataset)  [t x n]
+ * |   |__ aggregator_2 (dataset)  [t x m]
  * |   |__ ...
  * |__ trial_2
  * |   |__ time (dataset)  [1 x t]
@@ -62,9 +91,19 @@ namespace Kilosim
  * where `t` is the number of time steps when data was logged, and
  * `aggregator_1` and `aggregator_2` were specified by the user.
  *
- * Logging (I/O in general) is one of the *slowest* parts of the simulation. As
- * such, a high logging rate will significantly slow down your simulations. Try
- * something like logging every 5-10 seconds, if you can get away with it.
+ * The datasets are chunked and compressed (see `set_compression()` and
+ * `set_chunk_size()`). Chunks span a block of rows *and* a block of columns, so
+ * reading one robot's history (one column) or a range of time (some rows)
+ * only reads the chunks that contain it, not the whole dataset.
+ *
+ * Logging (I/O in general) is one of the *slowest* parts of the simulation.
+ * To keep it from stalling the simulation, `log_state()` only runs the
+ * aggregators and copies their outputs into a bounded buffer. A background
+ * thread writes the buffered rows to the file in batches. If the
+ * buffer fills up (see `set_buffer_size()`), `log_state()` waits for the
+ * writer to catch up. Buffered rows are written when you call `flush()` or
+ * `close()`, or when the Logger is destroyed. A very high logging rate will
+ * still slow down your simulations once the disk can't keep up.
  *
  * If you delete an HDF5 file, it does NOT actually delete the data; it just
  * removes the reference to it. Therefore, rather than extensive use of the
@@ -82,22 +121,74 @@ public:
   /*!
    * A function mapping Robots to values
    * This is used by #log_state to compute values to save from all of the
-   * robots at a time step. The output will form a row in an H5::PacketTable. It
+   * robots at a time step. The output will form a row in a 2D dataset. It
    * may be one value per robot (e.g., the current motor command) or all the way
    * to one combined value from all the robots (e.g., the mean light perceived).
    *
    * Functions with this signature are the inputs to #add_aggregator
+   *
+   * @note These allocate a new vector every time they're called. For large
+   * outputs, use the `add_aggregator()` that takes a number of values and a
+   * callable instead.
    */
   typedef std::vector<double> (*aggregatorFunc)(std::vector<Robot *> &robots);
 
+  //! Combines the partial results `part` of a block of robots into `total`
+  typedef std::function<void(AggregatorSpan<double> total, AggregatorSpan<double> part)> ReductionMerge;
+  //! Computes the final values of a reduction from the merged results (e.g.,
+  //! dividing a sum by the number of robots)
+  typedef std::function<void(AggregatorSpan<double> total, size_t num_robots)> ReductionFinish;
+
 private:
-  //! Managed H5File pointer
-  typedef std::shared_ptr<H5::H5File> H5FilePtr;
-  //! Managed pointer to HDF5 Group
-  typedef std::shared_ptr<H5::Group> H5GroupPtr;
-  //! Managed pointer to HDF5 PacketTable
-  typedef std::shared_ptr<FL_PacketTable> H5PacketTablePtr;
   typedef std::unordered_map<std::string, double> Params;
+
+  //! How a column's rows are computed
+  enum LogColumnKind : uint8_t
+  {
+    //! The time series
+    LOG_TIME,
+    //! An aggregator called once with all of the robots
+    LOG_AGGREGATOR,
+    //! One value per robot (evaluated in the fused pass)
+    LOG_PER_ROBOT,
+    //! A reduction over the robots (evaluated in the fused pass)
+    LOG_REDUCTION
+  };
+
+  /*!
+   * A dataset that rows are appended to at every log_state(): the time series
+   * or an aggregator's outputs. Its dataset in the sink has the same number as
+   * its position in m_columns. Rows waiting to be written are kept in a ring
+   * buffer that holds the same number of rows for every column.
+   */
+  struct LogColumn
+  {
+    //! Name of the dataset within the trial group
+    std::string name;
+    //! How the rows are computed
+    LogColumnKind kind;
+    //! Writes a row of values from the robots (for LOG_AGGREGATOR)
+    std::function<void(std::vector<Robot *> &, void *)> fill;
+    //! Evaluates a block of robots [begin, end) in the fused pass: writes
+    //! their values into a row (LOG_PER_ROBOT) or adds them to partial results
+    //! (LOG_REDUCTION)
+    std::function<void(std::vector<Robot *> &, size_t, size_t, void *)> fill_block;
+    //! Merge, finish, and identity value of a LOG_REDUCTION
+    ReductionMerge merge;
+    ReductionFinish finish;
+    double initial;
+    //! Partial results of a LOG_REDUCTION for each block of robots
+    mutable std::vector<double> partials;
+    //! Number of values in each row
+    size_t row_len;
+    //! Type of the values
+    LogValueType type;
+    //! Size of each value (bytes)
+    size_t value_size;
+    //! Ring buffer of rows waiting to be written (filled by log_state())
+    mutable std::vector<uint8_t> rows;
+  };
+
   //! Reference to Kilosim World that this Logger tracks
   World &m_world;
   //! HDF5 file where the data lives
@@ -106,30 +197,43 @@ private:
   bool m_overwrite_trials;
   //! Trial number specifying group where the data lives
   uint m_trial_num;
-  //! Names and functions of aggregators
-  std::unordered_map<std::string, aggregatorFunc> m_aggregators;
-  //! Names and HDF5 datasets (PacketTables) for every aggregator
-  std::unordered_map<std::string, H5PacketTablePtr> m_aggregator_dsets;
-  //! Opened HDF5 file where this Logger saves
-  H5FilePtr m_h5_file;
-  //! HDF5 group name for trial. e.g., /trial_0
-  std::string m_trial_group_name;
-  //! HDF5 group name for trial parameters. e.g., /trial_0/params
-  std::string m_params_group_name;
-  //! HDF5 group opened within the file for storing/saving parameters
-  H5GroupPtr m_params_group;
-  //! HDF5 dataset name for time series (packet table)
-  std::string m_time_dset_name;
-  //! HDF5 PacketTable used to track the time (in seconds) when logging state
-  H5PacketTablePtr m_time_table;
-  //! Conversion from JSON types to HDF5 types (NOTE: only works for atomic datatypes)
-  std::unordered_map<json::value_t, H5::PredType> m_json_h5_types = {
-      {json::value_t::boolean, H5::PredType::NATIVE_HBOOL},
-      {json::value_t::number_integer, H5::PredType::NATIVE_INT},
-      {json::value_t::number_unsigned, H5::PredType::NATIVE_UINT},
-      {json::value_t::number_float, H5::PredType::NATIVE_DOUBLE},
-      {json::value_t::string, H5::PredType::C_S1},
-  };
+  //! Where the data is saved: the HDF5 file (shared with other Loggers in
+  //! this process) or a LogServer that saves it
+  std::unique_ptr<LogSink> m_sink;
+  //! Time series (first) and aggregators, in the order they were added. This
+  //! is only changed when there are no rows waiting to be written.
+  std::vector<LogColumn> m_columns;
+  //! Indices of the columns that are evaluated in the fused pass over the
+  //! robots (LOG_PER_ROBOT and LOG_REDUCTION)
+  std::vector<size_t> m_fused_columns;
+  //! Approximate memory used by the rows waiting to be written (bytes)
+  size_t m_buffer_bytes = 4 << 20;
+  //! Compression level for new datasets (0-9, 0 for none)
+  unsigned int m_gzip_level = 4;
+  //! Whether to shuffle bytes before compressing (usually compresses better)
+  bool m_shuffle = true;
+  //! Rows and columns in each chunk of new datasets (0 to choose
+  //! automatically)
+  size_t m_chunk_rows = 0;
+  size_t m_chunk_cols = 0;
+  //! Number of rows each column's ring buffer holds
+  size_t m_capacity = 0;
+  //! Number of rows written to the file so far (the oldest buffered row)
+  mutable uint64_t m_head = 0;
+  //! Number of rows logged so far (the next free row in the buffers)
+  mutable uint64_t m_tail = 0;
+  //! Protects m_head, m_tail, and m_stop_writer
+  mutable std::mutex m_queue_mutex;
+  //! Signalled when rows are logged (or the writer should stop)
+  mutable std::condition_variable m_rows_logged;
+  //! Signalled when the writer has written rows
+  mutable std::condition_variable m_rows_written;
+  //! Whether the writer thread should finish
+  bool m_stop_writer = false;
+  //! Whether the file has been closed
+  bool m_closed = false;
+  //! Background thread that writes buffered rows to the file
+  std::thread m_writer;
 
 public:
   /*!
@@ -144,15 +248,22 @@ public:
    * @param overwrite_trials Whether to overwrite data if the trial is already
    * in the log file. If set to `false`, the program will exit if the trial
    * already exists.
+   * @param log_server Location of the socket of a `LogServer` to save through,
+   * or "" (default) to write the file directly. Several Loggers in the same
+   * process can always save different trials to the same file at the same
+   * time; a LogServer lets Loggers in different processes do so too.
    *
    * @warning You must create any directories in the filepath to your `file_id`
    * before attempting to create a file with this constructor. If you attempt to
    * create a log file in a location (directory) that does not exist, your
    * program will terminate with an `H5::FileIException`.
+   * @throws std::runtime_error if the log server can't be reached, or the
+   * trial can't be created for a reason other than already existing
    */
   Logger(World &world, const std::string file_id, const int trial_num,
-         const bool overwrite_trials = false);
-  //! Destructor: closes the file when it goes out of scope
+         const bool overwrite_trials = false, const std::string log_server = "");
+  //! Destructor: writes any buffered rows and closes the file when it goes
+  //! out of scope
   ~Logger();
 
   /*!
@@ -164,6 +275,9 @@ public:
    * The same overwrite_trials flag from initialization is still in effect
    *
    * @param trial_num New trial you want to log.
+   * @throws std::runtime_error if the trial can't be created for a reason
+   * other than already existing (e.g., the connection to the log server was
+   * lost)
    */
   void set_trial(uint const trial_num);
 
@@ -186,6 +300,131 @@ public:
    */
   void add_aggregator(std::string const agg_name, aggregatorFunc const agg_func);
 
+  /*!
+   * Add an aggregator that writes its values straight into memory owned by
+   * the Logger, so logging doesn't allocate anything. It can be any callable
+   * (such as a lambda with captures, or a functor with its own state) with
+   * the signature `void(std::vector<Robot *> &robots, AggregatorSpan<T> out)`.
+   * It must set all `num_values` values of `out` every time it's called.
+   *
+   * The values are saved as type `T`, which can be `double` (default),
+   * `float`, `int16_t`, or `uint8_t`. Smaller types make smaller files. For
+   * example, to save every robot's motor command:
+   *
+   * ```
+   * logger.add_aggregator<uint8_t>(
+   *     "motor_command", world.get_robots().size(),
+   *     [](std::vector<Kilosim::Robot *> &robots,
+   *        Kilosim::AggregatorSpan<uint8_t> out) {
+   *       for (size_t i = 0; i < robots.size(); i++)
+   *         out[i] = robots[i]->get_motor_command();
+   *     });
+   * ```
+   *
+   * @param agg_name Name of the dataset in which to store the output of the
+   * agg_func. This exists within the trial_# group.
+   * @param num_values Number of values the aggregator writes every time
+   * @param agg_func Aggregator that writes values from the Robots in the World
+   */
+  template <typename T = double, typename Func>
+  void add_aggregator(const std::string agg_name, const size_t num_values,
+                      Func agg_func)
+  {
+    LogColumn column = new_column<T>(agg_name, LOG_AGGREGATOR, num_values);
+    column.fill = [agg_func, num_values](std::vector<Robot *> &robots, void *row) mutable {
+      agg_func(robots, AggregatorSpan<T>{static_cast<T *>(row), num_values});
+    };
+    add_column(column);
+  }
+
+  /*!
+   * Add an aggregator that saves one value for every robot, computed by
+   * `agg_func(robot)` (for example, `[](Kilosim::Robot &r) { return r.x; }`).
+   *
+   * Unlike other aggregators, all per-robot aggregators and reductions (see
+   * `add_reduction()`) are evaluated together in a single parallel pass over
+   * the robots, so `agg_func` must be safe to call from several threads at
+   * once (it's called as a const function).
+   *
+   * The row has one value per robot in the World when this is added. If the
+   * number of robots changes, extra robots aren't saved and missing ones are
+   * saved as 0.
+   *
+   * @param agg_name Name of the dataset in which to store the values
+   * @param agg_func Function of a `Robot &` returning a value convertible to
+   * `T` (`double`, `float`, `int16_t`, or `uint8_t`)
+   */
+  template <typename T = double, typename Func>
+  void add_robot_aggregator(const std::string agg_name, Func agg_func)
+  {
+    LogColumn column = new_column<T>(agg_name, LOG_PER_ROBOT,
+                                     m_world.get_robots().size());
+    column.fill_block = [agg_func](std::vector<Robot *> &robots, size_t begin,
+                                   size_t end, void *row) {
+      T *values = static_cast<T *>(row);
+      for (size_t i = begin; i < end; i++)
+      {
+        values[i] = agg_func(*robots[i]);
+      }
+    };
+    add_column(column);
+  }
+
+  /*!
+   * Add an aggregator that reduces all of the robots to `num_values` values
+   * (such as sums, means, or extremes), evaluated in the same single parallel
+   * pass over the robots as per-robot aggregators.
+   *
+   * The robots are split into fixed blocks (independent of the number of
+   * threads). For each block, the partial results start at `initial` and
+   * `accumulate` is called for each robot in the block. The partial results
+   * are then merged in block order, and `finish` is called on the total. The
+   * results are therefore the same (to the bit) on any number of threads.
+   *
+   * For example, the mean x-position:
+   *
+   * ```
+   * logger.add_reduction(
+   *     "mean_x", 1,
+   *     [](Kilosim::Robot &r, Kilosim::AggregatorSpan<double> acc) { acc[0] += r.x; },
+   *     nullptr,
+   *     [](Kilosim::AggregatorSpan<double> total, size_t n) { total[0] /= n; });
+   * ```
+   *
+   * `accumulate` must be safe to call from several threads at once (on
+   * different partial results).
+   *
+   * @param agg_name Name of the dataset in which to store the values
+   * @param num_values Number of values computed
+   * @param accumulate Adds a robot's contribution to the partial results, with
+   * the signature `void(Robot &robot, AggregatorSpan<double> acc)`
+   * @param merge Combines a block's partial results into the total (Default:
+   * add them)
+   * @param finish Computes the final values from the total (Default: none)
+   * @param initial Starting value of the partial results and the total. This
+   * should be the identity of `merge` (e.g., 0 for sums, infinity for
+   * minimums). (Default: 0)
+   */
+  template <typename Func>
+  void add_reduction(const std::string agg_name, const size_t num_values,
+                     Func accumulate, ReductionMerge merge = nullptr,
+                     ReductionFinish finish = nullptr, const double initial = 0)
+  {
+    LogColumn column = new_column<double>(agg_name, LOG_REDUCTION, num_values);
+    column.fill_block = [accumulate, num_values](std::vector<Robot *> &robots,
+                                                 size_t begin, size_t end, void *part) {
+      const AggregatorSpan<double> acc{static_cast<double *>(part), num_values};
+      for (size_t i = begin; i < end; i++)
+      {
+        accumulate(*robots[i], acc);
+      }
+    };
+    column.merge = merge;
+    column.finish = finish;
+    column.initial = initial;
+    add_column(column);
+  }
+
   /*!
    * Log the aggregators at the given time mapped over all the given robots in
    * the World. Every time this is called, the current time (in seconds) is
@@ -193,6 +432,61 @@ public:
    */
   void log_state() const;
 
+  /*!
+   * Wait until every row logged so far has been written, and flush the file
+   * to disk
+   */
+  void flush();
+
+  /*!
+   * Write all of the buffered rows, stop the writer thread, and close the
+   * file. Nothing can be logged afterwards. This is done automatically when
+   * the Logger is destroyed.
+   */
+  void close();
+
+  /*!
+   * Set how much memory can be used for rows that are waiting to be written.
+   * A larger buffer lets the file be written in bigger batches and absorbs
+   * slow writes without stopping the simulation. This waits for all rows
+   * logged so far to be written.
+   * @param bytes Size of the buffer in bytes. At least one row is always
+   * buffered. (Default: 4 MiB)
+   */
+  void set_buffer_size(const size_t bytes);
+
+  /*!
+   * Set how datasets are compressed. This applies to datasets created
+   * afterwards (by `add_aggregator()` and `set_trial()`), so call it before
+   * adding aggregators.
+   *
+   * Compressing is done by the writer thread, so it doesn't slow down the
+   * simulation unless the writer can't keep up. Loggers in the same process
+   * take turns using the HDF5 library, compression included, so many of them
+   * compress no faster than one.
+   * @param gzip_level Compression level from 1 (fastest) to 9 (smallest), or 0
+   * to not compress (Default: 4)
+   * @param shuffle Whether to shuffle the bytes of values before compressing,
+   * which usually makes floating point data much smaller (Default: true)
+   */
+  void set_compression(const unsigned int gzip_level, const bool shuffle = true);
+
+  /*!
+   * Set the size of the chunks that datasets are stored in. Like
+   * `set_compression()`, this applies to datasets created afterwards.
+   *
+   * Reading any value reads (and decompresses) its whole chunk, so smaller
+   * chunks make reading small slices faster but compress less well. By
+   * default, chunks are about 64 KiB and at most 64 columns (robots) wide.
+   * HDF5 can't store chunks of 4 GiB or more, so datasets with larger chunks
+   * aren't saved (with a warning).
+   * @param rows Number of rows (time steps) in each chunk, or 0 to choose
+   * automatically
+   * @param cols Maximum number of columns (values of an aggregator) in each
+   * chunk, or 0 to choose automatically
+   */
+  void set_chunk_size(const size_t rows, const size_t cols = 0);
+
   /*!
    * Log all of the values in the configuration as params in the HDF5 file/trial
    *
@@ -226,14 +520,34 @@ public:
   void log_vector(const std::string name, const std::vector<double> val_vec);
 
 private:
-  //! Log data for this specific aggregator
-  void log_aggregator(const std::string agg_name, const aggregatorFunc agg_func) const;
-  //! Get the H5 data type (for saving) from the JSON
-  H5::PredType h5_type(const json j) const;
-  //! Create or open an HDF5 file
-  H5FilePtr create_or_open_file(const std::string &fname);
-  //! Create or open a group in an HDF5 file
-  H5GroupPtr create_or_open_group(H5FilePtr file, const std::string &group_name);
+  //! Describe a column of values of type T
+  template <typename T>
+  LogColumn new_column(const std::string &name, const LogColumnKind kind,
+                       const size_t row_len) const
+  {
+    LogColumn column;
+    column.name = name;
+    column.kind = kind;
+    column.row_len = row_len;
+    column.type = LogValueTypeOf<T>::value;
+    column.value_size = sizeof(T);
+    column.initial = 0;
+    return column;
+  }
+  //! Add a dataset that's filled by an aggregator
+  void add_column(const LogColumn &column);
+  //! Compute the rows of all per-robot aggregators and reductions in one
+  //! pass over the robots
+  void evaluate_fused(std::vector<Robot *> &robots, const size_t slot) const;
+  //! Create the dataset for a column in the current trial group
+  void create_dataset(const LogColumn &column);
+  //! Resize every column's ring buffer to fit m_buffer_bytes (only when
+  //! there are no rows waiting to be written)
+  void allocate_buffers();
+  //! Wait until the writer has written every row logged so far
+  void drain() const;
+  //! Body of the writer thread
+  void write_rows();
   //! Version of log_param (for use by log_config) with warnings optional
   void log_param(const std::string name, const json val, const bool show_warnings);
 };
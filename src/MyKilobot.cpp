@@ -126,5 +126,30 @@ class MyKilobot : public Kilobot
     }
 
     void message_tx_success() {}
+
+    // Checkpointing (optional)
+    void save_state(CheckpointWriter &out) const
+    {
+        out.write(light_intensity);
+        out.write(transmit_msg);
+        out.write(new_message);
+        out.write(last_checked);
+        out.write(random_number);
+        out.write(dice);
+        out.write(curr_motion);
+        out.write(next_check_dur);
+    }
+
+    void load_state(CheckpointReader &in)
+    {
+        in.read(light_intensity);
+        in.read(transmit_msg);
+        in.read(new_message);
+        in.read(last_checked);
+        in.read(random_number);
+        in.read(dice);
+        in.read(curr_motion);
+        in.read(next_check_dur);
+    }
 };
 } // namespace Kilosim
\ No newline at end of file
@@ -2,6 +2,8 @@
 #include <iostream>
 #include <numeric>
 #include "Robot.h"
+#include "RobotStore.h"
+#include "Checkpoint.h"
 #include "random.hpp"
 
 namespace Kilosim
@@ -155,7 +157,71 @@ void Robot::add_to_world(LightPattern &light_pattern, const double dt)
 	m_tick_delta_t = dt;
 }
 
-double Robot::wrap_angle(double angle) const
+void Robot::write_to_store(RobotStore &store, const size_t i) const
+{
+	store.x[i] = x;
+	store.y[i] = y;
+	store.theta[i] = theta;
+	store.motor_command[i] = m_motor_command;
+	store.forward_speed[i] = m_forward_speed;
+	store.turn_speed[i] = m_turn_speed;
+	store.collision_timer[i] = m_collision_timer;
+	store.max_collision_timer[i] = m_max_collision_timer;
+	store.collision_turn_dir[i] = m_collision_turn_dir;
+}
+
+void Robot::read_from_store(const RobotStore &store, const size_t i)
+{
+	x = store.x[i];
+	y = store.y[i];
+	theta = store.theta[i];
+	m_collision_timer = store.collision_timer[i];
+	m_collision_turn_dir = store.collision_turn_dir[i];
+}
+
+void Robot::robot_save(CheckpointWriter &out) const
+{
+	out.write(m_collision_turn_dir);
+	out.write(m_collision_timer);
+	out.write(m_max_collision_timer);
+	out.write(m_motor_error);
+	out.write(m_motor_command);
+	out.write(m_forward_speed);
+	out.write(m_turn_speed);
+	out.write(battery);
+	out.write(tx_request);
+	out.write(id);
+	out.write(x);
+	out.write(y);
+	out.write(theta);
+	out.write(color, 3);
+	out.write(incoming_message_flag);
+	out.write(timer);
+	save(out);
+}
+
+void Robot::robot_load(CheckpointReader &in)
+{
+	in.read(m_collision_turn_dir);
+	in.read(m_collision_timer);
+	in.read(m_max_collision_timer);
+	in.read(m_motor_error);
+	in.read(m_motor_command);
+	in.read(m_forward_speed);
+	in.read(m_turn_speed);
+	in.read(battery);
+	in.read(tx_request);
+	in.read(id);
+	in.read(x);
+	in.read(y);
+	in.read(theta);
+	in.read(color, 3);
+	in.read(incoming_message_flag);
+	in.read(timer);
+	load(in);
+}
+
+double Robot::wrap_angle(double angle)
 {
 	// Guarantee that angle will be from 0 to 2*pi
 	// While loop is fastest option when angles are close to correct range
@@ -3,6 +3,7 @@
 
 #include <iostream>
 #include <cmath>
+#include <limits>
 #include <SFML/Graphics.hpp>
 #include "LightPattern.h"
 
@@ -21,6 +22,10 @@ constexpr uint8_t T = 2;
 
 namespace Kilosim
 {
+class RobotStore;
+class CheckpointWriter;
+class CheckpointReader;
+
 //! Simple representation of red/green/blue color
 struct rgb
 {
@@ -135,6 +140,14 @@ public:
 	 */
 	virtual void *get_message() = 0;
 
+	/*!
+	 * Get the size of the messages returned by `get_message()` (in bytes). The
+	 * World delivers a copy of each message, so the robot can change its own
+	 * message buffer while the message is being received.
+	 * @return Size of a message (in bytes)
+	 */
+	virtual size_t message_size() const = 0;
+
 public:
 	virtual ~Robot() = default;
 
@@ -205,6 +218,58 @@ public:
 	 */
 	void robot_move(const RobotPose &new_pose, const int16_t &collision);
 
+	/*!
+	 * Copy the Robot's physical state (pose, motor command, speeds, and
+	 * collision timers) into the World's store of all Robots' states.
+	 *
+	 * This is automatically called by the `World` after the Robot's controller
+	 * runs.
+	 *
+	 * @param store Physical state of all Robots in the World
+	 * @param i Index of this Robot in the store
+	 */
+	void write_to_store(RobotStore &store, const size_t i) const;
+
+	/*!
+	 * Update the Robot's pose and collision state from the World's store of
+	 * all Robots' states.
+	 *
+	 * This is automatically called by the `World` after moving the Robots.
+	 *
+	 * @param store Physical state of all Robots in the World
+	 * @param i Index of this Robot in the store
+	 */
+	void read_from_store(const RobotStore &store, const size_t i);
+
+	/*!
+	 * Save the Robot's state (everything that changes while simulating,
+	 * including the child implementation's state from `save()`) for a
+	 * checkpoint.
+	 *
+	 * This is automatically called by `World::save_state()`.
+	 *
+	 * @param out Checkpoint to write the state into
+	 */
+	void robot_save(CheckpointWriter &out) const;
+
+	/*!
+	 * Restore the Robot's state from a checkpoint written by `robot_save()`.
+	 * This is automatically called by `World::load_state()`.
+	 *
+	 * @param in Checkpoint to read the state from
+	 */
+	void robot_load(CheckpointReader &in);
+
+	/*!
+	 * Get the Robot's current motor command (for logging and recording)
+	 * @return 1=forward, 2=cw rotation, 3=ccw rotation, 4=stop (or 0 before
+	 * the first command)
+	 */
+	int get_motor_command() const
+	{
+		return m_motor_command;
+	}
+
 	virtual char *get_debug_info(char *buffer, char *rt) = 0;
 
 	/*!
@@ -213,10 +278,32 @@ public:
 	 * within range when sending a message OUT. Because of possible
 	 * asymmetries in communication range, both comm_criteria() must be met by
 	 * both the tx and rx robots for a message to be successfully transmitted.
+	 *
+	 * This is called on the receiver's thread for both robots, so a robot's
+	 * comm_criteria() may run on several threads at once. It must not modify
+	 * the robot (random numbers are fine, since each thread has its own).
 	 * @param dist Distance between the robots (in mm)
 	 * @return true if robot can communicate with another robot
 	 */
-	virtual bool comm_criteria(double dist) = 0;
+	virtual bool comm_criteria(double dist) const = 0;
+	//! comm_criteria() used to be non-const. This makes an old non-const
+	//! override a compile error, instead of an unrelated function that the
+	//! World never calls. (Add `const` to the override to fix it.)
+	virtual bool comm_criteria(double dist) = delete;
+
+	/*!
+	 * Get the largest distance at which comm_criteria() can return true. The
+	 * World uses this to only check nearby pairs of robots for communication.
+	 * If you override comm_criteria(), make sure this is still an upper bound.
+	 *
+	 * The default is unbounded, which makes the World check every pair of
+	 * robots.
+	 * @return Maximum communication range (in mm)
+	 */
+	virtual double comm_range() const
+	{
+		return std::numeric_limits<double>::max();
+	}
 
 	/*!
 	 * Compute the cartesian distance between two positions (x1, y1) and (x2, y2)
@@ -244,6 +331,9 @@ public:
 	 * This is called when a robot (rx) receives a message. It calls some
 	 * message handling function (e.g., message_rx) specific to the
 	 * implementation.
+	 *
+	 * The message is shared by every robot receiving it, so it must not be
+	 * modified.
 	 */
 	virtual void receive_msg(void *msg, double dist) = 0;
 
@@ -266,9 +356,23 @@ protected:
 	 */
 	virtual void controller() = 0;
 
-private:
+	/*!
+	 * Save the state of the specific Robot subclass implementation for a
+	 * checkpoint. It is called by `robot_save()`, after the Robot's own state
+	 * is written. (By default, it saves nothing.)
+	 * @param out Checkpoint to write the state into
+	 */
+	virtual void save(CheckpointWriter &out) const {}
+
+	/*!
+	 * Restore the state saved by `save()`. It is called by `robot_load()`.
+	 * @param in Checkpoint to read the state from
+	 */
+	virtual void load(CheckpointReader &in) {}
+
+public:
 	//! Wrap an angle to be within [0, 2*pi)
-	double wrap_angle(double angle) const;
+	static double wrap_angle(double angle);
 };
 } // namespace Kilosim
 #endif
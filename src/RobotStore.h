@@ -0,0 +1,137 @@
+/*
+    Kilosim
+
+    Contiguous storage of the physical state of all Robots in a World
+*/
+
+#ifndef __KILOSIM_ROBOTSTORE_H
+#define __KILOSIM_ROBOTSTORE_H
+
+#include "Robot.h"
+#include "AlignedAllocator.hpp"
+#include <cstdint>
+
+namespace Kilosim
+{
+/*!
+ * Poses of many robots, stored as one array per coordinate
+ */
+struct PoseArrays
+{
+  //! x-positions
+  aligned_vector<double> x;
+  //! y-positions
+  aligned_vector<double> y;
+  //! Rotations, where 0 points along x-axis and positive is CCW
+  aligned_vector<double> theta;
+
+  //! Change the number of poses stored
+  void resize(const size_t n)
+  {
+    x.resize(n);
+    y.resize(n);
+    theta.resize(n);
+  }
+};
+
+/*!
+ * The physical state of all Robots in a World, stored as a structure of arrays
+ * (one array per variable, indexed by Robot).
+ *
+ * The World copies each Robot's state into the store after its controller
+ * runs, does all of the pseudo-physics on these arrays, and then copies the
+ * results back into the Robots. This keeps the physics loops running over
+ * contiguous memory instead of following a pointer to every Robot.
+ *
+ * The computations on these arrays (here and in `compute_next_steps()`) mirror
+ * `Robot::robot_compute_next_step()` and `Robot::robot_move()`.
+ */
+class RobotStore
+{
+public:
+  //! Robot x-positions
+  aligned_vector<double> x;
+  //! Robot y-positions
+  aligned_vector<double> y;
+  //! Robot rotations
+  aligned_vector<double> theta;
+  //! Commanded motion: 1=forward, 2=cw rotation, 3=ccw rotation, 4=stop
+  aligned_vector<int> motor_command;
+  //! Forward speeds in mm/s
+  aligned_vector<double> forward_speed;
+  //! Turning speeds in rad/s
+  aligned_vector<double> turn_speed;
+  //! How long each robot has been turning one way while colliding
+  aligned_vector<uint32_t> collision_timer;
+  //! How long each robot turns one way when colliding before switching
+  aligned_vector<uint32_t> max_collision_timer;
+  //! Which direction each robot turns when colliding (0 or 1)
+  aligned_vector<uint8_t> collision_turn_dir;
+
+  //! Number of robots stored
+  size_t size() const
+  {
+    return x.size();
+  }
+
+  //! Change the number of robots stored
+  void resize(const size_t n)
+  {
+    x.resize(n);
+    y.resize(n);
+    theta.resize(n);
+    motor_command.resize(n);
+    forward_speed.resize(n);
+    turn_speed.resize(n);
+    collision_timer.resize(n);
+    max_collision_timer.resize(n);
+    collision_turn_dir.resize(n);
+  }
+
+  /*!
+   * Move a robot according to its collision-ignorant new pose and collisions
+   * @param i Index of the robot
+   * @param dt Seconds per tick
+   * @param new_poses Next poses from compute_next_step()
+   * @param collision Whether there's a collision with a wall (-1), another
+   * Robot (1), or no collision (0)
+   */
+  void move(const size_t i, const double dt, const PoseArrays &new_poses,
+            const int16_t collision)
+  {
+    double new_theta = new_poses.theta[i];
+    switch (collision)
+    {
+    case 0:
+    { // No collisions
+      x[i] = new_poses.x[i];
+      y[i] = new_poses.y[i];
+      collision_timer[i] = 0;
+      break;
+    }
+    case 1:
+    { // Collision with another robot
+      if (collision_turn_dir[i] == 0)
+      {
+        new_theta = theta[i] - turn_speed[i] * dt; // left/CCW
+      }
+      else
+      {
+        new_theta = theta[i] + turn_speed[i] * dt; // right/CW
+      }
+      if (collision_timer[i] > max_collision_timer[i])
+      { // Change turn dir
+        collision_turn_dir[i] = (collision_turn_dir[i] + 1) % 2;
+        collision_timer[i] = 0;
+      }
+      collision_timer[i]++;
+      break;
+    }
+    }
+    // If a bot is touching the wall, update angle but not position
+    theta[i] = Robot::wrap_angle(new_theta);
+  }
+};
+} // namespace Kilosim
+
+#endif
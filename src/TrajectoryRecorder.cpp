@@ -0,0 +1,529 @@
+/*
+    Kilosim
+
+    Compact recording and playback of every robot's trajectory
+*/
+
+#include "TrajectoryRecorder.h"
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <stdexcept>
+
+namespace Kilosim
+{
+
+namespace
+{
+//! Identifies the start of a trajectory file
+const char TRAJECTORY_MAGIC[8] = {'K', 'I', 'L', 'O', 'T', 'R', 'J', '1'};
+//! Identifies the end of a completed trajectory file
+const char TRAJECTORY_END_MAGIC[8] = {'K', 'I', 'L', 'O', 'T', 'R', 'J', 'E'};
+
+//! Position units per mm
+const double POSITION_SCALE = 100;
+//! Rotation units per full turn
+const double THETA_STEPS = 65536;
+//! Color units per full intensity
+const double COLOR_SCALE = 255;
+
+//! Columns of quantities stored for every robot in every frame
+enum TrajectoryColumn
+{
+    COLUMN_X,
+    COLUMN_Y,
+    COLUMN_THETA,
+    COLUMN_RED,
+    COLUMN_GREEN,
+    COLUMN_BLUE,
+    COLUMN_MOTOR,
+    NUM_COLUMNS
+};
+
+//! Fixed-size start of a trajectory file
+struct TrajectoryHeader
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t tick_rate;
+    double width;
+    double height;
+    uint32_t keyframe_interval;
+    uint8_t reserved[28];
+};
+static_assert(sizeof(TrajectoryHeader) == 64, "Trajectory header must be 64 bytes");
+
+//! Entry in the block index at the end of a completed file
+struct IndexEntry
+{
+    uint64_t offset;
+    uint32_t first_tick;
+    uint32_t last_tick;
+    uint32_t num_frames;
+    uint32_t reserved;
+};
+
+//! Fixed-size end of a completed file, pointing to the block index
+struct TrajectoryTrailer
+{
+    uint64_t index_offset;
+    uint32_t num_blocks;
+    uint32_t reserved;
+    char magic[8];
+};
+
+//! Map signed integers to unsigned so small magnitudes have short varints
+uint64_t zigzag(const int64_t v)
+{
+    return ((uint64_t)v << 1) ^ (uint64_t)(v >> 63);
+}
+
+int64_t unzigzag(const uint64_t v)
+{
+    return (int64_t)(v >> 1) ^ -(int64_t)(v & 1);
+}
+
+//! Append an unsigned integer, 7 bits per byte (LEB128)
+void put_varint(std::vector<uint8_t> &out, uint64_t v)
+{
+    while (v >= 0x80)
+    {
+        out.push_back((uint8_t)(v | 0x80));
+        v >>= 7;
+    }
+    out.push_back((uint8_t)v);
+}
+
+//! Read an unsigned integer written by put_varint(), advancing p
+uint64_t get_varint(const uint8_t *&p, const uint8_t *end)
+{
+    uint64_t v = 0;
+    for (int shift = 0; shift < 64; shift += 7)
+    {
+        if (p == end)
+        {
+            throw std::runtime_error("Truncated trajectory data");
+        }
+        const uint8_t byte = *p++;
+        v |= (uint64_t)(byte & 0x7f) << shift;
+        if (!(byte & 0x80))
+        {
+            return v;
+        }
+    }
+    throw std::runtime_error("Invalid trajectory data");
+}
+
+//! Quantize a robot's values for every column
+void quantize(const Robot &robot, int64_t *q)
+{
+    q[COLUMN_X] = std::llround(robot.x * POSITION_SCALE);
+    q[COLUMN_Y] = std::llround(robot.y * POSITION_SCALE);
+    const double turns = Robot::wrap_angle(robot.theta) / (2 * PI);
+    q[COLUMN_THETA] = std::llround(turns * THETA_STEPS) & 0xffff;
+    for (int c = 0; c < 3; c++)
+    {
+        const double intensity = std::min(std::max(robot.color[c], 0.0), 1.0);
+        q[COLUMN_RED + c] = std::llround(intensity * COLOR_SCALE);
+    }
+    q[COLUMN_MOTOR] = robot.get_motor_command();
+}
+} // namespace
+
+TrajectoryRecorder::TrajectoryRecorder(World &world, const std::string filename,
+                                       const uint32_t keyframe_interval)
+    : m_world(world),
+      m_filename(filename),
+      m_keyframe_interval(std::max(keyframe_interval, (uint32_t)1))
+{
+    m_file.open(filename, std::ios::binary | std::ios::trunc);
+    const std::vector<double> dims = world.get_dimensions();
+    TrajectoryHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, TRAJECTORY_MAGIC, sizeof(TRAJECTORY_MAGIC));
+    header.version = 1;
+    header.tick_rate = world.get_tick_rate();
+    header.width = dims[0];
+    header.height = dims[1];
+    header.keyframe_interval = m_keyframe_interval;
+    m_file.write(reinterpret_cast<const char *>(&header), sizeof(header));
+    if (!m_file)
+    {
+        throw std::runtime_error("Could not create trajectory file " + filename);
+    }
+}
+
+TrajectoryRecorder::~TrajectoryRecorder()
+{
+    close();
+}
+
+void TrajectoryRecorder::record()
+{
+    if (m_closed)
+    {
+        fprintf(stderr, "WARNING: Cannot record after the TrajectoryRecorder is closed\n");
+        return;
+    }
+    const uint32_t tick = m_world.get_tick();
+    if ((int64_t)tick <= m_last_tick)
+    {
+        return;
+    }
+    m_last_tick = tick;
+    const std::vector<Robot *> &robots = m_world.get_robots();
+
+    // Start a new block when this one is full or the robots have changed
+    bool same_robots = (robots.size() == m_block_ids.size());
+    for (size_t i = 0; same_robots && i < robots.size(); i++)
+    {
+        same_robots = (robots[i]->id == m_block_ids[i]);
+    }
+    if (!m_block_ticks.empty() &&
+        (!same_robots || m_block_ticks.size() >= m_keyframe_interval))
+    {
+        write_block();
+    }
+    if (m_block_ticks.empty())
+    {
+        // The first frame of a block is stored as differences from 0
+        m_block_ids.resize(robots.size());
+        for (size_t i = 0; i < robots.size(); i++)
+        {
+            m_block_ids[i] = robots[i]->id;
+        }
+        for (int c = 0; c < NUM_COLUMNS; c++)
+        {
+            m_previous[c].assign(robots.size(), 0);
+        }
+    }
+    m_block_ticks.push_back(tick);
+
+    int64_t q[NUM_COLUMNS];
+    for (size_t i = 0; i < robots.size(); i++)
+    {
+        quantize(*robots[i], q);
+        for (int c = 0; c < NUM_COLUMNS; c++)
+        {
+            int64_t delta = q[c] - m_previous[c][i];
+            if (c == COLUMN_THETA)
+            {
+                // Rotations wrap around, so take the shorter way
+                delta = (int16_t)(uint16_t)delta;
+            }
+            put_varint(m_columns[c], zigzag(delta));
+            m_previous[c][i] = q[c];
+        }
+    }
+}
+
+void TrajectoryRecorder::write_block()
+{
+    if (m_block_ticks.empty())
+    {
+        return;
+    }
+    std::vector<uint8_t> head;
+    put_varint(head, m_block_ticks.size());
+    put_varint(head, m_block_ids.size());
+    put_varint(head, m_block_ticks[0]);
+    for (size_t f = 1; f < m_block_ticks.size(); f++)
+    {
+        put_varint(head, m_block_ticks[f] - m_block_ticks[f - 1]);
+    }
+    int64_t previous_id = 0;
+    for (const uint16_t id : m_block_ids)
+    {
+        put_varint(head, zigzag((int64_t)id - previous_id));
+        previous_id = id;
+    }
+    for (int c = 0; c < NUM_COLUMNS; c++)
+    {
+        put_varint(head, m_columns[c].size());
+    }
+    size_t payload_size = head.size();
+    for (int c = 0; c < NUM_COLUMNS; c++)
+    {
+        payload_size += m_columns[c].size();
+    }
+
+    BlockIndex block;
+    block.offset = m_file.tellp();
+    block.first_tick = m_block_ticks.front();
+    block.last_tick = m_block_ticks.back();
+    block.num_frames = m_block_ticks.size();
+
+    const uint32_t size = payload_size;
+    m_file.write(reinterpret_cast<const char *>(&size), sizeof(size));
+    m_file.write(reinterpret_cast<const char *>(head.data()), head.size());
+    for (int c = 0; c < NUM_COLUMNS; c++)
+    {
+        m_file.write(reinterpret_cast<const char *>(m_columns[c].data()),
+                     m_columns[c].size());
+        m_columns[c].clear();
+    }
+    if (!m_file)
+    {
+        fprintf(stderr, "WARNING: Failed to write to trajectory file %s\n",
+                m_filename.c_str());
+    }
+    m_index.push_back(block);
+    m_block_ticks.clear();
+}
+
+void TrajectoryRecorder::close()
+{
+    if (m_closed)
+    {
+        return;
+    }
+    write_block();
+
+    TrajectoryTrailer trailer;
+    memset(&trailer, 0, sizeof(trailer));
+    trailer.index_offset = m_file.tellp();
+    trailer.num_blocks = m_index.size();
+    memcpy(trailer.magic, TRAJECTORY_END_MAGIC, sizeof(TRAJECTORY_END_MAGIC));
+    for (const BlockIndex &block : m_index)
+    {
+        IndexEntry entry = {block.offset, block.first_tick, block.last_tick,
+                            block.num_frames, 0};
+        m_file.write(reinterpret_cast<const char *>(&entry), sizeof(entry));
+    }
+    m_file.write(reinterpret_cast<const char *>(&trailer), sizeof(trailer));
+    m_file.close();
+    if (!m_file)
+    {
+        fprintf(stderr, "WARNING: Failed to complete trajectory file %s\n",
+                m_filename.c_str());
+    }
+    m_closed = true;
+}
+
+TrajectoryReader::TrajectoryReader(const std::string filename)
+    : m_filename(filename)
+{
+    m_file.open(filename, std::ios::binary);
+    TrajectoryHeader header;
+    m_file.read(reinterpret_cast<char *>(&header), sizeof(header));
+    if (!m_file || memcmp(header.magic, TRAJECTORY_MAGIC, sizeof(TRAJECTORY_MAGIC)) != 0)
+    {
+        throw std::runtime_error("Invalid trajectory file " + filename);
+    }
+    m_tick_rate = header.tick_rate;
+    m_width = header.width;
+    m_height = header.height;
+
+    m_file.seekg(0, std::ios::end);
+    const uint64_t file_size = m_file.tellg();
+
+    // Use the block index if the file was completed
+    TrajectoryTrailer trailer;
+    bool completed = false;
+    if (file_size >= sizeof(header) + sizeof(trailer))
+    {
+        m_file.seekg(file_size - sizeof(trailer));
+        m_file.read(reinterpret_cast<char *>(&trailer), sizeof(trailer));
+        completed = m_file &&
+                    memcmp(trailer.magic, TRAJECTORY_END_MAGIC, sizeof(TRAJECTORY_END_MAGIC)) == 0 &&
+                    trailer.index_offset + trailer.num_blocks * sizeof(IndexEntry) + sizeof(trailer) == file_size;
+    }
+    if (completed)
+    {
+        m_file.seekg(trailer.index_offset);
+        for (uint32_t b = 0; b < trailer.num_blocks; b++)
+        {
+            IndexEntry entry;
+            m_file.read(reinterpret_cast<char *>(&entry), sizeof(entry));
+            m_index.push_back({entry.offset, entry.first_tick, entry.last_tick,
+                               entry.num_frames});
+        }
+        if (!m_file)
+        {
+            throw std::runtime_error("Invalid trajectory file " + filename);
+        }
+    }
+    else
+    {
+        m_file.clear();
+        scan_blocks(file_size);
+    }
+    for (const BlockIndex &block : m_index)
+    {
+        m_num_frames += block.num_frames;
+    }
+}
+
+void TrajectoryReader::scan_blocks(const uint64_t file_size)
+{
+    uint64_t offset = sizeof(TrajectoryHeader);
+    std::vector<uint8_t> payload;
+    while (offset + sizeof(uint32_t) <= file_size)
+    {
+        uint32_t size;
+        m_file.seekg(offset);
+        m_file.read(reinterpret_cast<char *>(&size), sizeof(size));
+        if (!m_file || offset + sizeof(size) + size > file_size)
+        {
+            // The last block wasn't completely written
+            break;
+        }
+        payload.resize(size);
+        m_file.read(reinterpret_cast<char *>(payload.data()), size);
+
+        const uint8_t *p = payload.data();
+        const uint8_t *end = p + size;
+        BlockIndex block;
+        block.offset = offset;
+        block.num_frames = get_varint(p, end);
+        get_varint(p, end); // Number of robots
+        block.first_tick = get_varint(p, end);
+        block.last_tick = block.first_tick;
+        for (uint32_t f = 1; f < block.num_frames; f++)
+        {
+            block.last_tick += get_varint(p, end);
+        }
+        m_index.push_back(block);
+        offset += sizeof(size) + size;
+    }
+    m_file.clear();
+}
+
+void TrajectoryReader::decode_block(const size_t b)
+{
+    uint32_t size;
+    m_file.seekg(m_index[b].offset);
+    m_file.read(reinterpret_cast<char *>(&size), sizeof(size));
+    std::vector<uint8_t> payload(size);
+    m_file.read(reinterpret_cast<char *>(payload.data()), size);
+    if (!m_file)
+    {
+        m_file.clear();
+        throw std::runtime_error("Could not read trajectory file " + m_filename);
+    }
+
+    const uint8_t *p = payload.data();
+    const uint8_t *end = p + size;
+    const size_t num_frames = get_varint(p, end);
+    const size_t n = get_varint(p, end);
+
+    m_frames.resize(num_frames);
+    uint32_t tick = 0;
+    for (size_t f = 0; f < num_frames; f++)
+    {
+        tick = (f == 0) ? get_varint(p, end) : tick + get_varint(p, end);
+        TrajectoryFrame &frame = m_frames[f];
+        frame.tick = tick;
+        frame.ids.resize(n);
+        frame.x.resize(n);
+        frame.y.resize(n);
+        frame.theta.resize(n);
+        frame.color.resize(3 * n);
+        frame.motor_command.resize(n);
+    }
+    int64_t id = 0;
+    for (size_t i = 0; i < n; i++)
+    {
+        id += unzigzag(get_varint(p, end));
+        m_frames[0].ids[i] = id;
+    }
+    for (size_t f = 1; f < num_frames; f++)
+    {
+        m_frames[f].ids = m_frames[0].ids;
+    }
+
+    size_t column_sizes[NUM_COLUMNS];
+    for (int c = 0; c < NUM_COLUMNS; c++)
+    {
+        column_sizes[c] = get_varint(p, end);
+    }
+    std::vector<int64_t> values(n);
+    for (int c = 0; c < NUM_COLUMNS; c++)
+    {
+        if (column_sizes[c] > (size_t)(end - p))
+        {
+            throw std::runtime_error("Invalid trajectory file " + m_filename);
+        }
+        const uint8_t *column_end = p + column_sizes[c];
+        std::fill(values.begin(), values.end(), 0);
+        for (size_t f = 0; f < num_frames; f++)
+        {
+            TrajectoryFrame &frame = m_frames[f];
+            for (size_t i = 0; i < n; i++)
+            {
+                values[i] += unzigzag(get_varint(p, column_end));
+                switch (c)
+                {
+                case COLUMN_X:
+                    frame.x[i] = values[i] / POSITION_SCALE;
+                    break;
+                case COLUMN_Y:
+                    frame.y[i] = values[i] / POSITION_SCALE;
+                    break;
+                case COLUMN_THETA:
+                    values[i] &= 0xffff;
+                    frame.theta[i] = values[i] * (2 * PI / THETA_STEPS);
+                    break;
+                case COLUMN_MOTOR:
+                    frame.motor_command[i] = values[i];
+                    break;
+                default:
+                    frame.color[3 * i + c - COLUMN_RED] = values[i] / COLOR_SCALE;
+                }
+            }
+        }
+        p = column_end;
+    }
+    m_block = b;
+}
+
+size_t TrajectoryReader::num_frames() const
+{
+    return m_num_frames;
+}
+
+uint32_t TrajectoryReader::first_tick() const
+{
+    return m_index.empty() ? 0 : m_index.front().first_tick;
+}
+
+uint32_t TrajectoryReader::last_tick() const
+{
+    return m_index.empty() ? 0 : m_index.back().last_tick;
+}
+
+uint16_t TrajectoryReader::get_tick_rate() const
+{
+    return m_tick_rate;
+}
+
+std::vector<double> TrajectoryReader::get_dimensions() const
+{
+    return {m_width, m_height};
+}
+
+bool TrajectoryReader::read_frame(const uint32_t tick, TrajectoryFrame &frame)
+{
+    if (m_index.empty() || tick < m_index.front().first_tick)
+    {
+        return false;
+    }
+    // Last block starting at or before the tick
+    const auto block = std::upper_bound(
+                           m_index.begin(), m_index.end(), tick,
+                           [](const uint32_t t, const BlockIndex &b) { return t < b.first_tick; }) -
+                       1;
+    const long b = block - m_index.begin();
+    if (b != m_block)
+    {
+        decode_block(b);
+    }
+    // Last frame in the block at or before the tick
+    const auto found = std::upper_bound(
+                           m_frames.begin(), m_frames.end(), tick,
+                           [](const uint32_t t, const TrajectoryFrame &f) { return t < f.tick; }) -
+                       1;
+    frame = *found;
+    return true;
+}
+} // namespace Kilosim
@@ -0,0 +1,228 @@
+/*
+  Kilosim
+
+  Compact recording and playback of every robot's trajectory
+*/
+
+#ifndef __KILOSIM_TRAJECTORYRECORDER_H
+#define __KILOSIM_TRAJECTORYRECORDER_H
+
+#include <string>
+#include <vector>
+#include <fstream>
+#include <cstdint>
+#include "World.h"
+
+namespace Kilosim
+{
+/*!
+ * The state of every robot at one recorded tick, as read by a
+ * `TrajectoryReader`. Values are indexed in the same order as the World's
+ * robots were when the frame was recorded.
+ */
+struct TrajectoryFrame
+{
+  //! Tick of the World when the frame was recorded
+  uint32_t tick = 0;
+  //! Robot ids (`Robot::id`)
+  std::vector<uint16_t> ids;
+  //! x-positions (mm)
+  std::vector<double> x;
+  //! y-positions (mm)
+  std::vector<double> y;
+  //! Rotations in [0, 2*PI), where 0 points along x-axis and positive is CCW
+  std::vector<double> theta;
+  //! LED colors (red, green, and blue for each robot, values 0-1)
+  std::vector<double> color;
+  //! Motor commands: 1=forward, 2=cw rotation, 3=ccw rotation, 4=stop (or 0
+  //! before the first command)
+  std::vector<int> motor_command;
+
+  //! Number of robots in the frame
+  size_t size() const
+  {
+    return ids.size();
+  }
+};
+
+/*!
+ * A TrajectoryRecorder saves the pose, LED color, and motor command of every
+ * robot in a World to a compact binary file, to replay or analyze later with a
+ * `TrajectoryReader`. It's much smaller and faster than logging poses through
+ * a `Logger` aggregator, so recording every tick of a large swarm is
+ * affordable.
+ *
+ * Call `record()` whenever you want to save a frame (usually right after
+ * `World::step()`). Values are quantized: positions to 0.01 mm, rotations to
+ * 1/65536 of a turn, and colors to 8 bits. Frames are grouped into blocks of
+ * `keyframe_interval` frames. The first frame of a block is saved as is and
+ * later frames as differences from the previous frame, in variable-length
+ * integers. Each quantity is stored in its own column within a block, and an
+ * index of the blocks at the end of the file lets a reader jump to any tick.
+ *
+ * A new block is also started when robots are added or removed.
+ *
+ * The file is completed when the recorder is closed (or destroyed). If the
+ * program stops before then, a `TrajectoryReader` can still read all of the
+ * blocks that were written.
+ */
+class TrajectoryRecorder
+{
+private:
+  //! Location of a block in the file
+  struct BlockIndex
+  {
+    uint64_t offset;
+    uint32_t first_tick;
+    uint32_t last_tick;
+    uint32_t num_frames;
+  };
+
+  //! World that's recorded
+  World &m_world;
+  //! Filename of the recording
+  std::string m_filename;
+  //! Output file
+  std::ofstream m_file;
+  //! Maximum number of frames in each block
+  uint32_t m_keyframe_interval;
+  //! Ticks of the frames in the current block
+  std::vector<uint32_t> m_block_ticks;
+  //! Ids of the robots in the current block
+  std::vector<uint16_t> m_block_ids;
+  //! Encoded values of each quantity in the current block
+  std::vector<uint8_t> m_columns[7];
+  //! Last quantized value of each quantity for each robot
+  std::vector<int64_t> m_previous[7];
+  //! Blocks written so far
+  std::vector<BlockIndex> m_index;
+  //! Tick of the last recorded frame (or -1 if none)
+  int64_t m_last_tick = -1;
+  //! Whether the file has been completed
+  bool m_closed = false;
+
+  //! Write the current block to the file and start a new one
+  void write_block();
+
+public:
+  /*!
+   * Create a recording of a World in a new file (replacing any existing file)
+   * @param world World to record
+   * @param filename Name and location of the file to create
+   * @param keyframe_interval Number of frames in each block. Smaller blocks
+   * make reading a single frame faster but the file larger. (Default: 32, or
+   * one second of ticks at the default tick rate)
+   * @throws std::runtime_error if the file can't be created
+   */
+  TrajectoryRecorder(World &world, const std::string filename,
+                     const uint32_t keyframe_interval = 32);
+  //! Destructor: completes the file
+  ~TrajectoryRecorder();
+
+  /*!
+   * Save the current state of every robot in the World. Ticks must increase
+   * between calls; calling this again in the same tick does nothing.
+   */
+  void record();
+
+  /*!
+   * Write any buffered frames and the block index, and close the file. Nothing
+   * can be recorded afterwards. This is done automatically when the recorder
+   * is destroyed.
+   */
+  void close();
+};
+
+/*!
+ * Reads a file written by a `TrajectoryRecorder`. Any recorded tick can be
+ * read directly; only the block containing it is read from the file and
+ * decoded.
+ */
+class TrajectoryReader
+{
+private:
+  //! Location of a block in the file
+  struct BlockIndex
+  {
+    uint64_t offset;
+    uint32_t first_tick;
+    uint32_t last_tick;
+    uint32_t num_frames;
+  };
+
+  //! Recording file
+  std::ifstream m_file;
+  //! Filename of the recording
+  std::string m_filename;
+  //! World's tick rate when recorded
+  uint16_t m_tick_rate;
+  //! World's width and height (mm)
+  double m_width;
+  double m_height;
+  //! Blocks in the file
+  std::vector<BlockIndex> m_index;
+  //! Total number of frames
+  size_t m_num_frames = 0;
+  //! Frames of the most recently decoded block
+  std::vector<TrajectoryFrame> m_frames;
+  //! Which block m_frames holds (or -1 if none)
+  long m_block = -1;
+
+  //! Find the blocks by reading through the file (if it wasn't completed)
+  void scan_blocks(const uint64_t file_size);
+  //! Read and decode a block into m_frames
+  void decode_block(const size_t block);
+
+public:
+  /*!
+   * Open a recording
+   * @param filename Name and location of the file written by a
+   * `TrajectoryRecorder`
+   * @throws std::runtime_error if the file can't be read or isn't a recording
+   */
+  TrajectoryReader(const std::string filename);
+
+  /*!
+   * Get the number of frames in the recording
+   * @return Number of times `TrajectoryRecorder::record()` saved a frame
+   */
+  size_t num_frames() const;
+
+  /*!
+   * Get the first recorded tick
+   * @return Tick of the first frame (0 if there are no frames)
+   */
+  uint32_t first_tick() const;
+
+  /*!
+   * Get the last recorded tick
+   * @return Tick of the last frame (0 if there are no frames)
+   */
+  uint32_t last_tick() const;
+
+  /*!
+   * Get the tick rate of the World that was recorded
+   * @return Number of ticks per second
+   */
+  uint16_t get_tick_rate() const;
+
+  /*!
+   * Get the size of the World that was recorded
+   * @return 2-element vector of width and height (mm)
+   */
+  std::vector<double> get_dimensions() const;
+
+  /*!
+   * Get the state of the robots at a tick. Frames don't have to be read in
+   * order, but reading frames in order (or close together) is fastest.
+   * @param tick Tick to read. If there's no frame at exactly this tick, the
+   * last frame before it is read.
+   * @param frame Frame to read into
+   * @return Whether there was a frame to read (false if `tick` is before the
+   * first frame)
+   */
+  bool read_frame(const uint32_t tick, TrajectoryFrame &frame);
+};
+} // namespace Kilosim
+
+#endif
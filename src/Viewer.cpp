@@ -11,22 +11,52 @@
 
 namespace Kilosim
 {
-Viewer::Viewer(World &world, const int window_width)
-    : m_world(world), m_window_width(window_width)
+Viewer::Viewer(World &world, const int window_width, const bool render_thread)
+    : m_world(world), m_window_width(window_width),
+      m_robot_vertices(sf::Quads), m_middle(1),
+      m_use_render_thread(render_thread), m_stop_rendering(false)
 {
     std::vector<double> world_dim = world.get_dimensions();
     m_scale = m_window_width / world_dim[0];
     m_window_height = world_dim[1] * m_scale;
 
+    if (m_use_render_thread)
+    {
+        // Load the light pattern image here, since loading it isn't
+        // thread-safe. The render thread only reads it.
+        if (world.has_light_pattern())
+        {
+            world.get_light_pattern();
+        }
+        // The window is created and used only by the render thread
+        m_render_thread = std::thread(&Viewer::render_loop, this);
+    }
+    else
+    {
+        open_window();
+    }
+}
+
+Viewer::~Viewer()
+{
+    if (m_render_thread.joinable())
+    {
+        m_stop_rendering = true;
+        m_render_thread.join();
+    }
+}
+
+void Viewer::open_window()
+{
     // m_settings.antialiasingLevel = 32;
     m_window.create(sf::VideoMode(m_window_width, m_window_height),
                     "Kilosim", sf::Style::Default, m_settings);
     m_window.setFramerateLimit(144);
 
     m_background.setSize(sf::Vector2f(m_window_width, m_window_height));
-    if (world.has_light_pattern())
+    if (m_world.has_light_pattern())
     {
-        m_bg_texture.loadFromImage(world.get_light_pattern());
+        m_bg_texture.loadFromImage(m_world.get_light_pattern());
     }
     else
     {
@@ -49,7 +79,85 @@ Viewer::Viewer(World &world, const int window_width)
 
 void Viewer::draw()
 {
-    if (m_window.isOpen())
+    if (!m_use_render_thread)
+    {
+        if (m_window.isOpen())
+        {
+            sf::Event event;
+            while (m_window.pollEvent(event))
+            {
+                if (event.type == sf::Event::Closed)
+                {
+                    m_window.close();
+                }
+            }
+        }
+        take_snapshot(m_snapshots[0]);
+        render(m_snapshots[0]);
+    }
+    // Only publish a new snapshot once the render thread has taken the last
+    // one, so a fast simulation doesn't copy every tick for nothing
+    else if (!(m_middle.load(std::memory_order_acquire) & SNAPSHOT_FRESH))
+    {
+        take_snapshot(m_snapshots[m_back]);
+        const uint8_t old_middle = m_middle.exchange(m_back | SNAPSHOT_FRESH,
+                                                     std::memory_order_acq_rel);
+        m_back = old_middle & ~SNAPSHOT_FRESH;
+    }
+    pace();
+}
+
+void Viewer::set_realtime(const bool realtime)
+{
+    m_realtime = realtime;
+    // Restart pacing at the next draw(), so time spent before now isn't
+    // made up for
+    m_realtime_start = std::chrono::steady_clock::time_point();
+}
+
+void Viewer::pace()
+{
+    if (!m_realtime)
+    {
+        return;
+    }
+    if (m_realtime_start == std::chrono::steady_clock::time_point())
+    {
+        m_realtime_start = std::chrono::steady_clock::now();
+        m_realtime_start_tick = m_world.get_tick();
+        return;
+    }
+    const std::chrono::duration<double> world_time(
+        (double)(m_world.get_tick() - m_realtime_start_tick) / m_world.get_tick_rate());
+    std::this_thread::sleep_until(
+        m_realtime_start +
+        std::chrono::duration_cast<std::chrono::steady_clock::duration>(world_time));
+}
+
+void Viewer::take_snapshot(WorldSnapshot &snapshot)
+{
+    std::vector<Robot *> &robots = m_world.get_robots();
+    snapshot.time = m_world.get_time();
+    snapshot.robots.resize(robots.size());
+#pragma omp parallel for schedule(static)
+    for (size_t i = 0; i < robots.size(); i++)
+    {
+        const Robot *r = robots[i];
+        RobotView &view = snapshot.robots[i];
+        view.x = r->x;
+        view.y = r->y;
+        view.theta = r->theta;
+        for (int c = 0; c < 3; c++)
+        {
+            view.color[c] = r->color[c] * 255;
+        }
+    }
+}
+
+void Viewer::render_loop()
+{
+    open_window();
+    while (!m_stop_rendering && m_window.isOpen())
     {
         sf::Event event;
         while (m_window.pollEvent(event))
@@ -59,46 +167,78 @@ void Viewer::draw()
                 m_window.close();
             }
         }
+        // Take the newest snapshot, if there's one that hasn't been drawn
+        if (m_middle.load(std::memory_order_acquire) & SNAPSHOT_FRESH)
+        {
+            m_front = m_middle.exchange(m_front, std::memory_order_acq_rel) &
+                      ~SNAPSHOT_FRESH;
+        }
+        // Waits for the frame rate limit here, without holding up the
+        // simulation
+        render(m_snapshots[m_front]);
     }
+    // The window's OpenGL context belongs to this thread, so close it here
+    m_robot_texture.setActive(false);
+    m_window.close();
+}
 
+void Viewer::render(const WorldSnapshot &snapshot)
+{
     m_window.clear();
 
     // Draw world's lightPattern
     m_window.draw(m_background);
-    draw_time();
+    draw_time(snapshot.time);
 
-    // TODO: Implement this
-    for (auto &r : m_world.get_robots())
-    {
-        draw_robot(r);
-        // r->draw();
-    }
+    // All of the robots share one texture, so they're drawn in a single call
+    update_robot_vertices(snapshot);
+    m_window.draw(m_robot_vertices, &m_robot_texture.getTexture());
 
     m_window.display();
 }
 
-void Viewer::draw_robot(Robot *r)
+void Viewer::update_robot_vertices(const WorldSnapshot &snapshot)
 {
-    // TODO : Implement this
-    // Maybe move this to Robot.h (each robot responsible for determining its
-    // own representation)
-
-    sf::Sprite sprite;
-    sprite.setOrigin(RADIUS * m_scale, RADIUS * m_scale);
-    sprite.setTexture(m_robot_texture.getTexture());
-    sprite.setColor(sf::Color(r->color[0] * 255,
-                              r->color[1] * 255,
-                              r->color[2] * 255));
-    sprite.setPosition(sf::Vector2f(r->x * m_scale,
-                                    m_window_height - (r->y * m_scale)));
-    sprite.setRotation(r->theta * -180 / PI);
-
-    m_window.draw(sprite);
+    const size_t n = snapshot.robots.size();
+    const float half = RADIUS * m_scale;
+    // Corners of a robot's quad, relative to its center (before rotating)
+    const float corners[4][2] = {{-half, -half}, {half, -half}, {half, half}, {-half, half}};
+
+    if (m_robot_vertices.getVertexCount() != n * 4)
+    {
+        // The texture coordinates never change, so they're only set here
+        m_robot_vertices.resize(n * 4);
+        for (size_t i = 0; i < n * 4; i++)
+        {
+            m_robot_vertices[i].texCoords = sf::Vector2f(corners[i % 4][0] + half,
+                                                         corners[i % 4][1] + half);
+        }
+    }
+
+#pragma omp parallel for schedule(static)
+    for (size_t i = 0; i < n; i++)
+    {
+        const RobotView &r = snapshot.robots[i];
+        const sf::Color color(r.color[0], r.color[1], r.color[2]);
+        const float x = r.x * m_scale;
+        const float y = m_window_height - (r.y * m_scale);
+        // The window's y-axis points down, so rotate by -theta (the same as
+        // sprite.setRotation(theta * -180 / PI))
+        const float c = cos(r.theta);
+        const float s = sin(r.theta);
+        sf::Vertex *quad = &m_robot_vertices[i * 4];
+        for (int k = 0; k < 4; k++)
+        {
+            quad[k].position = sf::Vector2f(x + c * corners[k][0] + s * corners[k][1],
+                                            y - s * corners[k][0] + c * corners[k][1]);
+            quad[k].color = color;
+        }
+    }
 }
 
-void Viewer::draw_time()
+void Viewer::draw_time(const double time)
 {
-    int t = m_world.get_time();
+    int t = time;
     int hour = t / 3600;
     t = t % 3600;
     int minute = t / 60;
@@ -110,4 +250,4 @@ void Viewer::draw_time()
     std::string timeStr = buff;
     m_window.setTitle(timeStr);
 }
-} // namespace Kilosim
\ No newline at end of file
+} // namespace Kilosim
@@ -14,6 +14,9 @@
 #include "Robot.h"
 #include <SFML/Graphics.hpp>
 #include <memory>
+#include <atomic>
+#include <thread>
+#include <chrono>
 
 namespace Kilosim
 {
@@ -22,10 +25,37 @@ namespace Kilosim
  * pointer to a World, which will be displayed whenever the #draw method is
  * called. After constructing your Viewer, this is the only method you need to
  * call to use it.
+ *
+ * By default, the World is drawn by `draw()` itself, so the simulation can't
+ * run faster than the display (144 FPS). With a render thread (see the
+ * constructor), the window is drawn by its own thread at the display rate
+ * instead: `draw()` just hands the robots' current positions and colors to it
+ * and returns. The simulation can then run thousands of ticks per displayed
+ * frame, or be slowed to real time with `set_realtime()`.
  */
 class Viewer
 {
 private:
+  //! What's needed to draw a robot
+  struct RobotView
+  {
+    float x;
+    float y;
+    float theta;
+    uint8_t color[3];
+  };
+
+  //! State of the World to draw
+  struct WorldSnapshot
+  {
+    //! Time of the World (seconds)
+    double time;
+    std::vector<RobotView> robots;
+  };
+
+  //! Set in m_middle when the snapshot there is newer than the one being drawn
+  static const uint8_t SNAPSHOT_FRESH = 4;
+
   //! Reference to the World that this Viewer draws
   World &m_world;
   //! Width of the display window (in pixels)
@@ -42,8 +72,30 @@ private:
   double m_scale;
   //! Texture used for drawing all the robots
   sf::RenderTexture m_robot_texture;
+  //! Textured quads (4 vertices each) of all of the robots, drawn at once
+  sf::VertexArray m_robot_vertices;
   //! Settings for SFML
   sf::ContextSettings m_settings;
+  //! Triple buffer of snapshots. The simulation writes m_snapshots[m_back],
+  //! the window is drawn from m_snapshots[m_front], and m_middle holds the
+  //! index of the last one published (with SNAPSHOT_FRESH if it hasn't been
+  //! drawn yet). Without a render thread, only m_snapshots[0] is used.
+  WorldSnapshot m_snapshots[3];
+  uint8_t m_back = 0;
+  uint8_t m_front = 2;
+  std::atomic<uint8_t> m_middle;
+  //! Whether the window is drawn by m_render_thread
+  bool m_use_render_thread;
+  //! Thread that draws the window (if m_use_render_thread)
+  std::thread m_render_thread;
+  //! Whether the render thread should finish
+  std::atomic<bool> m_stop_rendering;
+  //! Whether draw() waits to keep the simulation from running faster than
+  //! real time
+  bool m_realtime = false;
+  //! Wall clock time and World tick when real time pacing started
+  std::chrono::steady_clock::time_point m_realtime_start;
+  uint32_t m_realtime_start_tick;
 
 public:
   /*!
@@ -53,8 +105,14 @@ public:
    * @param window_width Width (in pixels) to draw the display window. Height
    * will be automatically determined from the aspect ratio of the World's
    * dimensions.
+   * @param render_thread Whether to draw the window in its own thread, so the
+   * simulation isn't limited by the display. (Default: false)
    */
-  Viewer(World &world, const int window_width = 1080);
+  Viewer(World &world, const int window_width = 1080,
+         const bool render_thread = false);
+  //! Destructor: stops the render thread (if there is one)
+  ~Viewer();
+
   /*!
    * Draw everything in the world at the current state
    *
@@ -62,14 +120,37 @@ public:
    * black). It is frame rate limited to 144 FPS, which limits the overall rate
    * at which the simulation can run. If the window is closed, the simulation
    * will continue to run but the window will not reopen.
+   *
+   * With a render thread, this doesn't draw or wait for the display: it only
+   * passes the robots' current state to the render thread (if it has taken
+   * the last state passed to it), which shows the newest state it has at
+   * every frame.
    */
   void draw();
 
+  /*!
+   * Set whether `draw()` slows the simulation down to real time (one second
+   * of World time per second), e.g., to watch a simulation that runs too
+   * fast with a render thread. Pacing starts from the next `draw()`.
+   * @param realtime Whether to run in real time (Default: not)
+   */
+  void set_realtime(const bool realtime);
+
 private:
-  //! Draw a single robot onto the scene
-  void draw_robot(Robot *robot);
-  //! Add the current world time to the display
-  void draw_time();
+  //! Create the window and textures (in the thread that draws them)
+  void open_window();
+  //! Copy the state of the World into a snapshot
+  void take_snapshot(WorldSnapshot &snapshot);
+  //! Draw a snapshot of the World into the window
+  void render(const WorldSnapshot &snapshot);
+  //! Update the quads of all the robots from a snapshot
+  void update_robot_vertices(const WorldSnapshot &snapshot);
+  //! Add the World time to the display
+  void draw_time(const double time);
+  //! Body of the render thread
+  void render_loop();
+  //! Wait until real time catches up with the World (if m_realtime)
+  void pace();
 };
 
 /*! \example example_viewer.cpp
@@ -77,4 +158,4 @@ private:
  */
 } // namespace Kilosim
 
-#endif
\ No newline at end of file
+#endif
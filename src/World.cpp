@@ -1,15 +1,21 @@
 #include "World.h"
 #include "random.hpp"
+#include "Kinematics.h"
 #include <stdexcept>
+#include <cstddef>
+#include <cstring>
+#include <algorithm>
 
 // Implementation of Kilobot Arena/World
 
 namespace Kilosim
 {
 World::World(const double arena_width, const double arena_height,
-             const std::string light_pattern_src, const uint num_threads)
+             const std::string light_pattern_src, const uint num_threads,
+             const BroadPhase broad_phase)
     : m_arena_width(arena_width), m_arena_height(arena_height),
-      cb(arena_width, arena_height, 2 * RADIUS)
+      m_seed(get_rand_seed()), m_broad_phase(broad_phase),
+      cb(arena_width, arena_height, 2 * RADIUS, broad_phase)
 {
     if (light_pattern_src.size() > 0)
     {
@@ -45,11 +51,8 @@ void World::step()
 {
     timer_step.start();
 
-    timer_step_memory.start();
-    // Initialize vectors that are used in parallelism
-    std::vector<RobotPose> new_poses((m_robots.size()));
-    std::vector<int16_t> collisions(m_robots.size(), 0);
-    timer_step_memory.stop();
+    // Let time-varying light move on to this tick before anything reads it
+    m_light_pattern.update(m_tick);
 
     // Apply robot controller for all robots
     timer_controllers.start();
@@ -63,27 +66,35 @@ void World::step()
 
     // Compute potential movement for all robots
     timer_compute_next_step.start();
-    compute_next_step(new_poses);
+    compute_next_step(m_new_poses);
     timer_compute_next_step.stop();
 
     // Check for collisions between all robot pairs
     timer_collisions.start();
-    find_collisions(new_poses, collisions);
+    find_collisions(m_new_poses, m_collisions);
     timer_collisions.stop();
 
     // And execute move if no collision
     // or turn if collision
     timer_move.start();
-    move_robots(new_poses, collisions);
+    move_robots(m_new_poses, m_collisions);
     timer_move.stop();
 
     // Increment time
     m_tick++;
 
+    // Nothing reads m_store until the controllers copy the robots' states
+    // into it at the start of the next step, so this is the cheapest time to
+    // change the slots
+    if (m_reorder_interval != 0 && m_tick % m_reorder_interval == 0)
+    {
+        reorder_robots();
+    }
+
     timer_step.stop();
 }
 
-sf::Image World::get_light_pattern() const
+const sf::Image &World::get_light_pattern() const
 {
     return m_light_pattern.get_light_pattern();
 }
@@ -98,10 +109,67 @@ void World::set_light_pattern(std::string light_pattern_src)
     m_light_pattern.set_light_pattern(light_pattern_src);
 }
 
+void World::set_light_source(std::shared_ptr<LightSource> light_source)
+{
+    m_light_pattern.set_light_source(light_source);
+}
+
+bool World::has_light_source() const
+{
+    return m_light_pattern.has_light_source();
+}
+
+void World::get_ambientlight(aligned_vector<uint16_t> &light)
+{
+    m_light_xs.resize(m_robots.size());
+    m_light_ys.resize(m_robots.size());
+#pragma omp parallel for schedule(static)
+    for (unsigned int i = 0; i < m_robots.size(); i++)
+    {
+        // Same sensor position as Kilobot::get_ambientlight() (the nose of the
+        // robot)
+        const Robot &r = *m_robots[i];
+        m_light_xs[i] = r.x + RADIUS * cos(r.theta);
+        m_light_ys[i] = r.y + RADIUS * sin(r.theta);
+    }
+    m_light_pattern.get_ambientlight(m_light_xs, m_light_ys, light);
+}
+
+void World::get_ambientlight(const aligned_vector<double> &xs,
+                             const aligned_vector<double> &ys,
+                             aligned_vector<uint16_t> &light) const
+{
+    m_light_pattern.get_ambientlight(xs, ys, light);
+}
+
+void World::set_light_sampling(const LightSampling sampling,
+                               const double footprint_radius)
+{
+    m_light_pattern.set_sampling(sampling, footprint_radius);
+}
+
 void World::add_robot(Robot *robot)
 {
     robot->add_to_world(m_light_pattern, m_tick_delta_t);
     m_robots.push_back(robot);
+    m_slot_robots.push_back(robot);
+    m_slot_ids.push_back(m_robots.size() - 1);
+    m_id_slots.push_back(m_robots.size() - 1);
+    // Buffers used while stepping are only resized here, so that step()
+    // doesn't allocate memory
+    m_store.resize(m_robots.size());
+    m_new_poses.resize(m_robots.size());
+    m_collisions.resize(m_robots.size());
+    m_comm_msgs.resize(m_robots.size());
+    const size_t align = alignof(std::max_align_t);
+    m_comm_msg_stride = std::max(m_comm_msg_stride,
+                                 (robot->message_size() + align - 1) / align * align);
+    m_comm_msg_data.resize(m_robots.size() * m_comm_msg_stride);
+    m_comm_delivered.resize(m_robots.size());
+    m_comm_ranges.resize(m_robots.size());
+    m_reorder_keys.resize(m_robots.size());
+    cb.reserve(m_robots.size());
+    comm_cb.reserve(m_robots.size());
 }
 
 void World::remove_robot(Robot *robot)
@@ -112,13 +180,22 @@ void World::remove_robot(Robot *robot)
 
 void World::run_controllers()
 {
-    // #pragma omp parallel for default(none) //schedule(static)
+    // Controllers only touch their own robot, so they can all run at once.
+    // Their run time varies a lot, so hand them out in small chunks.
+#pragma omp parallel for schedule(dynamic, 64)
     for (unsigned int i = 0; i < m_robots.size(); i++)
     {
+        // Each robot draws random numbers from its own stream for this tick,
+        // so the results don't depend on which thread runs it
+        set_rand_stream(m_seed, i, m_tick, RAND_STREAM_CONTROLLER);
         if (uniform_rand_real(0, 1) < m_prob_control_execute)
         {
             m_robots[i]->robot_controller();
         }
+        reset_rand_stream();
+        // The robot is still in cache, so this is the cheapest time to copy
+        // its state for the physics
+        m_robots[i]->write_to_store(m_store, m_id_slots[i]);
     }
 }
 
@@ -126,56 +203,196 @@ void World::communicate()
 {
     // TODO: Is the shuffling necessary? (I killed it)
 
-    if (m_tick % m_comm_rate == 0)
+    if (m_tick % m_comm_rate != 0)
+        return;
+
+    // Messages are exchanged in three passes so that every robot is only ever
+    // modified by one thread:
+    // 1. Every robot produces its message (transmitter callbacks), which is
+    //    copied so receivers never read the transmitter's own buffer
+    // 2. Every robot receives the messages in range (receiver callbacks)
+    // 3. Every robot that reached a receiver is told so (transmitter callback)
+    std::fill(m_comm_delivered.begin(), m_comm_delivered.end(), 0);
+    // Messages can only travel as far as the largest communication range, so
+    // only robots in neighbouring boxes of that size need to be checked
+    double max_range = 0;
+#pragma omp parallel for schedule(dynamic, 64) reduction(max : max_range)
+    for (unsigned int tx_id = 0; tx_id < m_robots.size(); tx_id++)
     {
-        // #pragma omp parallel for
-        for (unsigned int tx_i = 0; tx_i < m_robots.size(); tx_i++)
+        const unsigned int tx_i = m_id_slots[tx_id];
+        set_rand_stream(m_seed, tx_id, m_tick, RAND_STREAM_MESSAGE_TX);
+        const void *msg = m_robots[tx_id]->get_message();
+        reset_rand_stream();
+        if (msg)
         {
-            Robot &tx_r = *m_robots[tx_i];
-            // Loop over all transmitting robots
-            void *msg = tx_r.get_message();
-            if (msg)
-            {
-                for (unsigned int rx_i = 0; rx_i < m_robots.size(); rx_i++)
-                {
-                    Robot &rx_r = *m_robots[rx_i];
-                    // Loop over receivers if transmitting robot is sending a message
-                    if (rx_i != tx_i)
-                    {
-                        // Check communication range in both directions
-                        // (due to potentially noisy communication range)
-                        double dist = tx_r.distance(tx_r.x, tx_r.y, rx_r.x, rx_r.y);
-                        // Only communicate if robots are within each others'
-                        // communication ranges. (Range may be asymmetric/noisy)
-                        if (tx_r.comm_criteria(dist) &&
-                            rx_r.comm_criteria(dist))
-                        {
-                            // Receiving robot processes incoming message
-                            rx_r.receive_msg(msg, dist);
-                            // Tell the sender that the message sent successfully
-                            tx_r.received();
-                        }
-                    }
-                }
-            }
+            uint8_t *copy = &m_comm_msg_data[tx_i * m_comm_msg_stride];
+            memcpy(copy, msg, m_robots[tx_id]->message_size());
+            m_comm_msgs[tx_i] = copy;
+        }
+        else
+        {
+            m_comm_msgs[tx_i] = NULL;
         }
+        // Keep the range next to the message, so looking for receivers doesn't
+        // need to touch the transmitting robot
+        m_comm_ranges[tx_i] = m_robots[tx_id]->comm_range();
+        max_range = std::max(max_range, m_comm_ranges[tx_i]);
+    }
+
+    if (max_range >= std::max(m_arena_width, m_arena_height))
+    {
+        deliver_all_pairs();
+    }
+    else
+    {
+        deliver_nearby(max_range);
+    }
+
+#pragma omp parallel for schedule(static)
+    for (unsigned int tx_id = 0; tx_id < m_robots.size(); tx_id++)
+    {
+        // Tell the sender that the message sent successfully
+        if (m_comm_delivered[m_id_slots[tx_id]])
+        {
+            set_rand_stream(m_seed, tx_id, m_tick, RAND_STREAM_MESSAGE_SENT);
+            m_robots[tx_id]->received();
+            reset_rand_stream();
+        }
+    }
+}
+
+void World::deliver_message(const unsigned int tx_i, const unsigned int rx_i)
+{
+    Robot &rx_r = *m_slot_robots[rx_i];
+    const Robot &tx_r = *m_slot_robots[tx_i];
+    // Check communication range in both directions
+    // (due to potentially noisy communication range)
+    double dist = tx_r.distance(m_store.x[tx_i], m_store.y[tx_i],
+                                m_store.x[rx_i], m_store.y[rx_i]);
+    // Only communicate if robots are within each others'
+    // communication ranges. (Range may be asymmetric/noisy)
+    if (tx_r.comm_criteria(dist) &&
+        static_cast<const Robot &>(rx_r).comm_criteria(dist))
+    {
+        // Receiving robot processes incoming message
+        rx_r.receive_msg(m_comm_msgs[tx_i], dist);
+#pragma omp atomic write
+        m_comm_delivered[tx_i] = 1;
+    }
+}
+
+void World::deliver_nearby(const double max_range)
+{
+    const double box_size = std::max(max_range, 2.0 * RADIUS);
+    if (box_size != m_comm_box_size)
+    {
+        comm_cb = CollisionBoxes(m_arena_width, m_arena_height, box_size, m_broad_phase);
+        // Non-overlapping robots can't be packed more densely than a hexagonal
+        // lattice, which bounds how many robot centers can share one box. This
+        // is only a hint for how much room to reserve: the boxes themselves
+        // have no capacity limit.
+        const double span = box_size + 2 * RADIUS;
+        const int per_box = std::ceil(span * span / (2 * sqrt(3) * RADIUS * RADIUS)) + 1;
+        m_comm_max_candidates = 9 * per_box;
+        comm_cb.reserve(m_robots.size());
+        m_comm_box_size = box_size;
+    }
+
+    comm_cb.update(m_store.x, m_store.y);
+
+    m_comm_candidates.resize(omp_get_max_threads());
+    for (auto &candidates : m_comm_candidates)
+        candidates.reserve(m_comm_max_candidates);
+    // Receivers are visited in the order they're stored in the grid, so that
+    // consecutive receivers look at the same boxes
+#pragma omp parallel for schedule(dynamic, 64)
+    for (int k = 0; k < comm_cb.size(); k++)
+    {
+        const unsigned int rx_i = comm_cb.sorted_agent(k);
+        const double rx_x = m_store.x[rx_i];
+        const double rx_y = m_store.y[rx_i];
+        auto &candidates = m_comm_candidates[omp_get_thread_num()];
+
+        // Compare squared distances to find the transmitters that might be in
+        // range. The small margin keeps pairs right at the edge of the range
+        // (where the rounding of sqrt could go either way) for the exact check
+        // in deliver_message.
+        candidates.clear();
+        comm_cb.considerNeighbours(rx_x, rx_y, [&](const unsigned int tx_i, const double tx_x, const double tx_y) -> bool {
+            if (tx_i == rx_i || !m_comm_msgs[tx_i])
+                return true;
+            const double tx_range = m_comm_ranges[tx_i];
+            const double dx = tx_x - rx_x;
+            const double dy = tx_y - rx_y;
+            if (dx * dx + dy * dy <= tx_range * tx_range * (1 + 1e-9))
+                candidates.push_back(tx_i);
+            return true;
+        });
+        // Receive in the same order as checking every robot would
+        std::sort(candidates.begin(), candidates.end(),
+                  [&](const unsigned int a, const unsigned int b) {
+                      return m_slot_ids[a] < m_slot_ids[b];
+                  });
+
+        set_rand_stream(m_seed, m_slot_ids[rx_i], m_tick, RAND_STREAM_MESSAGE_RX);
+        for (const auto tx_i : candidates)
+            deliver_message(tx_i, rx_i);
+        reset_rand_stream();
+    }
+}
+
+void World::deliver_all_pairs()
+{
+#pragma omp parallel for schedule(dynamic, 64)
+    for (unsigned int rx_i = 0; rx_i < m_slot_robots.size(); rx_i++)
+    {
+        set_rand_stream(m_seed, m_slot_ids[rx_i], m_tick, RAND_STREAM_MESSAGE_RX);
+        // Loop over all transmitting robots, in the order they were added
+        for (unsigned int tx_id = 0; tx_id < m_robots.size(); tx_id++)
+        {
+            const unsigned int tx_i = m_id_slots[tx_id];
+            if (tx_i != rx_i && m_comm_msgs[tx_i])
+                deliver_message(tx_i, rx_i);
+        }
+        reset_rand_stream();
     }
 }
 
-void World::compute_next_step(std::vector<RobotPose> &new_poses)
+void World::compute_next_step(PoseArrays &new_poses)
 {
-    // TODO: Implement compute_next_step (and maybe change from pointers)
+#pragma omp parallel
+    {
+        // Give each thread one contiguous block of robots (a multiple of 8
+        // long) for the vectorized kernel
+        const size_t num_robots = m_store.size();
+        const size_t num_threads = omp_get_num_threads();
+        const size_t block = ((num_robots + num_threads - 1) / num_threads + 7) / 8 * 8;
+        const size_t begin = std::min(num_robots, omp_get_thread_num() * block);
+        const size_t end = std::min(num_robots, begin + block);
+        compute_next_steps(m_store, m_tick_delta_t, new_poses, begin, end);
+    }
 
-    // printf("\nt = %d\n", m_tick);
-    // #pragma omp parallel for schedule(static)
-    // #pragma omp parallel for
+#ifdef CHECKSANE
+    // The batched kinematics must agree with each Robot's own computation
     for (unsigned int r_i = 0; r_i < m_robots.size(); r_i++)
     {
-        new_poses[r_i] = m_robots[r_i]->robot_compute_next_step();
+        const RobotPose ref = m_slot_robots[r_i]->robot_compute_next_step();
+        const double dtheta = std::abs(ref.theta - new_poses.theta[r_i]);
+        if (std::abs(ref.x - new_poses.x[r_i]) > 1e-6 ||
+            std::abs(ref.y - new_poses.y[r_i]) > 1e-6 ||
+            std::min(dtheta, 2 * PI - dtheta) > 1e-6)
+        {
+            std::cerr << "Robot " << r_i << " next pose (" << new_poses.x[r_i]
+                      << ", " << new_poses.y[r_i] << ", " << new_poses.theta[r_i]
+                      << ") != reference (" << ref.x << ", " << ref.y << ", "
+                      << ref.theta << ")" << std::endl;
+            throw std::runtime_error("Kinematics disagree in compute_next_step!");
+        }
     }
+#endif
 }
 
-void World::find_collisions(const std::vector<RobotPose> &new_poses, std::vector<int16_t> &collisions)
+void World::find_collisions(const PoseArrays &new_poses, aligned_vector<int16_t> &collisions)
 {
     // Check to see if motion causes robots to collide with their updated positions
 
@@ -185,7 +402,7 @@ void World::find_collisions(const std::vector<RobotPose> &new_poses, std::vector
 
     //This updates a grid structure which enables robots to quickly identify
     //other robots with whom they might be colliding.
-    cb.update(new_poses);
+    cb.update(new_poses.x, new_poses.y);
 
     //The following checks whether a robot is colliding with a wall or any other
     //robots. Only the collision status of the focal robot is changed. This
@@ -194,15 +411,21 @@ void World::find_collisions(const std::vector<RobotPose> &new_poses, std::vector
     //to ensure that wall collisions are still adequately accounted for. It also
     //reduces the potential for parallelism since it introduces a data race.
 
-    // #pragma omp parallel for schedule(static)
-    for (unsigned int ci = 0; ci < m_robots.size(); ci++)
+    //Robots are visited in the order they're stored in the grid, so that
+    //consecutive robots look at the same (already cached) boxes
+#pragma omp parallel for schedule(static)
+    for (int k = 0; k < cb.size(); k++)
     {
-        const auto &cr = new_poses[ci];
+        const unsigned int ci = cb.sorted_agent(k);
+        const double cr_x = new_poses.x[ci];
+        const double cr_y = new_poses.y[ci];
+        // The buffer is reused between steps, so clear the last result
+        collisions[ci] = 0;
         // Check for collisions with walls
-        if (cr.x <= RADIUS ||
-            cr.x >= m_arena_width - RADIUS ||
-            cr.y <= RADIUS ||
-            cr.y >= m_arena_height - RADIUS)
+        if (cr_x <= RADIUS ||
+            cr_x >= m_arena_width - RADIUS ||
+            cr_y <= RADIUS ||
+            cr_y >= m_arena_height - RADIUS)
         {
             // There's a collision with the wall.
             // Don't even bother to check for collisions with other robots
@@ -210,11 +433,10 @@ void World::find_collisions(const std::vector<RobotPose> &new_poses, std::vector
             continue;
         }
 
-        const auto func = [&](const unsigned int ni) -> bool {
+        const auto func = [&](const unsigned int ni, const double n_x, const double n_y) -> bool {
             if (ci == ni)
                 return true; //Look at more neighbours
-            const auto &nr = new_poses[ni];
-            const double distance = pow(cr.x - nr.x, 2) + pow(cr.y - nr.y, 2);
+            const double distance = pow(cr_x - n_x, 2) + pow(cr_y - n_y, 2);
 
             //Check to see if robots' centers are within 2*RADIUS of each other,
             //since that means their edges would be touching. But we actually
@@ -230,20 +452,19 @@ void World::find_collisions(const std::vector<RobotPose> &new_poses, std::vector
             return true; //Look at more neighbours
         };
 
-        cb.considerNeighbours(cr.x, cr.y, func);
+        cb.considerNeighbours(cr_x, cr_y, func);
     }
 
 #ifdef CHECKSANE
     for (unsigned int ci = 0; ci < m_robots.size(); ci++)
     {
-        const auto &cr = new_poses[ci];
         for (unsigned int ni = ci + 1; ni < m_robots.size(); ni++)
         {
-            const auto &nr = new_poses[ni];
-            const double distance = pow(cr.x - nr.x, 2) + pow(cr.y - nr.y, 2);
+            const double distance = pow(new_poses.x[ci] - new_poses.x[ni], 2) +
+                                    pow(new_poses.y[ci] - new_poses.y[ni], 2);
             if (distance < 4 * RADIUS * RADIUS && (collisions[ni] == 0 || collisions[ci] == 0))
             {
-                std::cerr << "Robots " << ci << " and " << ni << " overlap!" << std::endl;
+                std::cerr << "Robots " << m_slot_ids[ci] << " and " << m_slot_ids[ni] << " overlap!" << std::endl;
                 std::cerr << "collisions[" << ci << "] = " << collisions[ci] << std::endl;
                 std::cerr << "collisions[" << ni << "] = " << collisions[ni] << std::endl;
                 // std::cerr<<"Neighbours found: ";
@@ -257,15 +478,194 @@ void World::find_collisions(const std::vector<RobotPose> &new_poses, std::vector
 #endif
 }
 
-void World::move_robots(std::vector<RobotPose> &new_poses,
-                        const std::vector<int16_t> &collisions)
+void World::move_robots(const PoseArrays &new_poses,
+                        const aligned_vector<int16_t> &collisions)
+{
+#pragma omp parallel for schedule(static)
+    for (unsigned int i = 0; i < m_robots.size(); i++)
+    {
+        const unsigned int ri = m_id_slots[i];
+        m_store.move(ri, m_tick_delta_t, new_poses, collisions[ri]);
+        // Hand the new pose back to the robot, where it's visible to the
+        // controller, Logger, and Viewer
+        m_robots[i]->read_from_store(m_store, ri);
+    }
+}
+
+void World::reorder_robots()
+{
+    // Quantize positions to boxes the size of a robot and interleave the bits
+    // of the box coordinates (Morton/Z-order). The robot's index breaks ties,
+    // so the order doesn't depend on the previous one.
+    const unsigned int num_robots = m_slot_robots.size();
+#pragma omp parallel for schedule(static)
+    for (unsigned int i = 0; i < num_robots; i++)
+    {
+        uint64_t bx = std::min(std::max(m_store.x[i] / (2 * RADIUS), 0.0), 65535.0);
+        uint64_t by = std::min(std::max(m_store.y[i] / (2 * RADIUS), 0.0), 65535.0);
+        uint64_t morton = 0;
+        for (int b = 0; b < 16; b++)
+        {
+            morton |= ((bx >> b) & 1) << (2 * b);
+            morton |= ((by >> b) & 1) << (2 * b + 1);
+        }
+        m_reorder_keys[i] = (morton << 32) | m_slot_ids[i];
+    }
+    std::sort(m_reorder_keys.begin(), m_reorder_keys.end());
+
+    for (unsigned int i = 0; i < num_robots; i++)
+    {
+        const unsigned int id = m_reorder_keys[i] & 0xFFFFFFFF;
+        m_slot_ids[i] = id;
+        m_slot_robots[i] = m_robots[id];
+        m_id_slots[id] = i;
+    }
+}
+
+void World::set_reorder_interval(const uint32_t interval)
 {
-    // TODO: Parallelize
-    // #pragma omp parallel for
-    for (unsigned int ri = 0; ri < m_robots.size(); ri++)
+    m_reorder_interval = interval;
+}
+
+void World::set_seed(const uint64_t seed)
+{
+    m_seed = seed;
+}
+
+uint64_t World::get_seed() const
+{
+    return m_seed;
+}
+
+void World::save_state(CheckpointWriter &out) const
+{
+    // Enough of the setup to check that the state is restored into a matching
+    // World
+    out.write(m_arena_width);
+    out.write(m_arena_height);
+    out.write(m_tick_rate);
+    out.write((uint64_t)m_robots.size());
+
+    out.write(m_tick);
+    out.write(m_seed);
+    // Random numbers only depend on the seed, the robot, and the tick, so
+    // there's no other random number state to save. The order of the slots
+    // doesn't change the results, but it's kept so stepping is just as fast.
+    out.write(m_slot_ids);
+    for (const Robot *robot : m_robots)
+    {
+        const size_t block = out.begin_block();
+        robot->robot_save(out);
+        out.end_block(block);
+    }
+}
+
+void World::load_state(CheckpointReader &in)
+{
+    double arena_width, arena_height;
+    uint16_t tick_rate;
+    uint64_t num_robots;
+    in.read(arena_width);
+    in.read(arena_height);
+    in.read(tick_rate);
+    in.read(num_robots);
+    if (arena_width != m_arena_width || arena_height != m_arena_height ||
+        tick_rate != m_tick_rate)
+    {
+        throw std::runtime_error("Checkpoint is of a World with different dimensions or tick rate");
+    }
+    if (num_robots != m_robots.size())
     {
-        m_robots[ri]->robot_move(new_poses[ri], collisions[ri]);
+        throw std::runtime_error("Checkpoint has " + std::to_string(num_robots) +
+                                 " robots, but the World has " +
+                                 std::to_string(m_robots.size()));
     }
+
+    uint32_t tick;
+    uint64_t seed;
+    std::vector<unsigned int> slot_ids;
+    in.read(tick);
+    in.read(seed);
+    in.read(slot_ids);
+    if (slot_ids.size() != num_robots)
+    {
+        throw std::runtime_error("Checkpoint has an invalid order of robots");
+    }
+    std::vector<unsigned int> id_slots(num_robots, num_robots);
+    for (unsigned int i = 0; i < slot_ids.size(); i++)
+    {
+        if (slot_ids[i] >= num_robots || id_slots[slot_ids[i]] != num_robots)
+        {
+            throw std::runtime_error("Checkpoint has an invalid order of robots");
+        }
+        id_slots[slot_ids[i]] = i;
+    }
+
+    // Find every robot's block before changing anything, so a truncated
+    // checkpoint leaves the World as it was
+    std::vector<CheckpointReader> robot_ins;
+    robot_ins.reserve(num_robots);
+    for (unsigned int i = 0; i < num_robots; i++)
+    {
+        robot_ins.push_back(in.block());
+    }
+
+    // A robot's state can only be checked by loading it, so keep the current
+    // state of the robots to put back if one of them fails
+    CheckpointWriter backup;
+    for (const Robot *robot : m_robots)
+    {
+        const size_t block = backup.begin_block();
+        robot->robot_save(backup);
+        backup.end_block(block);
+    }
+    unsigned int num_loaded = 0;
+    try
+    {
+        for (; num_loaded < m_robots.size(); num_loaded++)
+        {
+            CheckpointReader &robot_in = robot_ins[num_loaded];
+            m_robots[num_loaded]->robot_load(robot_in);
+            if (robot_in.remaining() != 0)
+            {
+                throw std::runtime_error("Robot " + std::to_string(num_loaded) +
+                                         " didn't read all of its saved state (do its save_state() and load_state() match?)");
+            }
+        }
+    }
+    catch (...)
+    {
+        CheckpointReader backup_in(backup);
+        for (unsigned int i = 0; i <= num_loaded && i < m_robots.size(); i++)
+        {
+            CheckpointReader robot_in = backup_in.block();
+            m_robots[i]->robot_load(robot_in);
+        }
+        throw;
+    }
+
+    m_tick = tick;
+    m_seed = seed;
+    m_slot_ids = slot_ids;
+    m_id_slots = id_slots;
+    for (unsigned int i = 0; i < m_slot_ids.size(); i++)
+    {
+        m_slot_robots[i] = m_robots[m_slot_ids[i]];
+    }
+    m_light_pattern.update(m_tick);
+}
+
+void World::save_checkpoint(const std::string &filename)
+{
+    m_checkpoint.clear();
+    save_state(m_checkpoint);
+    m_checkpoint.save(filename);
+}
+
+void World::load_checkpoint(const std::string &filename)
+{
+    CheckpointReader in(filename);
+    load_state(in);
 }
 
 uint16_t World::get_tick_rate() const
@@ -297,7 +697,6 @@ std::vector<double> World::get_dimensions() const
 void World::printTimes() const
 {
     std::cerr << "t timer_step              = " << timer_step.accumulated() << std::endl;
-    std::cerr << "t timer_step_memory       = " << timer_step_memory.accumulated() << std::endl;
     std::cerr << "t timer_controllers       = " << timer_controllers.accumulated() << std::endl;
     std::cerr << "t timer_communicate       = " << timer_communicate.accumulated() << std::endl;
     std::cerr << "t timer_compute_next_step = " << timer_compute_next_step.accumulated() << std::endl;
@@ -13,6 +13,8 @@
 #include "Robot.h"
 #include "LightPattern.h"
 #include "CollisionBoxes.h"
+#include "RobotStore.h"
+#include "Checkpoint.h"
 #include "Timer.hpp"
 
 #ifdef _OPENMP
@@ -39,12 +41,51 @@ namespace Kilosim
  *
  * It manages fixed-step simulated control over all `Robot`s placed in it.
  *
+ * Each phase of `step()` processes the `Robot`s in parallel (with OpenMP,
+ * over the number of threads set in the constructor). This means that
+ * callbacks in your `Robot`/`Kilobot` code follow these rules:
+ *
+ * - Callbacks of *different* robots may run at the same time, on different
+ *   threads. This includes `loop()`, `message_tx()`, `message_tx_success()`,
+ *   and `message_rx()`.
+ * - Callbacks of the *same* robot never run at the same time. The exception
+ *   is `Robot::comm_criteria()`, which is called by the receiving robot's
+ *   thread, so it must not modify the robot.
+ * - Within a communication tick, every robot runs `message_tx()` before any
+ *   robot runs `message_rx()`. Each robot receives its messages in order of
+ *   the transmitting robots' indices, regardless of the number of threads.
+ * - Robots receive a copy of each message, taken right after `message_tx()`,
+ *   so `message_rx()` can change the robot's own outgoing message. The copy
+ *   is shared by all of the receivers, so it must not be modified.
+ * - `Robot::received()` is called at most once per communication tick, after
+ *   all messages have been delivered.
+ *
+ * Callbacks should therefore only modify their own robot. Anything shared
+ * between robots (global or `static` variables) must be protected by the user,
+ * for example with `#pragma omp critical`.
  */
 class World
 {
 private:
   //! Robots in the world
   std::vector<Robot *> m_robots;
+  //! Robots in the order they're stored for stepping (same order as m_store)
+  std::vector<Robot *> m_slot_robots;
+  //! Index in m_robots of the robot in each slot of m_slot_robots
+  std::vector<unsigned int> m_slot_ids;
+  //! Slot in m_slot_robots of each robot in m_robots
+  std::vector<unsigned int> m_id_slots;
+  //! Physical state of the robots (same order as m_slot_robots), used for
+  //! physics
+  RobotStore m_store;
+  //! Number of ticks between spatial reorderings of the slots (0 = never)
+  uint32_t m_reorder_interval = 0;
+  //! Sort keys of the slots when reordering
+  std::vector<uint64_t> m_reorder_keys;
+  //! Collision-ignorant next poses of the robots (reused every step)
+  PoseArrays m_new_poses;
+  //! Whether/how each robot is colliding (reused every step)
+  aligned_vector<int16_t> m_collisions;
   //! How many ticks per second in simulation
   const uint16_t m_tick_rate = 32;
   //! Current tick of the system (starts at 0)
@@ -61,16 +102,54 @@ private:
   const double m_prob_control_execute = .99;
   //! Background light pattern image
   LightPattern m_light_pattern;
+  //! Light sensor positions of the robots (reused by get_ambientlight())
+  aligned_vector<double> m_light_xs;
+  aligned_vector<double> m_light_ys;
+  //! Seed of the random number streams used by the robots in this World
+  uint64_t m_seed;
+
+  //! Random number streams used for each kind of robot callback in a tick
+  enum RandStream : uint32_t
+  {
+    RAND_STREAM_CONTROLLER,
+    RAND_STREAM_MESSAGE_TX,
+    RAND_STREAM_MESSAGE_RX,
+    RAND_STREAM_MESSAGE_SENT
+  };
 
 private:
+  //! How cb and comm_cb store their boxes
+  const BroadPhase m_broad_phase;
   CollisionBoxes cb;
+  //! Grid for finding robots within communication range of each other
+  CollisionBoxes comm_cb;
+  //! Box size of comm_cb (largest communication range of any robot)
+  double m_comm_box_size = 0;
+  //! Copy of the message each robot is transmitting this tick (NULL if none),
+  //! pointing into m_comm_msg_data
+  std::vector<void *> m_comm_msgs;
+  //! Copies of the messages being transmitted, one every m_comm_msg_stride
+  //! bytes (in the same order as m_slot_robots)
+  aligned_vector<uint8_t> m_comm_msg_data;
+  //! Bytes for each message in m_comm_msg_data (the largest message size of
+  //! any robot, rounded up to keep the copies aligned)
+  size_t m_comm_msg_stride = 0;
+  //! Communication range of each robot this tick
+  std::vector<double> m_comm_ranges;
+  //! Whether each robot's message reached at least one receiver this tick
+  std::vector<uint8_t> m_comm_delivered;
+  //! Possible transmitters for a single receiving robot (one per thread)
+  std::vector<std::vector<unsigned int>> m_comm_candidates;
+  //! Most robots that can be in the 3x3 boxes of comm_cb around a robot
+  size_t m_comm_max_candidates = 0;
+  //! Buffer that save_checkpoint() writes the state into (reused)
+  CheckpointWriter m_checkpoint;
   Timer timer_controllers;
   Timer timer_collisions;
   Timer timer_move;
   Timer timer_compute_next_step;
   Timer timer_communicate;
   Timer timer_step;
-  Timer timer_step_memory;
 
 protected:
   //! Run the controllers (kilolib) for all robots
@@ -78,12 +157,29 @@ protected:
   //! Send messages between robots
   void communicate();
   /*!
-   * Compute the next positions of the robots from positions and motor commands
-   * @param new_poses Shared reference of new positions to compute over all of
-   * the robots. (This is passed as a parameter so it can be initialized outside
-   * of the parallelization)
+   * Deliver the messages in m_comm_msgs to every receiver in range, only
+   * checking robots that are in neighbouring boxes of comm_cb
+   * @param max_range Largest communication range of any robot
+   */
+  void deliver_nearby(const double max_range);
+  /*!
+   * Deliver the messages in m_comm_msgs by checking every pair of robots. This
+   * is used when any robot has an unbounded communication range.
+   */
+  void deliver_all_pairs();
+  /*!
+   * Deliver the message of one transmitting robot to one receiving robot, if
+   * they are within each other's communication range
+   * @param tx_i Index of the transmitting robot
+   * @param rx_i Index of the receiving robot
    */
-  void compute_next_step(std::vector<RobotPose> &new_poses);
+  void deliver_message(const unsigned int tx_i, const unsigned int rx_i);
+  /*!
+   * Compute the next positions of the robots from the positions and motor
+   * commands in m_store
+   * @param new_poses New positions to compute over all of the robots
+   */
+  void compute_next_step(PoseArrays &new_poses);
   /*!
    * Check to see if motion causes robots to collide
    * @param new_poses Check for collisions between these would-be next positions
@@ -92,17 +188,24 @@ protected:
    * @return For each robot: 0 if no collision; -1 if wall collision; 1 if
    * collision with another robot
    */
-  void find_collisions(const std::vector<RobotPose> &new_poses,
-                       std::vector<int16_t> &collisions);
+  void find_collisions(const PoseArrays &new_poses,
+                       aligned_vector<int16_t> &collisions);
   /*!
    * Move the robots based on new positions and collisions. This modifies the
-   * internal positions of all robots in m_robots vector
+   * states in m_store and copies the resulting poses back into the robots in
+   * m_robots
    * @param new_poses Possible next step positions from compute_next_step()
    * @param collisions Whether or not robots are colliding, from
    * find_collisions()
    */
-  void move_robots(std::vector<RobotPose> &new_poses,
-                   const std::vector<int16_t> &collisions);
+  void move_robots(const PoseArrays &new_poses,
+                   const aligned_vector<int16_t> &collisions);
+  /*!
+   * Sort the slots of the robots along a Morton (Z-order) curve through their
+   * positions, so that robots that are close together in the arena are close
+   * together in memory
+   */
+  void reorder_robots();
 
 public:
   /*!
@@ -116,9 +219,14 @@ public:
    * background will be black.
    * @param num_threads How many threads to parallelize the simulation over. If
    * set to 0 (default), dynamic threading will be used.
+   * @param broad_phase How to store the boxes used to find nearby robots. The
+   * default (`BROAD_PHASE_GRID`) uses memory in proportion to the area of the
+   * arena; use `BROAD_PHASE_HASH` for huge or mostly-empty arenas, where it
+   * uses memory in proportion to the number of robots instead.
    */
   World(const double arena_width, const double arena_height,
-        const std::string light_pattern_src = "", const uint num_threads = 0);
+        const std::string light_pattern_src = "", const uint num_threads = 0,
+        const BroadPhase broad_phase = BROAD_PHASE_GRID);
   //! Destructor, destroy all objects within the world
   /*!
    * This does not destroy any Robots that have pointers stored in the world.
@@ -135,10 +243,11 @@ public:
   void step();
 
   /*!
-   * Get the current light in the world
+   * Get the current light in the world. The image is loaded the first time
+   * this is called (it's only needed for display).
    * @return SFML Image showing the visible light in the world
    */
-  sf::Image get_light_pattern() const;
+  const sf::Image &get_light_pattern() const;
 
   /*!
    * Check whether the World has a light pattern image set
@@ -155,6 +264,59 @@ public:
    */
   void set_light_pattern(const std::string light_img_src);
 
+  /*!
+   * Set a light source that can change over time (such as an `ImageSequence`,
+   * `PointLight`, `GradientLight`, or `SumLight`), to use instead of a light
+   * pattern image. It is updated at the start of every tick.
+   *
+   * The light source is read by robots' controllers in parallel, so its
+   * `get_ambientlight()` must not modify it.
+   * @param light_source Light source to use (or nullptr to go back to the
+   * light pattern image)
+   */
+  void set_light_source(std::shared_ptr<LightSource> light_source);
+
+  /*!
+   * Check whether the light comes from a light source set with
+   * `set_light_source()` (rather than the light pattern image)
+   * @return Whether a light source is set
+   */
+  bool has_light_source() const;
+
+  /*!
+   * Set how robots' light sensors sample the light pattern image. By default
+   * (`LIGHT_SAMPLE_NEAREST`) they read the single pixel under the sensor;
+   * `LIGHT_SAMPLE_BILINEAR` interpolates between pixels so light changes
+   * smoothly as robots move, and `LIGHT_SAMPLE_AREA` averages the light over a
+   * square around the sensor. This doesn't affect a light source set with
+   * `set_light_source()` (an `ImageSequence` has its own `set_sampling()`).
+   * @param sampling How to sample light
+   * @param footprint_radius For `LIGHT_SAMPLE_AREA`, half the side of the
+   * square to average over (mm)
+   */
+  void set_light_sampling(const LightSampling sampling,
+                          const double footprint_radius = 0);
+
+  /*!
+   * Get the light intensity seen by every robot's light sensor, in one pass
+   * over all of the robots. Each value is what `Kilobot::get_ambientlight()`
+   * would return for that robot right now.
+   * @param light 10-bit light intensity for each robot, in the same order as
+   * `get_robots()` (resized to the number of robots)
+   */
+  void get_ambientlight(aligned_vector<uint16_t> &light);
+
+  /*!
+   * Get the light intensity at many points in the World at the current tick
+   * (e.g., to draw the light when it comes from a light source)
+   * @param xs x positions (from left) in mm
+   * @param ys y positions (from bottom) in mm
+   * @param light 10-bit light intensity at each point (resized to match xs)
+   */
+  void get_ambientlight(const aligned_vector<double> &xs,
+                        const aligned_vector<double> &ys,
+                        aligned_vector<uint16_t> &light) const;
+
   /*!
    * Add a robot to the world by its pointer.
    * @warning It is possible right now to add a Robot twice, so be careful.
@@ -169,6 +331,87 @@ public:
    */
   void remove_robot(Robot *robot);
 
+  /*!
+   * Set the seed of the random numbers used by the robots while stepping.
+   *
+   * By default, this is the seed given to `seed_rand()` before the World was
+   * constructed. Each robot gets its own stream of random numbers for every
+   * tick, based on this seed, its index in the World, and the tick. This makes
+   * simulations reproducible regardless of the number of threads.
+   * @param seed Seed for the random number streams
+   */
+  void set_seed(const uint64_t seed);
+
+  /*!
+   * Get the seed of the random numbers used by the robots while stepping
+   * @return Seed for the random number streams
+   */
+  uint64_t get_seed() const;
+
+  /*!
+   * Periodically reorder the robots in memory by their positions.
+   *
+   * The World keeps the robots' physical state (used for finding collisions and
+   * message receivers) in its own order, separate from the order the robots
+   * were added in. Normally the two are the same, so as robots move around,
+   * neighbours in the arena end up far apart in memory. With reordering, the
+   * World sorts its own order along a space-filling curve every `interval`
+   * ticks, which speeds up finding collisions and messages. Copying state
+   * to and from the Robots (which stay where they are in memory) gets slower,
+   * so this only pays off for many robots (thousands or more) with cheap
+   * controllers, which have moved far from where they were added.
+   *
+   * This is invisible outside of the World: `get_robots()` keeps the order the
+   * robots were added in, and random numbers and message order are based on
+   * that order too, so simulations give identical results with or without
+   * reordering.
+   * @param interval Number of ticks between reorderings, or 0 (default) to
+   * never reorder
+   */
+  void set_reorder_interval(const uint32_t interval);
+
+  /*!
+   * Save the full state of the simulation: the tick, random number seed, and
+   * the state of every robot (including the state of your Kilobot code, from
+   * `Kilobot::save_state()`). Restoring it with `load_state()` makes the
+   * simulation continue exactly as it would have from here.
+   *
+   * The World's setup isn't saved. This includes its size, light pattern or
+   * light source (which only depend on the tick), and which robots are in it.
+   * @param out Checkpoint to write the state into
+   */
+  void save_state(CheckpointWriter &out) const;
+
+  /*!
+   * Restore the state saved with `save_state()`. The World must be set up the
+   * same way as the one that was saved: the same size and light, with the
+   * same kinds of robots added in the same order. The robots don't need to be
+   * initialized (with `Robot::robot_init()`), since their state is replaced.
+   * @param in Checkpoint to read the state from
+   * @throws std::runtime_error if the checkpoint doesn't match this World.
+   * (The World is then left as it was.)
+   */
+  void load_state(CheckpointReader &in);
+
+  /*!
+   * Save the full state of the simulation (see `save_state()`) to a file,
+   * e.g., to resume a long simulation after it's interrupted. An existing
+   * file is only replaced once the new checkpoint has been written
+   * completely.
+   * @param filename File to save the checkpoint in
+   * @throws std::runtime_error if the file can't be written
+   */
+  void save_checkpoint(const std::string &filename);
+
+  /*!
+   * Restore the state of the simulation from a file saved with
+   * `save_checkpoint()` (see `load_state()`)
+   * @param filename Checkpoint file
+   * @throws std::runtime_error if the file can't be read or doesn't match
+   * this World
+   */
+  void load_checkpoint(const std::string &filename);
+
   /*!
    * Get the tick rate (should be 32)
    * @return Number of simulation ticks per second of real-world (wall clock)
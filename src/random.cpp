@@ -2,54 +2,164 @@
 #include <cassert>
 #include <random>
 #include <cstdint>
+#include <cmath>
 #include <algorithm>
 #include <iostream>
 #include <functional>
 #include <limits>
 
+namespace
+{
+//Seed shared by the default streams of all threads
+std::uint64_t global_seed = 0;
+
+//Every thread gets its own default stream
+philox_engine make_default_engine()
+{
+  philox_engine e;
+  e.set_stream(global_seed,
+               std::numeric_limits<std::uint32_t>::max() - omp_get_thread_num(),
+               0, 0);
+  return e;
+}
+
+//Default stream of the calling thread
+thread_local philox_engine default_engine = make_default_engine();
+//Stream set with set_rand_stream
+thread_local philox_engine stream_engine;
+//Which of the two the calling thread is drawing from
+thread_local philox_engine *current_engine = &default_engine;
+
+//Returns the high 32 bits of a*b and stores the low 32 bits in lo
+inline std::uint32_t mulhilo(const std::uint32_t a, const std::uint32_t b,
+                             std::uint32_t &lo)
+{
+  const std::uint64_t product = (std::uint64_t)a * b;
+  lo = (std::uint32_t)product;
+  return product >> 32;
+}
+
+//Uniformly-distributed double in [0,1) with all 53 bits of the mantissa used
+inline double rand_unit(our_random_engine &e)
+{
+  const std::uint64_t hi = e() >> 5;
+  const std::uint64_t lo = e() >> 6;
+  return (hi * 67108864.0 + lo) * (1.0 / 9007199254740992.0);
+}
+
+void seed_default_engine()
+{
+  default_engine = make_default_engine();
+  current_engine = &default_engine;
+}
+} // namespace
+
+void philox_engine::set_stream(const std::uint64_t seed, const std::uint32_t id,
+                               const std::uint32_t tick, const std::uint32_t stream)
+{
+  m_key[0] = (std::uint32_t)seed;
+  m_key[1] = seed >> 32;
+  m_ctr[0] = 0;
+  m_ctr[1] = tick;
+  m_ctr[2] = id;
+  m_ctr[3] = stream;
+  m_next = 4;
+}
+
+void philox_engine::refill()
+{
+  std::uint32_t c[4] = {m_ctr[0], m_ctr[1], m_ctr[2], m_ctr[3]};
+  std::uint32_t k[2] = {m_key[0], m_key[1]};
+  for (int round = 0; round < 10; round++)
+  {
+    std::uint32_t lo0, lo1;
+    const std::uint32_t hi0 = mulhilo(0xD2511F53, c[0], lo0);
+    const std::uint32_t hi1 = mulhilo(0xCD9E8D57, c[2], lo1);
+    c[0] = hi1 ^ c[1] ^ k[0];
+    c[1] = lo1;
+    c[2] = hi0 ^ c[3] ^ k[1];
+    c[3] = lo0;
+    k[0] += 0x9E3779B9;
+    k[1] += 0xBB67AE85;
+  }
+  std::copy(c, c + 4, m_out);
+  m_next = 0;
+
+  //Move on to the next block. (A stream has 2^32 blocks before it runs into
+  //the stream of the next tick.)
+  if (++m_ctr[0] == 0)
+    m_ctr[1]++;
+}
+
 our_random_engine &rand_engine()
 {
-  static our_random_engine e[PRNG_THREAD_MAX];
-  return e[omp_get_thread_num()];
+  return *current_engine;
 }
 
 //Be sure to read: http://www.pcg-random.org/posts/cpp-seeding-surprises.html
 //and http://www.pcg-random.org/posts/cpps-random_device.html
 void seed_rand(unsigned long seed)
 {
-#pragma omp parallel //All threads must come here
+  if (seed == 0)
   {
-#pragma omp critical //But only one at a time
-    if (seed == 0)
-    {
-      std::uint_least32_t seed_data[std::mt19937::state_size];
-      std::random_device r;
-      std::generate_n(seed_data, std::mt19937::state_size, std::ref(r));
-      std::seed_seq q(std::begin(seed_data), std::end(seed_data));
-      rand_engine().seed(q);
-    }
-    else
-      rand_engine().seed(seed * (1+omp_get_thread_num()));
+    std::random_device r;
+    global_seed = ((std::uint64_t)r() << 32) | r();
   }
+  else
+    global_seed = seed;
+
+#pragma omp parallel //All threads must come here
+  seed_default_engine();
+  //The calling thread might not be part of OpenMP's thread pool
+  seed_default_engine();
+}
+
+std::uint64_t get_rand_seed()
+{
+  return global_seed;
+}
+
+void set_rand_stream(const std::uint64_t seed, const std::uint32_t id,
+                     const std::uint32_t tick, const std::uint32_t stream)
+{
+  stream_engine.set_stream(seed, id, tick, stream);
+  current_engine = &stream_engine;
+}
+
+void reset_rand_stream()
+{
+  current_engine = &default_engine;
 }
 
 int uniform_rand_int(int from, int thru)
 {
-  static std::uniform_int_distribution<> d[PRNG_THREAD_MAX];
-  using parm_t = std::uniform_int_distribution<>::param_type;
-  return d[omp_get_thread_num()](rand_engine(), parm_t{from, thru});
+  //Lemire's nearly divisionless method: scale a 32-bit number to the range and
+  //reject the few values that would make the result biased
+  const std::uint64_t range = (std::int64_t)thru - from + 1;
+  our_random_engine &e = rand_engine();
+  if (range > std::numeric_limits<std::uint32_t>::max())
+    return (std::int64_t)from + e();
+  std::uint64_t m = (std::uint64_t)e() * range;
+  if ((std::uint32_t)m < range)
+  {
+    const std::uint32_t threshold = (std::uint32_t)(-(std::uint32_t)range) % (std::uint32_t)range;
+    while ((std::uint32_t)m < threshold)
+      m = (std::uint64_t)e() * range;
+  }
+  return (std::int64_t)from + (std::int64_t)(m >> 32);
 }
 
 double uniform_rand_real(double from, double thru)
 {
-  static std::uniform_real_distribution<> d[PRNG_THREAD_MAX];
-  using parm_t = std::uniform_real_distribution<>::param_type;
-  return d[omp_get_thread_num()](rand_engine(), parm_t{from, thru});
+  return from + (thru - from) * rand_unit(rand_engine());
 }
 
 double normal_rand(double mean, double stddev)
 {
-  static std::normal_distribution<double> d[PRNG_THREAD_MAX];
-  using parm_t = std::normal_distribution<double>::param_type;
-  return d[omp_get_thread_num()](rand_engine(), parm_t{mean, stddev});
-}
\ No newline at end of file
+  //Box-Muller transform. Only one of the pair of values is used, so that a
+  //draw never depends on an earlier one.
+  our_random_engine &e = rand_engine();
+  const double u1 = 1.0 - rand_unit(e); //In (0,1], so the log is finite
+  const double u2 = rand_unit(e);
+  return mean + stddev * std::sqrt(-2.0 * std::log(u1)) * std::cos(2 * M_PI * u2);
+}
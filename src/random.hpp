@@ -1,16 +1,19 @@
 //This file contains a number of functions for getting seeding random number
 //generators and pulling numbers from them in a thread-safe manner.
 
-//Note: This is a generaly poor way of getting pseudorandom numbers in parallel
-//since the sequences might be more correlated than would be expected by chance.
-//Nonetheless, it should be sufficient for most applications. Good parallel
-//PRNGs are rare, so this is probably not easily ameliorated.
+//Random numbers come from a counter-based generator (Philox4x32-10, from
+//Salmon et al., "Parallel Random Numbers: As Easy as 1, 2, 3", SC 2011).
+//Rather than carrying state from one number to the next, each block of random
+//numbers is a hash of a key (the seed) and a counter. This means that any
+//number of independent streams can be made by giving them different counters.
+//
+//The World gives every robot its own stream for every tick (see
+//set_rand_stream), so a robot draws the same numbers no matter which thread
+//runs it or how many threads there are. Outside of these streams, every thread
+//draws from its own default stream.
 #ifndef _prng_header
 #define _prng_header
 
-///Maximum number of threads this class should deal with
-#define PRNG_THREAD_MAX 32
-
 #ifdef _OPENMP
 #include <omp.h>
 #else
@@ -19,16 +22,65 @@
 #define omp_get_max_threads() 1
 #endif
 
+#include <cstdint>
+#include <limits>
 #include <random>
 
-typedef std::mt19937 our_random_engine;
+///Philox4x32-10 counter-based random number engine. This satisfies the
+///UniformRandomBitGenerator requirements, so it works with the standard
+///library's distributions.
+class philox_engine
+{
+public:
+  typedef std::uint32_t result_type;
+
+  static constexpr result_type min() { return 0; }
+  static constexpr result_type max() { return std::numeric_limits<result_type>::max(); }
+
+  ///Start the stream identified by (seed, id, tick, stream) at its beginning
+  void set_stream(std::uint64_t seed, std::uint32_t id, std::uint32_t tick,
+                  std::uint32_t stream);
+
+  ///Get the next 32 random bits from the stream
+  result_type operator()()
+  {
+    if (m_next == 4)
+      refill();
+    return m_out[m_next++];
+  }
+
+private:
+  std::uint32_t m_key[2] = {0, 0};
+  //Counter: block number, tick, id, and stream
+  std::uint32_t m_ctr[4] = {0, 0, 0, 0};
+  //Output of the last block and how much of it has been used
+  std::uint32_t m_out[4];
+  unsigned int m_next = 4;
 
-//Returns a PRNG engine specific to the calling thread
+  void refill();
+};
+
+typedef philox_engine our_random_engine;
+
+//Returns the PRNG engine the calling thread should currently draw from
 our_random_engine &rand_engine();
 
-//Seeds the PRNG engines using entropy from the computer's random device
+//Seeds the default streams of all threads. If the seed is 0, a seed is chosen
+//using entropy from the computer's random device.
 void seed_rand(unsigned long seed);
 
+//Returns the seed set by seed_rand (or the one it chose if seeded with 0)
+std::uint64_t get_rand_seed();
+
+//Makes the calling thread draw from the stream identified by (seed, id, tick,
+//stream) until reset_rand_stream is called. The stream always starts from its
+//beginning, so the same arguments always give the same numbers.
+void set_rand_stream(std::uint64_t seed, std::uint32_t id, std::uint32_t tick,
+                     std::uint32_t stream);
+
+//Makes the calling thread go back to drawing from its default stream
+void reset_rand_stream();
+
 //Returns an integer value on the closed interval [from,thru]
 //Thread-safe
 int uniform_rand_int(int from, int thru);